@@ -0,0 +1,604 @@
+/* ftdi_bench.c
+
+   Measure the throughput, latency and cost of the data paths
+
+   Sweeps chip modes, chunk sizes and latency timer settings and measures
+   for each combination the sustained TX and RX throughput, the CPU time
+   per MB and the number of bulk transfers needed, plus the percentiles of
+   request/response round trips.
+
+   RX and round trips need the data to come back. Synchronous bitbang
+   and MPSSE (internal loopback) do that on their own, UART and
+   synchronous FIFO mode need an external loopback, announce it with -x.
+   The emulated device (-e) loops back everything but has no MPSSE engine.
+
+   This program is distributed under the GPL, version 2
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <ftdi.h>
+
+#define MAX_LIST 16
+
+enum { MODE_UART, MODE_BITBANG, MODE_MPSSE, MODE_FIFO, MODE_COUNT };
+static const char *mode_names[MODE_COUNT] = { "uart", "bitbang", "mpsse", "fifo" };
+
+static const char *type_names[] = { "am", "bm", "2232c", "r", "2232h", "4232h", "232h", "230x" };
+
+struct bench_options
+{
+    int baudrate;
+    int size;
+    int samples;
+    int loopback;
+    int emulated;
+    int json;
+};
+
+struct bench_result
+{
+    const char *error;
+    double mb_s;
+    double cpu_ms_per_mb;
+    unsigned long transfers;
+};
+
+struct bench_latency
+{
+    const char *error;
+    double p50;
+    double p99;
+    double p999;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double cpu_time(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + 1e-6 * ru.ru_utime.tv_usec +
+           ru.ru_stime.tv_sec + 1e-6 * ru.ru_stime.tv_usec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Comma separated numbers, returns how many were found */
+static int parse_list(const char *arg, int *list)
+{
+    char *end;
+    int count = 0;
+
+    while (*arg && count < MAX_LIST)
+    {
+        list[count++] = strtol(arg, &end, 0);
+        if (end == arg)
+            return 0;
+        arg = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+static int parse_modes(const char *arg, int *modes)
+{
+    int count = 0, i;
+
+    while (*arg && count < MAX_LIST)
+    {
+        size_t len = strcspn(arg, ",");
+
+        for (i = 0; i < MODE_COUNT; i++)
+            if (strlen(mode_names[i]) == len && strncmp(arg, mode_names[i], len) == 0)
+                break;
+        if (i == MODE_COUNT)
+            return 0;
+        modes[count++] = i;
+        arg += len;
+        if (*arg == ',')
+            arg++;
+    }
+    return count;
+}
+
+/* Why a mode can't be measured, NULL if it can */
+static const char *mode_unsupported(struct ftdi_context *ftdi, int mode,
+                                    const struct bench_options *opt)
+{
+    if (mode == MODE_MPSSE && opt->emulated)
+        return "the emulated device has no MPSSE engine";
+    if (mode == MODE_MPSSE && ftdi->type != TYPE_2232C && ftdi->type != TYPE_2232H &&
+        ftdi->type != TYPE_4232H && ftdi->type != TYPE_232H)
+        return "chip has no MPSSE engine";
+    if (mode == MODE_FIFO && ftdi->type != TYPE_2232H && ftdi->type != TYPE_232H)
+        return "chip has no synchronous FIFO mode";
+    return NULL;
+}
+
+/* Whether written data comes back to be read */
+static int mode_loops_back(int mode, const struct bench_options *opt)
+{
+    return opt->emulated || opt->loopback || mode == MODE_BITBANG || mode == MODE_MPSSE;
+}
+
+/* Put the chip into the mode. With duplex set, everything written
+   comes back, otherwise it only goes out */
+static int setup_mode(struct ftdi_context *ftdi, int mode, int duplex,
+                      const struct bench_options *opt)
+{
+    unsigned char mpsse_init[] = { LOOPBACK_START, TCK_DIVISOR, 0x00, 0x00, DIS_DIV_5 };
+    int ret = ftdi_set_bitmode(ftdi, 0, BITMODE_RESET);
+
+    if (ret < 0)
+        return ret;
+
+    switch (mode)
+    {
+        case MODE_UART:
+            ret = ftdi_set_baudrate(ftdi, opt->baudrate);
+            break;
+        case MODE_BITBANG:
+            ret = ftdi_set_bitmode(ftdi, 0xff, duplex ? BITMODE_SYNCBB : BITMODE_BITBANG);
+            if (ret >= 0)
+                ret = ftdi_set_baudrate(ftdi, opt->baudrate);
+            break;
+        case MODE_MPSSE:
+            ret = ftdi_set_bitmode(ftdi, 0, BITMODE_MPSSE);
+            // only the H chips know about the clock divide by 5
+            if (ret >= 0)
+                ret = ftdi_write_data(ftdi, mpsse_init,
+                                      sizeof(mpsse_init) - (ftdi->type == TYPE_2232C));
+            break;
+        case MODE_FIFO:
+            ret = ftdi_set_bitmode(ftdi, 0xff, BITMODE_SYNCFF);
+            break;
+    }
+
+    if (ret >= 0)
+        ret = ftdi_tcioflush(ftdi);
+    return ret;
+}
+
+/* What to write for size bytes of payload. MPSSE wraps the payload
+   in clock out commands, which read back the bits if read is set */
+static int encode(int mode, int read, const unsigned char *src, int size, unsigned char *dst)
+{
+    int len = 0;
+
+    if (mode != MODE_MPSSE)
+    {
+        memcpy(dst, src, size);
+        return size;
+    }
+
+    while (size > 0)
+    {
+        int block = (size > 65536) ? 65536 : size;
+
+        dst[len++] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG | (read ? MPSSE_DO_READ : 0);
+        dst[len++] = (block - 1) & 0xff;
+        dst[len++] = (block - 1) >> 8;
+        memcpy(dst + len, src, block);
+        len += block;
+        src += block;
+        size -= block;
+    }
+    if (read)
+        dst[len++] = SEND_IMMEDIATE;
+    return len;
+}
+
+static void account(struct bench_result *res, int size, double seconds, double cpu,
+                    unsigned long transfers)
+{
+    res->mb_s = size / seconds / 1e6;
+    res->cpu_ms_per_mb = cpu * 1000 / (size / 1e6);
+    res->transfers = transfers;
+}
+
+static void run_tx(struct ftdi_context *ftdi, int mode, const struct bench_options *opt,
+                   const unsigned char *src, unsigned char *wire, struct bench_result *res)
+{
+    int len = encode(mode, 0, src, opt->size, wire);
+    unsigned long transfers;
+    double start, cpu;
+
+    memset(res, 0, sizeof(*res));
+    if (setup_mode(ftdi, mode, 0, opt) < 0)
+    {
+        res->error = ftdi_get_error_string(ftdi);
+        return;
+    }
+
+    transfers = ftdi->bulk_out_transfers;
+    cpu = cpu_time();
+    start = now();
+    if (ftdi_write_data(ftdi, wire, len) != len)
+    {
+        res->error = ftdi_get_error_string(ftdi);
+        return;
+    }
+    account(res, opt->size, now() - start, cpu_time() - cpu,
+            ftdi->bulk_out_transfers - transfers);
+
+    // drop what came back
+    ftdi_tcioflush(ftdi);
+}
+
+static void run_rx(struct ftdi_context *ftdi, int mode, const struct bench_options *opt,
+                   const unsigned char *src, unsigned char *wire, unsigned char *dst,
+                   struct bench_result *res)
+{
+    int len = encode(mode, 1, src, opt->size, wire);
+    struct ftdi_transfer_control *tc;
+    unsigned long transfers;
+    double start, last, cpu;
+    int got = 0, written;
+
+    memset(res, 0, sizeof(*res));
+    if (!mode_loops_back(mode, opt))
+    {
+        res->error = "needs an external loopback (-x)";
+        return;
+    }
+    if (setup_mode(ftdi, mode, 1, opt) < 0)
+    {
+        res->error = ftdi_get_error_string(ftdi);
+        return;
+    }
+
+    transfers = ftdi->bulk_in_transfers;
+    cpu = cpu_time();
+    start = last = now();
+
+    // keep the chip busy while reading
+    tc = ftdi_write_data_submit(ftdi, wire, len);
+    if (tc == NULL)
+    {
+        res->error = ftdi_get_error_string(ftdi);
+        return;
+    }
+    while (got < opt->size)
+    {
+        int ret = ftdi_read_data(ftdi, dst + got, opt->size - got);
+
+        if (ret < 0)
+            break;
+        if (ret > 0)
+        {
+            got += ret;
+            last = now();
+        }
+        else if (now() - last > 2.0)
+            break;
+    }
+    written = ftdi_transfer_data_done(tc);
+    account(res, opt->size, now() - start, cpu_time() - cpu,
+            ftdi->bulk_in_transfers - transfers);
+
+    if (written != len)
+        res->error = "write failed";
+    else if (got != opt->size)
+        res->error = "the data didn't come back";
+    // synchronous bitbang reads the pins before they change
+    else if (mode != MODE_BITBANG && memcmp(src, dst, opt->size) != 0)
+        res->error = "the data came back corrupted";
+}
+
+static void run_latency(struct ftdi_context *ftdi, int mode, const struct bench_options *opt,
+                        struct bench_latency *lat)
+{
+    unsigned char request[] = { MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_DO_READ,
+                                0x00, 0x00, 0x5a, SEND_IMMEDIATE };
+    unsigned char response;
+    double *samples;
+    int i;
+
+    memset(lat, 0, sizeof(*lat));
+    if (!mode_loops_back(mode, opt))
+    {
+        lat->error = "needs an external loopback (-x)";
+        return;
+    }
+    if (setup_mode(ftdi, mode, 1, opt) < 0)
+    {
+        lat->error = ftdi_get_error_string(ftdi);
+        return;
+    }
+
+    samples = malloc(opt->samples * sizeof(*samples));
+    if (samples == NULL)
+    {
+        lat->error = "out of memory";
+        return;
+    }
+
+    for (i = 0; i < opt->samples; i++)
+    {
+        double start = now();
+        int ret;
+
+        if (mode == MODE_MPSSE)
+            ret = ftdi_transact(ftdi, request, sizeof(request), &response, 1);
+        else
+            ret = ftdi_transact(ftdi, request + 3, 1, &response, 1);
+        if (ret != 1)
+        {
+            lat->error = "no response";
+            free(samples);
+            return;
+        }
+        samples[i] = (now() - start) * 1e6;
+    }
+
+    // nearest rank
+    qsort(samples, opt->samples, sizeof(*samples), compare_double);
+    lat->p50 = samples[(opt->samples * 500 + 999) / 1000 - 1];
+    lat->p99 = samples[(opt->samples * 990 + 999) / 1000 - 1];
+    lat->p999 = samples[(opt->samples * 999 + 999) / 1000 - 1];
+    free(samples);
+}
+
+static void print_result_json(const char *name, const struct bench_result *res)
+{
+    if (res->error)
+        printf("\"%s\": {\"error\": \"%s\"}", name, res->error);
+    else
+        printf("\"%s\": {\"mb_per_s\": %.3f, \"cpu_ms_per_mb\": %.3f, \"transfers\": %lu}",
+               name, res->mb_s, res->cpu_ms_per_mb, res->transfers);
+}
+
+static void print_result_text(const struct bench_result *res)
+{
+    if (res->error)
+        printf(" %-30.30s", res->error);
+    else
+        printf(" %9.2f %9.2f %10lu", res->mb_s, res->cpu_ms_per_mb, res->transfers);
+}
+
+int main(int argc, char **argv)
+{
+    struct ftdi_context *ftdi;
+    struct bench_options opt;
+    int modes[MAX_LIST] = { MODE_UART, MODE_BITBANG, MODE_MPSSE, MODE_FIFO };
+    int chunks[MAX_LIST] = { 4096, 16384, 65536 };
+    int latencies[MAX_LIST] = { 1, 16 };
+    int nmodes = 4, nchunks = 3, nlatencies = 2;
+    int vid = 0x0403, pid = 0x6010;
+    int interface = INTERFACE_ANY;
+    const char *emulated = NULL;
+    unsigned char *src = NULL, *wire = NULL, *dst = NULL;
+    int first = 1;
+    int m, l, c, i;
+    int retval = EXIT_FAILURE;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.baudrate = 3000000;
+    opt.size = 1 << 20;
+    opt.samples = 200;
+
+    while ((i = getopt(argc, argv, "v:p:i:e:m:c:l:s:n:b:xj")) != -1)
+    {
+        switch (i)
+        {
+            case 'v':
+                vid = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                pid = strtoul(optarg, NULL, 0);
+                break;
+            case 'i': // 0=ANY, 1=A, 2=B, 3=C, 4=D
+                interface = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                emulated = optarg;
+                break;
+            case 'm':
+                nmodes = parse_modes(optarg, modes);
+                break;
+            case 'c':
+                nchunks = parse_list(optarg, chunks);
+                break;
+            case 'l':
+                nlatencies = parse_list(optarg, latencies);
+                break;
+            case 's':
+                opt.size = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                opt.samples = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                opt.baudrate = strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                opt.loopback = 1;
+                break;
+            case 'j':
+                opt.json = 1;
+                break;
+            default:
+                nmodes = 0;
+                break;
+        }
+    }
+
+    if (nmodes == 0 || nchunks == 0 || nlatencies == 0 || opt.size <= 0 || opt.samples <= 0)
+    {
+        fprintf(stderr, "usage: %s [-v vid] [-p pid] [-i interface] [-e chip] [-m modes]\n"
+                "       [-c chunksizes] [-l latencies] [-s size] [-n samples] [-b baudrate] [-x] [-j]\n"
+                "  -e chip        use the emulated device (am, bm, 2232c, r, 2232h, 4232h, 232h, 230x)\n"
+                "  -m modes       comma separated: uart,bitbang,mpsse,fifo (default all)\n"
+                "  -c chunksizes  comma separated read/write chunk sizes (default 4096,16384,65536)\n"
+                "  -l latencies   comma separated latency timer values in ms (default 1,16)\n"
+                "  -s size        bytes per throughput run (default 1 MiB)\n"
+                "  -n samples     round trips per latency run (default 200)\n"
+                "  -b baudrate    for UART and bitbang modes (default 3000000)\n"
+                "  -x             UART and FIFO data is looped back externally\n"
+                "  -j             JSON output\n", *argv);
+        return EXIT_FAILURE;
+    }
+
+    if ((ftdi = ftdi_new()) == 0)
+    {
+        fprintf(stderr, "ftdi_new failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (emulated)
+    {
+        for (i = 0; i < (int)(sizeof(type_names) / sizeof(type_names[0])); i++)
+            if (strcmp(emulated, type_names[i]) == 0)
+                break;
+        if (i == (int)(sizeof(type_names) / sizeof(type_names[0])) ||
+            ftdi_usb_open_emulated(ftdi, (enum ftdi_chip_type)i, 1) < 0)
+        {
+            fprintf(stderr, "Can't emulate chip \"%s\"\n", emulated);
+            goto do_deinit;
+        }
+        opt.emulated = 1;
+    }
+    else
+    {
+        if (ftdi_set_interface(ftdi, interface) < 0)
+        {
+            fprintf(stderr, "ftdi_set_interface failed: %s\n", ftdi_get_error_string(ftdi));
+            goto do_deinit;
+        }
+        if (ftdi_usb_open(ftdi, vid, pid) < 0)
+        {
+            fprintf(stderr, "Can't open ftdi device: %s\n", ftdi_get_error_string(ftdi));
+            goto do_deinit;
+        }
+    }
+
+    src = malloc(opt.size);
+    dst = malloc(opt.size);
+    wire = malloc(opt.size + 3 * (opt.size / 65536 + 1) + 1);
+    if (src == NULL || dst == NULL || wire == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        goto do_close;
+    }
+    for (i = 0; i < opt.size; i++)
+        src[i] = i * 7 + i / 251;
+
+    if (opt.json)
+        printf("{\"chip\": \"%s\", \"emulated\": %s, \"max_packet_size\": %d, "
+               "\"size\": %d, \"samples\": %d, \"results\": [",
+               type_names[ftdi->type], opt.emulated ? "true" : "false",
+               ftdi->max_packet_size, opt.size, opt.samples);
+    else
+        printf("chip %s%s, max packet size %d, %d bytes per run, %d round trips\n\n"
+               "%-8s %3s %6s | %9s %9s %10s | %9s %9s %10s | %9s %9s %9s\n",
+               type_names[ftdi->type], opt.emulated ? " (emulated)" : "",
+               ftdi->max_packet_size, opt.size, opt.samples,
+               "mode", "lat", "chunk", "TX MB/s", "CPU ms/MB", "transfers",
+               "RX MB/s", "CPU ms/MB", "transfers", "p50 us", "p99 us", "p99.9 us");
+
+    for (m = 0; m < nmodes; m++)
+    {
+        const char *unsupported = mode_unsupported(ftdi, modes[m], &opt);
+
+        if (unsupported)
+        {
+            if (opt.json)
+                printf("%s\n  {\"mode\": \"%s\", \"error\": \"%s\"}", first ? "" : ",",
+                       mode_names[modes[m]], unsupported);
+            else
+                printf("%-8s skipped, %s\n", mode_names[modes[m]], unsupported);
+            first = 0;
+            continue;
+        }
+
+        for (l = 0; l < nlatencies; l++)
+        {
+            struct bench_latency lat;
+
+            if (ftdi_set_latency_timer(ftdi, latencies[l]) < 0)
+            {
+                fprintf(stderr, "Can't set latency timer %d: %s\n", latencies[l],
+                        ftdi_get_error_string(ftdi));
+                goto do_close;
+            }
+            run_latency(ftdi, modes[m], &opt, &lat);
+
+            if (opt.json)
+            {
+                printf("%s\n  {\"mode\": \"%s\", \"latency_timer\": %d, ", first ? "" : ",",
+                       mode_names[modes[m]], latencies[l]);
+                if (lat.error)
+                    printf("\"round_trip_us\": {\"error\": \"%s\"}, ", lat.error);
+                else
+                    printf("\"round_trip_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, ",
+                           lat.p50, lat.p99, lat.p999);
+                printf("\"chunks\": [");
+            }
+            first = 0;
+
+            for (c = 0; c < nchunks; c++)
+            {
+                struct bench_result tx, rx;
+
+                ftdi_read_data_set_chunksize(ftdi, chunks[c]);
+                ftdi_write_data_set_chunksize(ftdi, chunks[c]);
+                run_tx(ftdi, modes[m], &opt, src, wire, &tx);
+                run_rx(ftdi, modes[m], &opt, src, wire, dst, &rx);
+
+                if (opt.json)
+                {
+                    printf("%s\n    {\"chunk_size\": %d, ", c ? "," : "", chunks[c]);
+                    print_result_json("tx", &tx);
+                    printf(", ");
+                    print_result_json("rx", &rx);
+                    printf("}");
+                    continue;
+                }
+
+                printf("%-8s %3d %6d |", mode_names[modes[m]], latencies[l], chunks[c]);
+                print_result_text(&tx);
+                printf(" |");
+                print_result_text(&rx);
+                if (lat.error)
+                    printf(" | %s\n", lat.error);
+                else
+                    printf(" | %9.1f %9.1f %9.1f\n", lat.p50, lat.p99, lat.p999);
+            }
+
+            if (opt.json)
+                printf("]}");
+        }
+    }
+
+    if (opt.json)
+        printf("\n]}\n");
+    retval = EXIT_SUCCESS;
+
+do_close:
+    free(src);
+    free(dst);
+    free(wire);
+    ftdi_usb_close(ftdi);
+do_deinit:
+    ftdi_free(ftdi);
+
+    return retval;
+}
@@ -1,8 +1,8 @@
 /* stream_test.c
  *
- * Test reading  from FT2232H in synchronous FIFO mode.
+ * Test reading from and writing to FT2232H in synchronous FIFO mode.
  *
- * The FT2232H must supply data due to an appropriate circuit
+ * When reading, the FT2232H must supply data due to an appropriate circuit
  *
  * To check for skipped block with appended code, 
  *     a structure as follows is assumed
@@ -24,17 +24,6 @@
 #include <signal.h>
 #include <errno.h>
 #include <ftdi.h>
-#include <libusb.h>
-
-typedef struct
-{
-    FTDIStreamCallback *callback;
-    void *userdata;
-    int packetsize;
-    int activity;
-    int result;
-    FTDIProgressInfo progress;
-} FTDIStreamState;
 
 static FILE *outputFile;
 static FILE *inputFile;
@@ -63,7 +52,7 @@ usage(const char *argv0)
 {
    fprintf(stderr,
            "Usage: %s [options...] \n"
-           "Test streaming read from FT2232H\n"
+           "Test streaming read from or write to FT2232H\n"
            "[-P string] only look for product with given string\n"
 	   "[-r] read data from file, write to FT (default: vice-versa)\n"
            "\n"
@@ -80,114 +69,70 @@ usage(const char *argv0)
 }
 
 static uint32_t n_err = 0;
+
+static void
+print_progress(FTDIProgressInfo *progress)
+{
+   fprintf(stderr, "%10.02fs total time %9.3f MiB transferred %7.1f kB/s curr rate %7.1f kB/s totalrate %d dropouts\n",
+           progress->totalTime,
+           progress->current.totalBytes / (1024.0 * 1024.0),
+           progress->currentRate / 1024.0,
+           progress->totalRate / 1024.0,
+           n_err);
+}
+
 static int
 callback(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
 {
-   if (length)
+   if (length && outputFile)
    {
-       if (outputFile)
-       {
-           if (fwrite(buffer, length, 1, outputFile) != 1)
-           {
-               perror("Write error");
-               return 1;
-           }
-       }
-       if (inputFile)
+       if (fwrite(buffer, length, 1, outputFile) != 1)
        {
-           if (feof(inputFile)) {
-               fseek (inputFile , 0 , SEEK_SET );
-           }
-    
-           int len = fread(buffer, 1, length, inputFile);
-           if (len < 1){
-                   fprintf(stderr, "read %d of %d\n", len, length);
-                   perror("File read error");
-                   return 1;
-           } else {
-    //           perror("File read OK");
-           }
-       }
+           perror("Write error");
+           return 1;
        }
-   if (progress)
-   {
-       fprintf(stderr, "%10.02fs total time %9.3f MiB transferred %7.1f kB/s curr rate %7.1f kB/s totalrate %d dropouts\n",
-               progress->totalTime,
-               progress->current.totalBytes / (1024.0 * 1024.0),
-               progress->currentRate / 1024.0,
-               progress->totalRate / 1024.0,
-               n_err);
    }
+   if (progress)
+       print_progress(progress);
    return exitRequested ? 1 : 0;
 }
 
-static double
-TimevalDiff(const struct timeval *a, const struct timeval *b)
-{
-    return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
-}
-
-static void LIBUSB_CALL
-ftdi_stream_cb(struct libusb_transfer *transfer)
+static int
+write_callback(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
 {
-    FTDIStreamState *state = transfer->user_data;
-    int packet_size = state->packetsize;
-
-    state->activity++;
-    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
-    {
-        int i;
-        uint8_t *ptr = transfer->buffer;
-        int length = transfer->actual_length;
-        int numPackets = (length + packet_size - 1) / packet_size;
-        int res = 0;
-
-        for (i = 0; i < numPackets; i++)
-        {
-            int payloadLen;
-            int packetLen = length;
+   int len;
 
-            if (packetLen > packet_size)
-                packetLen = packet_size;
-
-            payloadLen = packetLen - 2;
-            state->progress.current.totalBytes += payloadLen;
-
-            res = state->callback(ptr, payloadLen,
-                                  NULL, state->userdata);
+   if (progress)
+   {
+       print_progress(progress);
+       return exitRequested ? -1 : 0;
+   }
+   if (exitRequested)
+       return -1;
+   if (!inputFile)
+   {
+       memset(buffer, 0, length);
+       return length;
+   }
 
-            ptr += packetLen;
-            length -= packetLen;
-        }
-        if (res)
-        {
-            free(transfer->buffer);
-            libusb_free_transfer(transfer);
-        }
-        else
-        {
-            transfer->status = -1;
-            state->result = libusb_submit_transfer(transfer);
-        }
-    }
-    else
-    {
-        fprintf(stderr, "unknown status %d\n",transfer->status);
-        state->result = LIBUSB_ERROR_IO;
-    }
+   len = fread(buffer, 1, length, inputFile);
+   if (len < 1 && feof(inputFile))
+   {
+       // send the file over and over again
+       fseek(inputFile, 0, SEEK_SET);
+       len = fread(buffer, 1, length, inputFile);
+   }
+   if (len < 1)
+   {
+       perror("File read error");
+       return -1;
+   }
+   return len;
 }
 
-int
-ftdi_stream(struct ftdi_context *ftdi,
-                FTDIStreamCallback *callback, void *userdata,
-                int packetsPerTransfer, int numTransfers)
+static int
+stream_write(struct ftdi_context *ftdi)
 {
-    struct libusb_transfer **transfers;
-    FTDIStreamState state = { callback, userdata, ftdi->max_packet_size, 1 };
-    int bufferSize = packetsPerTransfer * ftdi->max_packet_size;
-    int xferIndex;
-    int err = 0;
-
     /* Only FT2232H and FT232H know about the synchronous FIFO Mode*/
     if ((ftdi->type != TYPE_2232H) && (ftdi->type != TYPE_232H))
     {
@@ -209,128 +154,14 @@ ftdi_stream(struct ftdi_context *ftdi,
         return 1;
     }
 
-    /*
-     * Set up all transfers
-     */
-
-    transfers = calloc(numTransfers, sizeof *transfers);
-    if (!transfers)
-    {
-        err = LIBUSB_ERROR_NO_MEM;
-        goto cleanup;
-    }
-
-    for (xferIndex = 0; xferIndex < numTransfers; xferIndex++)
-    {
-        struct libusb_transfer *transfer;
-
-        transfer = libusb_alloc_transfer(0);
-        transfers[xferIndex] = transfer;
-        if (!transfer)
-        {
-            err = LIBUSB_ERROR_NO_MEM;
-            goto cleanup;
-        }
-
-        libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, 
-                                  (mode == WRITE) ? ftdi->out_ep : ftdi->in_ep,
-                                  //TODO: don't send empty buffers in first batch
-                                  malloc(bufferSize), bufferSize,
-                                  ftdi_stream_cb,
-                                  &state, 0);
-
-        if (!transfer->buffer)
-        {
-            err = LIBUSB_ERROR_NO_MEM;
-            goto cleanup;
-        }
-
-        transfer->status = -1;
-        err = libusb_submit_transfer(transfer);
-        if (err)
-            goto cleanup;
-    }
-
-    /* Start the transfers only when everything has been set up.
-     * Otherwise the transfers start stuttering and the PC not
-     * fetching data for several to several ten milliseconds
-     * and we skip blocks
-     */
     if (ftdi_set_bitmode(ftdi,  0xff, BITMODE_SYNCFF) < 0)
     {
         fprintf(stderr,"Can't set synchronous fifo mode: %s\n",
                 ftdi_get_error_string(ftdi));
-        goto cleanup;
+        return 1;
     }
 
-    /*
-     * Run the transfers, and periodically assess progress.
-     */
-
-    gettimeofday(&state.progress.first.time, NULL);
-
-    do
-    {
-        FTDIProgressInfo  *progress = &state.progress;
-        const double progressInterval = 1.0;
-        struct timeval timeout = { 0, ftdi->usb_read_timeout * 1000};
-        struct timeval now;
-
-        int err = libusb_handle_events_timeout(ftdi->usb_ctx, &timeout);
-        if (err ==  LIBUSB_ERROR_INTERRUPTED)
-            /* restart interrupted events */
-            err = libusb_handle_events_timeout(ftdi->usb_ctx, &timeout);
-        if (!state.result)
-        {
-            state.result = err;
-        }
-        if (state.activity == 0)
-            state.result = 1;
-        else
-            state.activity = 0;
-
-        // If enough time has elapsed, update the progress
-        gettimeofday(&now, NULL);
-        if (TimevalDiff(&now, &progress->current.time) >= progressInterval)
-        {
-            progress->current.time = now;
-            progress->totalTime = TimevalDiff(&progress->current.time,
-                                              &progress->first.time);
-
-            if (progress->prev.totalBytes)
-            {
-                // We have enough information to calculate rates
-
-                double currentTime;
-
-                currentTime = TimevalDiff(&progress->current.time,
-                                          &progress->prev.time);
-
-                progress->totalRate =
-                    progress->current.totalBytes /progress->totalTime;
-                progress->currentRate =
-                    (progress->current.totalBytes -
-                     progress->prev.totalBytes) / currentTime;
-            }
-
-            state.callback(NULL, 0, progress, state.userdata);
-            progress->prev = progress->current;
-
-        }
-    } while (!state.result);
-
-    /*
-     * Cancel any outstanding transfers, and free memory.
-     */
-
-cleanup:
-    fprintf(stderr, "cleanup\n");
-    if (transfers)
-        free(transfers);
-    if (err)
-        return err;
-    else
-        return state.result;
+    return ftdi_writestream(ftdi, write_callback, NULL, 8, 256);
 }
 
 
@@ -426,7 +257,10 @@ int main(int argc, char **argv)
    }
    signal(SIGINT, sigintHandler);
    
-   err = ftdi_stream(ftdi, callback, NULL, 8, 256);
+   if (mode == READ)
+       err = stream_write(ftdi);
+   else
+       err = ftdi_readstream(ftdi, callback, NULL, 8, 256);
    if (err < 0 && !exitRequested)
        exit(1);
    
@@ -131,6 +131,28 @@ int Context::open(struct libusb_device *dev)
     return get_strings_and_reopen();
 }
 
+int Context::open_emulated(enum ftdi_chip_type type, bool loopback)
+{
+    int ret = ftdi_usb_open_emulated(d->ftdi, type, loopback);
+
+    if (ret < 0)
+       return ret;
+
+    d->open = true;
+    return ret;
+}
+
+int Context::open_replay(const std::string& filename, double speed)
+{
+    int ret = ftdi_usb_open_replay(d->ftdi, filename.c_str(), speed);
+
+    if (ret < 0)
+       return ret;
+
+    d->open = true;
+    return ret;
+}
+
 int Context::close()
 {
     d->open = false;
@@ -246,6 +268,16 @@ int Context::read(unsigned char *buf, int size)
     return ftdi_read_data(d->ftdi, buf, size);
 }
 
+int Context::read_blocking(unsigned char *buf, int size, int vmin, int vtime)
+{
+    return ftdi_read_data_blocking(d->ftdi, buf, size, vmin, vtime);
+}
+
+int Context::read_until(unsigned char *buf, int size, const unsigned char *delims, int num_delims, int timeout)
+{
+    return ftdi_read_data_until(d->ftdi, buf, size, delims, num_delims, timeout);
+}
+
 int Context::set_read_chunk_size(unsigned int chunksize)
 {
     return ftdi_read_data_set_chunksize(d->ftdi, chunksize);
@@ -260,11 +292,40 @@ int Context::read_chunk_size()
     return chunk;
 }
 
+int Context::set_read_ahead(int depth)
+{
+    return ftdi_read_data_set_readahead(d->ftdi, depth);
+}
+
+int Context::read_ahead()
+{
+    int depth = -1;
+    if (ftdi_read_data_get_readahead(d->ftdi, &depth) < 0)
+        return -1;
+
+    return depth;
+}
+
+int Context::set_read_adaptive(bool enable)
+{
+    return ftdi_read_data_set_adaptive(d->ftdi, enable ? 1 : 0);
+}
+
 int Context::write(const unsigned char *buf, int size)
 {
     return ftdi_write_data(d->ftdi, buf, size);
 }
 
+int Context::writev(const struct ftdi_iovec *iov, int iovcnt)
+{
+    return ftdi_write_datav(d->ftdi, iov, iovcnt);
+}
+
+int Context::transact(const unsigned char *wbuf, int wsize, unsigned char *rbuf, int rsize)
+{
+    return ftdi_transact(d->ftdi, wbuf, wsize, rbuf, rsize);
+}
+
 int Context::set_write_chunk_size(unsigned int chunksize)
 {
     return ftdi_write_data_set_chunksize(d->ftdi, chunksize);
@@ -279,6 +340,21 @@ int Context::write_chunk_size()
     return chunk;
 }
 
+int Context::set_write_queue_depth(int depth)
+{
+    return ftdi_write_data_set_queue_depth(d->ftdi, depth);
+}
+
+int Context::set_write_buffer(unsigned int size, int delay)
+{
+    return ftdi_write_data_set_buffer(d->ftdi, size, delay);
+}
+
+int Context::write_flush()
+{
+    return ftdi_write_data_flush(d->ftdi);
+}
+
 int Context::set_flow_control(int flowctrl)
 {
     return ftdi_setflowctrl(d->ftdi, flowctrl);
@@ -325,6 +401,13 @@ unsigned short Context::poll_modem_status()
     return status;
 }
 
+unsigned short Context::modem_status()
+{
+    unsigned short status = 0;
+    ftdi_get_modem_status(d->ftdi, &status);
+    return status;
+}
+
 int Context::set_event_char(unsigned char eventch, unsigned char enable)
 {
     return ftdi_set_event_char(d->ftdi, eventch, enable);
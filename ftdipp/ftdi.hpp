@@ -83,6 +83,8 @@ public:
     int open(int vendor, int product);
     int open(int vendor, int product, const std::string& description, const std::string& serial = std::string(), unsigned int index=0);
     int open(const std::string& description);
+    int open_emulated(enum ftdi_chip_type type, bool loopback = true);
+    int open_replay(const std::string& filename, double speed = 1.0);
     int close();
     int reset();
     int DEPRECATED(flush)(int mask = Input|Output);
@@ -101,11 +103,21 @@ public:
 
     /* I/O */
     int read(unsigned char *buf, int size);
+    int read_blocking(unsigned char *buf, int size, int vmin, int vtime);
+    int read_until(unsigned char *buf, int size, const unsigned char *delims, int num_delims, int timeout = 0);
     int write(const unsigned char *buf, int size);
+    int writev(const struct ftdi_iovec *iov, int iovcnt);
+    int transact(const unsigned char *wbuf, int wsize, unsigned char *rbuf, int rsize);
     int set_read_chunk_size(unsigned int chunksize);
     int set_write_chunk_size(unsigned int chunksize);
     int read_chunk_size();
+    int set_read_ahead(int depth);
+    int read_ahead();
+    int set_read_adaptive(bool enable);
     int write_chunk_size();
+    int set_write_queue_depth(int depth);
+    int set_write_buffer(unsigned int size, int delay = -1);
+    int write_flush();
 
     /* Async IO
     TODO: should wrap?
@@ -123,6 +135,7 @@ public:
     int set_rts(bool state);
 
     unsigned short poll_modem_status();
+    unsigned short modem_status();
     unsigned latency();
 
     /* BitBang mode */
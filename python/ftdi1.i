@@ -99,6 +99,8 @@ char * str2charp_size(PyObject* pyObj, int * size)
         free($1);
 %}
     int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size);
+    int ftdi_read_data_blocking(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                                int vmin, int vtime);
 %clear (unsigned char *buf, int size);
 
 %define ftdi_write_data_docstring
@@ -114,6 +116,15 @@ char * str2charp_size(PyObject* pyObj, int * size)
     int ftdi_write_data_get_chunksize(struct ftdi_context *ftdi, unsigned int *chunksize);
 %clear unsigned int *chunksize;
 
+%apply int *OUTPUT { int *depth };
+    int ftdi_read_data_get_readahead(struct ftdi_context *ftdi, int *depth);
+    int ftdi_write_data_get_queue_depth(struct ftdi_context *ftdi, int *depth);
+%clear int *depth;
+
+%apply int *OUTPUT { unsigned int *size };
+    int ftdi_read_data_get_transfer_size(struct ftdi_context *ftdi, unsigned int *size);
+%clear unsigned int *size;
+
 %define ftdi_read_pins_docstring
 "read_pins(context) -> (return_code, pins)"
 %enddef
@@ -130,6 +141,7 @@ char * str2charp_size(PyObject* pyObj, int * size)
 
 %apply short *OUTPUT { unsigned short *status };
     int ftdi_poll_modem_status(struct ftdi_context *ftdi, unsigned short *status);
+    int ftdi_get_modem_status(struct ftdi_context *ftdi, unsigned short *status);
 %clear unsigned short *status;
 
 %apply int *OUTPUT { int* value };
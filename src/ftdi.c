@@ -31,6 +31,8 @@
 
 #include <libusb.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,14 +43,6 @@
 #include "ftdi.h"
 #include "ftdi_version_i.h"
 
-#define ftdi_error_return(code, str) do {  \
-        if ( ftdi )                        \
-            ftdi->error_str = str;         \
-        else                               \
-            fprintf(stderr, str);          \
-        return code;                       \
-   } while(0);
-
 #define ftdi_error_return_free_device_list(code, str, devs) do {    \
         libusb_free_device_list(devs,1);   \
         ftdi->error_str = str;             \
@@ -56,6 +50,77 @@
    } while(0);
 
 
+/* libusb transport, the default one */
+static int ftdi_libusb_control_transfer(struct ftdi_context *ftdi, int request_type,
+                                        int request, int value, int index,
+                                        unsigned char *data, int length, int timeout)
+{
+    return libusb_control_transfer(ftdi->usb_dev, request_type, request, value, index,
+                                   data, length, timeout);
+}
+
+/**
+    Internal function to account a bulk transfer to the statistics
+    \internal
+*/
+void ftdi_count_transfer(struct ftdi_context *ftdi, int endpoint)
+{
+    if (endpoint & LIBUSB_ENDPOINT_IN)
+        ftdi->bulk_in_transfers++;
+    else
+        ftdi->bulk_out_transfers++;
+}
+
+static int ftdi_libusb_bulk_transfer(struct ftdi_context *ftdi, int endpoint,
+                                     unsigned char *data, int length,
+                                     int *transferred, int timeout)
+{
+    ftdi_count_transfer(ftdi, endpoint);
+    return libusb_bulk_transfer(ftdi->usb_dev, endpoint, data, length,
+                                transferred, timeout);
+}
+
+static int ftdi_libusb_submit_transfer(struct ftdi_context *ftdi,
+                                       struct libusb_transfer *transfer)
+{
+    ftdi_count_transfer(ftdi, transfer->endpoint);
+    return libusb_submit_transfer(transfer);
+}
+
+static int ftdi_libusb_cancel_transfer(struct ftdi_context *ftdi,
+                                       struct libusb_transfer *transfer)
+{
+    (void) ftdi;
+    return libusb_cancel_transfer(transfer);
+}
+
+static int ftdi_libusb_handle_events(struct ftdi_context *ftdi, struct timeval *tv,
+                                     int *completed)
+{
+    return libusb_handle_events_timeout_completed(ftdi->usb_ctx, tv, completed);
+}
+
+static int ftdi_libusb_release_interface(struct ftdi_context *ftdi)
+{
+    return libusb_release_interface(ftdi->usb_dev, ftdi->interface);
+}
+
+static void ftdi_libusb_close(struct ftdi_context *ftdi)
+{
+    libusb_close(ftdi->usb_dev);
+}
+
+const struct ftdi_backend ftdi_libusb_backend =
+{
+    ftdi_libusb_control_transfer,
+    ftdi_libusb_bulk_transfer,
+    ftdi_libusb_submit_transfer,
+    ftdi_libusb_cancel_transfer,
+    ftdi_libusb_handle_events,
+    ftdi_libusb_release_interface,
+    ftdi_libusb_close
+};
+
 /**
     Internal function to close usb device pointer.
     Sets ftdi->usb_dev to NULL.
@@ -69,8 +134,14 @@ static void ftdi_usb_close_internal (struct ftdi_context *ftdi)
 {
     if (ftdi && ftdi->usb_dev)
     {
-        libusb_close (ftdi->usb_dev);
+        ftdi_reader_stop(ftdi);
+        ftdi_readahead_stop(ftdi);
+        ftdi->write_buffer_used = 0;
+        ftdi_transport_lock(ftdi);
+        ftdi->backend->close(ftdi);
         ftdi->usb_dev = NULL;
+        ftdi->backend = &ftdi_libusb_backend;
+        ftdi_transport_unlock(ftdi);
         if(ftdi->eeprom)
             ftdi->eeprom->initialized_for_connected_device = 0;
     }
@@ -107,6 +178,30 @@ int ftdi_init(struct ftdi_context *ftdi)
     ftdi->max_packet_size = 0;
     ftdi->error_str = NULL;
     ftdi->module_detach_mode = AUTO_DETACH_SIO_MODULE;
+    ftdi->modem_status = 0;
+    ftdi->read_total = 0;
+    ftdi->status_events_first = 0;
+    ftdi->status_events_count = 0;
+    ftdi->readahead = NULL;
+    ftdi->reader = NULL;
+    ftdi->read_adaptive = 0;
+    ftdi->read_transfer_size = 0;
+    ftdi->read_fill_avg = 0;
+    ftdi->write_queue_depth = 1;
+    ftdi->write_buffer = NULL;
+    ftdi->write_buffer_size = 0;
+    ftdi->write_buffer_used = 0;
+    ftdi->write_buffer_delay = -1;
+    ftdi->tc_pool = NULL;
+    ftdi->tc_pool_count = 0;
+    ftdi->tc_pool_size = 8;
+    ftdi->event_loop = NULL;
+    ftdi->state_lock = NULL;
+    ftdi->backend = &ftdi_libusb_backend;
+    ftdi->backend_data = NULL;
+    ftdi->bulk_in_transfers = 0;
+    ftdi->bulk_out_transfers = 0;
+    ftdi->capture = NULL;
 
     if (libusb_init(&ftdi->usb_ctx) < 0)
         ftdi_error_return(-3, "libusb_init() failed");
@@ -224,6 +319,11 @@ void ftdi_deinit(struct ftdi_context *ftdi)
         ftdi->readbuffer = NULL;
     }
 
+    free(ftdi->write_buffer);
+    ftdi->write_buffer = NULL;
+
+    ftdi_set_transfer_pool(ftdi, 0);
+
     if (ftdi->eeprom != NULL)
     {
         if (ftdi->eeprom->manufacturer != 0)
@@ -245,6 +345,9 @@ void ftdi_deinit(struct ftdi_context *ftdi)
         ftdi->eeprom = NULL;
     }
 
+    // a shared libusb context stays with its event loop
+    ftdi_event_loop_detach(ftdi);
+
     if (ftdi->usb_ctx)
     {
         libusb_exit(ftdi->usb_ctx);
@@ -686,6 +789,14 @@ int ftdi_usb_open_dev(struct ftdi_context *ftdi, libusb_device *dev)
     // Determine maximum packet size
     ftdi->max_packet_size = _ftdi_determine_max_packet_size(ftdi, dev);
 
+    // Forget the modem status of a previously opened device
+    ftdi->modem_status = 0;
+    ftdi->read_total = 0;
+    ftdi->status_events_first = 0;
+    ftdi->status_events_count = 0;
+    ftdi->bulk_in_transfers = 0;
+    ftdi->bulk_out_transfers = 0;
+
     if (ftdi_set_baudrate (ftdi, 9600) != 0)
     {
         ftdi_usb_close_internal (ftdi);
@@ -1005,14 +1116,16 @@ int ftdi_usb_reset(struct ftdi_context *ftdi)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_RESET_SIO,
                                 ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1,"FTDI reset failed");
 
     // Invalidate data in the readbuffer
+    ftdi_lock(ftdi);
     ftdi->readbuffer_offset = 0;
     ftdi->readbuffer_remaining = 0;
+    ftdi_unlock(ftdi);
 
     return 0;
 }
@@ -1032,14 +1145,20 @@ int ftdi_tciflush(struct ftdi_context *ftdi)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_TCIFLUSH,
                                 ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "FTDI purge of RX buffer failed");
 
     // Invalidate data in the readbuffer
+    ftdi_lock(ftdi);
     ftdi->readbuffer_offset = 0;
     ftdi->readbuffer_remaining = 0;
+    ftdi_unlock(ftdi);
+
+    // ... and in the read-ahead transfers
+    if (ftdi->readahead != NULL && ftdi_readahead_restart(ftdi) < 0)
+        ftdi_error_return(-1, "Restarting the read-ahead transfers failed");
 
     return 0;
 }
@@ -1062,14 +1181,20 @@ int ftdi_usb_purge_rx_buffer(struct ftdi_context *ftdi)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_RESET_PURGE_RX,
                                 ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "FTDI purge of RX buffer failed");
 
     // Invalidate data in the readbuffer
+    ftdi_lock(ftdi);
     ftdi->readbuffer_offset = 0;
     ftdi->readbuffer_remaining = 0;
+    ftdi_unlock(ftdi);
+
+    // ... and in the read-ahead transfers
+    if (ftdi->readahead != NULL && ftdi_readahead_restart(ftdi) < 0)
+        ftdi_error_return(-1, "Restarting the read-ahead transfers failed");
 
     return 0;
 }
@@ -1089,7 +1214,10 @@ int ftdi_tcoflush(struct ftdi_context *ftdi)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    /* Data still waiting in the write buffer never reached the chip */
+    ftdi->write_buffer_used = 0;
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_TCOFLUSH,
                                 ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "FTDI purge of TX buffer failed");
@@ -1115,7 +1243,10 @@ int ftdi_usb_purge_tx_buffer(struct ftdi_context *ftdi)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    /* Data still waiting in the write buffer never reached the chip */
+    ftdi->write_buffer_used = 0;
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_RESET_PURGE_TX,
                                 ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "FTDI purge of TX buffer failed");
@@ -1201,8 +1332,15 @@ int ftdi_usb_close(struct ftdi_context *ftdi)
     if (ftdi == NULL)
         ftdi_error_return(-3, "ftdi context invalid");
 
+    ftdi_reader_stop(ftdi);
+    ftdi_readahead_stop(ftdi);
+
+    /* Best effort, the device might be gone already */
+    if (ftdi->usb_dev != NULL)
+        ftdi_write_data_flush(ftdi);
+
     if (ftdi->usb_dev != NULL)
-        if (libusb_release_interface(ftdi->usb_dev, ftdi->interface) < 0)
+        if (ftdi->backend->release_interface(ftdi) < 0)
             rtn = -1;
 
     ftdi_usb_close_internal (ftdi);
@@ -1469,7 +1607,11 @@ int ftdi_set_baudrate(struct ftdi_context *ftdi, int baudrate)
                 : (baudrate * 21 < actual_baudrate * 20)))
         ftdi_error_return (-1, "Unsupported baudrate. Note: bitbang baudrates are automatically multiplied by 4");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-2, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_BAUDRATE_REQUEST, value,
                                 index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return (-2, "Setting new baudrate failed");
@@ -1561,7 +1703,11 @@ int ftdi_set_line_property2(struct ftdi_context *ftdi, enum ftdi_bits_type bits,
             break;
     }
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_DATA_REQUEST, value,
                                 ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return (-1, "Setting new line property failed");
@@ -1570,445 +1716,2071 @@ int ftdi_set_line_property2(struct ftdi_context *ftdi, enum ftdi_bits_type bits,
 }
 
 /**
-    Writes data in chunks (see ftdi_write_data_set_chunksize()) to the chip
+    Internal function to get the milliseconds passed since a point in time
+    \internal
+*/
+static long ftdi_elapsed_ms(const struct timeval *since)
+{
+    struct timeval now;
 
-    \param ftdi pointer to ftdi_context
-    \param buf Buffer with the data
-    \param size Size of the buffer
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000L + (now.tv_usec - since->tv_usec) / 1000;
+}
 
-    \retval -666: USB device unavailable
-    \retval <0: error code from usb_bulk_write()
-    \retval >0: number of bytes written
+/**
+    Internal function to get the total size of the segments.
+    \internal
+
+    \retval >=0: total size in bytes
+    \retval  -1: invalid segments or total size too large
 */
-int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+static int ftdi_gather_total(const struct ftdi_iovec *iov, int iovcnt)
 {
-    int offset = 0;
-    int actual_length;
+    int total = 0;
+    int i;
 
-    if (ftdi == NULL || ftdi->usb_dev == NULL)
-        ftdi_error_return(-666, "USB device unavailable");
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0))
+        return -1;
 
-    while (offset < size)
+    for (i = 0; i < iovcnt; i++)
     {
-        int write_size = ftdi->writebuffer_chunksize;
+        if (iov[i].iov_len < 0 || iov[i].iov_len > INT_MAX - total ||
+            (iov[i].iov_base == NULL && iov[i].iov_len > 0))
+            return -1;
+        total += iov[i].iov_len;
+    }
 
-        if (offset+write_size > size)
-            write_size = size-offset;
+    return total;
+}
 
-        if (libusb_bulk_transfer(ftdi->usb_dev, ftdi->in_ep, (unsigned char *)buf+offset, write_size, &actual_length, ftdi->usb_write_timeout) < 0)
-            ftdi_error_return(-1, "usb bulk write failed");
+/**
+    Internal function to set up the scatter-gather state.
+    \internal
 
-        offset += actual_length;
-    }
+    The segment list is copied, only the data has to stay valid.
+    Free the result with free().
 
-    return offset;
+    \param iov Segments with the data
+    \param iovcnt Number of segments
+    \param chunksize Maximum size of a chunk
+    \param slots Number of chunks in flight at a time, each gets a staging buffer
+
+    \retval NULL: out of memory
+*/
+static struct ftdi_gather *ftdi_gather_new(const struct ftdi_iovec *iov, int iovcnt,
+                                           int chunksize, int slots)
+{
+    struct ftdi_gather *g;
+    struct ftdi_iovec *copy;
+
+    g = (struct ftdi_gather *) malloc(sizeof(*g) + iovcnt * sizeof(*copy) + slots * chunksize);
+    if (g == NULL)
+        return NULL;
+
+    copy = (struct ftdi_iovec *) (g + 1);
+    if (iovcnt > 0)
+        memcpy(copy, iov, iovcnt * sizeof(*copy));
+
+    g->iov = copy;
+    g->iovcnt = iovcnt;
+    g->index = 0;
+    g->offset = 0;
+    g->chunksize = chunksize;
+    g->staging = (unsigned char *) (copy + iovcnt);
+    return g;
 }
 
-static void LIBUSB_CALL ftdi_read_data_cb(struct libusb_transfer *transfer)
+/**
+    Internal function to get the next chunk of the segments.
+    \internal
+
+    A segment covering a whole chunk is passed on as it is, so is the
+    end of the last segment. Smaller pieces are packed into the staging
+    buffer of the slot, so a frame made of a header, the payload and a
+    checksum still goes out in full chunks.
+
+    \param g scatter-gather state
+    \param chunk Pointer to store the address of the chunk in
+    \param slot Staging buffer to use, it must not be in flight anymore
+
+    \retval >0: size of the chunk
+    \retval  0: all segments done
+*/
+static int ftdi_gather_next(struct ftdi_gather *g, unsigned char **chunk, int slot)
 {
-    struct ftdi_transfer_control *tc = (struct ftdi_transfer_control *) transfer->user_data;
-    struct ftdi_context *ftdi = tc->ftdi;
-    int packet_size, actual_length, num_of_chunks, chunk_remains, i, ret;
+    unsigned char *staging = g->staging + slot * g->chunksize;
+    int left, length = 0;
 
-    packet_size = ftdi->max_packet_size;
+    while (g->index < g->iovcnt && g->offset == g->iov[g->index].iov_len)
+    {
+        g->index++;
+        g->offset = 0;
+    }
+    if (g->index == g->iovcnt)
+        return 0;
 
-    actual_length = transfer->actual_length;
+    left = g->iov[g->index].iov_len - g->offset;
+    if (left >= g->chunksize || g->index == g->iovcnt - 1)
+    {
+        length = left < g->chunksize ? left : g->chunksize;
+        *chunk = g->iov[g->index].iov_base + g->offset;
+        g->offset += length;
+        return length;
+    }
 
-    if (actual_length > 2)
+    while (length < g->chunksize && g->index < g->iovcnt)
     {
-        // skip FTDI status bytes.
-        // Maybe stored in the future to enable modem use
-        num_of_chunks = actual_length / packet_size;
-        chunk_remains = actual_length % packet_size;
-        //printf("actual_length = %X, num_of_chunks = %X, chunk_remains = %X, readbuffer_offset = %X\n", actual_length, num_of_chunks, chunk_remains, ftdi->readbuffer_offset);
+        const struct ftdi_iovec *v = &g->iov[g->index];
+        int n = v->iov_len - g->offset;
 
-        ftdi->readbuffer_offset += 2;
-        actual_length -= 2;
+        if (n > g->chunksize - length)
+            n = g->chunksize - length;
 
-        if (actual_length > packet_size - 2)
+        memcpy(staging + length, v->iov_base + g->offset, n);
+        length += n;
+        g->offset += n;
+        if (g->offset == v->iov_len)
         {
-            for (i = 1; i < num_of_chunks; i++)
-                memmove (ftdi->readbuffer+ftdi->readbuffer_offset+(packet_size - 2)*i,
-                         ftdi->readbuffer+ftdi->readbuffer_offset+packet_size*i,
-                         packet_size - 2);
-            if (chunk_remains > 2)
-            {
-                memmove (ftdi->readbuffer+ftdi->readbuffer_offset+(packet_size - 2)*i,
-                         ftdi->readbuffer+ftdi->readbuffer_offset+packet_size*i,
-                         chunk_remains-2);
-                actual_length -= 2*num_of_chunks;
-            }
-            else
-                actual_length -= 2*(num_of_chunks-1)+chunk_remains;
+            g->index++;
+            g->offset = 0;
         }
+    }
 
-        if (actual_length > 0)
-        {
-            // data still fits in buf?
-            if (tc->offset + actual_length <= tc->size)
-            {
-                memcpy (tc->buf + tc->offset, ftdi->readbuffer + ftdi->readbuffer_offset, actual_length);
-                //printf("buf[0] = %X, buf[1] = %X\n", buf[0], buf[1]);
-                tc->offset += actual_length;
-
-                ftdi->readbuffer_offset = 0;
-                ftdi->readbuffer_remaining = 0;
+    *chunk = staging;
+    return length;
+}
 
-                /* Did we read exactly the right amount of bytes? */
-                if (tc->offset == tc->size)
-                {
-                    //printf("read_data exact rem %d offset %d\n",
-                    //ftdi->readbuffer_remaining, offset);
-                    tc->completed = 1;
-                    return;
-                }
-            }
-            else
-            {
-                // only copy part of the data or size <= readbuffer_chunksize
-                int part_size = tc->size - tc->offset;
-                memcpy (tc->buf + tc->offset, ftdi->readbuffer + ftdi->readbuffer_offset, part_size);
-                tc->offset += part_size;
-
-                ftdi->readbuffer_offset += part_size;
-                ftdi->readbuffer_remaining = actual_length - part_size;
-
-                /* printf("Returning part: %d - size: %d - offset: %d - actual_length: %d - remaining: %d\n",
-                part_size, size, offset, actual_length, ftdi->readbuffer_remaining); */
-                tc->completed = 1;
-                return;
-            }
-        }
-    }
+/**
+    Internal function to continue the chunks at a byte position.
+    \internal
 
-    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
-        tc->completed = LIBUSB_TRANSFER_CANCELLED;
-    else
+    \param g scatter-gather state
+    \param pos Position in the concatenated segments
+*/
+static void ftdi_gather_seek(struct ftdi_gather *g, int pos)
+{
+    g->index = 0;
+    while (g->index < g->iovcnt && pos >= g->iov[g->index].iov_len)
     {
-        ret = libusb_submit_transfer (transfer);
-        if (ret < 0)
-            tc->completed = 1;
+        pos -= g->iov[g->index].iov_len;
+        g->index++;
     }
+    g->offset = g->index < g->iovcnt ? pos : 0;
 }
 
-
-static void LIBUSB_CALL ftdi_write_data_cb(struct libusb_transfer *transfer)
+/**
+ * @brief Wrapper function to export the chunking of ftdi_write_datav() to the unit test
+ * Do not use, it's only for the unit test framework
+ **/
+int write_datav_gather_UT_export(const struct ftdi_iovec *iov, int iovcnt, int chunksize,
+                                 unsigned char *out, int *lengths, int *copied, int max_chunks)
 {
-    struct ftdi_transfer_control *tc = (struct ftdi_transfer_control *) transfer->user_data;
-    struct ftdi_context *ftdi = tc->ftdi;
+    struct ftdi_gather *g;
+    unsigned char *chunk;
+    int num = 0, length;
 
-    tc->offset += transfer->actual_length;
+    g = ftdi_gather_new(iov, iovcnt, chunksize, 1);
+    if (g == NULL)
+        return -1;
 
-    if (tc->offset == tc->size)
+    while (num < max_chunks && (length = ftdi_gather_next(g, &chunk, 0)) > 0)
     {
-        tc->completed = 1;
+        memcpy(out, chunk, length);
+        out += length;
+        lengths[num] = length;
+        copied[num] = (chunk == g->staging);
+        num++;
     }
-    else
-    {
-        int write_size = ftdi->writebuffer_chunksize;
-        int ret;
 
-        if (tc->offset + write_size > tc->size)
-            write_size = tc->size - tc->offset;
+    free(g);
+    return num;
+}
 
-        transfer->length = write_size;
-        transfer->buffer = tc->buf + tc->offset;
+static void LIBUSB_CALL ftdi_write_data_pipelined_cb(struct libusb_transfer *transfer)
+{
+    int *completed = (int *) transfer->user_data;
 
-        if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
-            tc->completed = LIBUSB_TRANSFER_CANCELLED;
-        else
+    *completed = 1;
+}
+
+/**
+    Internal function to cancel the pipelined write transfers in flight
+    and wait until they completed.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: event handling failed, some transfers are still in flight
+*/
+static int ftdi_write_data_pipelined_cancel(struct ftdi_context *ftdi,
+                                            struct libusb_transfer **transfers,
+                                            int *completed, int depth)
+{
+    int i;
+
+    for (i = 0; i < depth; i++)
+        if (transfers[i] != NULL && !completed[i])
+            ftdi->backend->cancel_transfer(ftdi, transfers[i]);
+
+    for (i = 0; i < depth; i++)
+    {
+        while (transfers[i] != NULL && !completed[i])
         {
-            ret = libusb_submit_transfer (transfer);
-            if (ret < 0)
-                tc->completed = 1;
+            struct timeval tv = { 1, 0 };
+
+            if (ftdi->backend->handle_events(ftdi, &tv, &completed[i]) < 0)
+                return -1;
         }
     }
+    return 0;
 }
 
-
 /**
-    Writes data to the chip. Does not wait for completion of the transfer
-    nor does it make sure that the transfer was successful.
+    Internal function to write data with several chunks in flight.
 
-    Use libusb 1.0 asynchronous API.
+    Keeps up to write_queue_depth bulk transfers of writebuffer_chunksize
+    bytes submitted. Transfers to the same endpoint are executed in order,
+    so the data arrives in order. Waits for the oldest transfer before the
+    next chunk gets submitted.
+
+    Like the unpipelined write, a chunk that was only partially written
+    is continued where it stopped. The chunks queued behind it are
+    cancelled and submitted again from there, unless they already sent
+    data, then the write fails.
+    \internal
 
     \param ftdi pointer to ftdi_context
-    \param buf Buffer with the data
-    \param size Size of the buffer
+    \param iov Segments with the data, see ftdi_write_datav()
+    \param iovcnt Number of segments
+    \param size Total size of the segments
 
-    \retval NULL: Some error happens when submit transfer
-    \retval !NULL: Pointer to a ftdi_transfer_control
+    \retval -1: USB write failed, the remaining transfers were cancelled
+    \retval >0: number of bytes written
 */
-
-struct ftdi_transfer_control *ftdi_write_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+static int ftdi_write_data_pipelined(struct ftdi_context *ftdi, const struct ftdi_iovec *iov,
+                                     int iovcnt, int size)
 {
-    struct ftdi_transfer_control *tc;
-    struct libusb_transfer *transfer;
-    int write_size, ret;
-
-    if (ftdi == NULL || ftdi->usb_dev == NULL)
-        return NULL;
-
-    tc = (struct ftdi_transfer_control *) malloc (sizeof (*tc));
-    if (!tc)
-        return NULL;
+    int depth = ftdi->write_queue_depth;
+    struct libusb_transfer **transfers;
+    struct ftdi_gather *g;
+    int *completed;
+    int offset = 0, submitted = 0, head = 0, in_flight = 0;
+    int failed = 0, i;
+
+    // a single segment never needs staging
+    g = ftdi_gather_new(iov, iovcnt, ftdi->writebuffer_chunksize, iovcnt > 1 ? depth : 0);
+    transfers = (struct libusb_transfer **) calloc(depth, sizeof(*transfers));
+    completed = (int *) calloc(depth, sizeof(*completed));
+    if (g == NULL || transfers == NULL || completed == NULL)
+    {
+        free(g);
+        free(transfers);
+        free(completed);
+        ftdi_error_return(-1, "out of memory for write transfers");
+    }
 
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer)
+    for (i = 0; i < depth; i++)
     {
-        free(tc);
-        return NULL;
+        completed[i] = 1;
+        transfers[i] = libusb_alloc_transfer(0);
+        if (transfers[i] == NULL)
+        {
+            failed = 1;
+            goto cleanup;
+        }
     }
 
-    tc->ftdi = ftdi;
-    tc->completed = 0;
-    tc->buf = buf;
-    tc->size = size;
-    tc->offset = 0;
+    while (offset < size)
+    {
+        struct libusb_transfer *transfer;
 
-    if (size < (int)ftdi->writebuffer_chunksize)
-        write_size = size;
-    else
-        write_size = ftdi->writebuffer_chunksize;
+        // keep the queue filled
+        while (in_flight < depth && submitted < size)
+        {
+            int slot = (head + in_flight) % depth;
+            unsigned char *chunk;
+            int write_size = ftdi_gather_next(g, &chunk, slot);
+
+            libusb_fill_bulk_transfer(transfers[slot], ftdi->usb_dev, ftdi->in_ep,
+                                      chunk, write_size,
+                                      ftdi_write_data_pipelined_cb, &completed[slot],
+                                      ftdi->usb_write_timeout);
+            completed[slot] = 0;
+            if (ftdi->backend->submit_transfer(ftdi, transfers[slot]) < 0)
+            {
+                completed[slot] = 1;
+                failed = 1;
+                goto cleanup;
+            }
+            submitted += write_size;
+            in_flight++;
+        }
 
-    libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->in_ep, buf,
-                              write_size, ftdi_write_data_cb, tc,
-                              ftdi->usb_write_timeout);
-    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+        // nothing in flight would pick up a slot that completed before
+        if (in_flight == 0)
+        {
+            failed = 1;
+            goto cleanup;
+        }
 
-    ret = libusb_submit_transfer(transfer);
-    if (ret < 0)
+        // wait for the oldest one
+        while (!completed[head])
+        {
+            struct timeval tv = { 1, 0 };
+            int ret = ftdi->backend->handle_events(ftdi, &tv, &completed[head]);
+
+            if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            {
+                failed = 1;
+                goto cleanup;
+            }
+        }
+        in_flight--;
+
+        transfer = transfers[head];
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+        {
+            failed = 1;
+            goto cleanup;
+        }
+        offset += transfer->actual_length;
+        head = (head + 1) % depth;
+
+        // a short write, resend the rest of the chunk
+        if (transfer->actual_length != transfer->length)
+        {
+            // the queued chunks would leave a hole
+            if (in_flight > 0)
+            {
+                if (ftdi_write_data_pipelined_cancel(ftdi, transfers, completed, depth) < 0)
+                {
+                    failed = 1;
+                    goto cleanup;
+                }
+                for (i = 0; i < in_flight; i++)
+                {
+                    if (transfers[(head + i) % depth]->actual_length > 0)
+                    {
+                        failed = 1;
+                        goto cleanup;
+                    }
+                }
+                head = (head + in_flight) % depth;
+                in_flight = 0;
+            }
+            submitted = offset;
+            ftdi_gather_seek(g, offset);
+        }
+    }
+
+cleanup:
+    ftdi_write_data_pipelined_cancel(ftdi, transfers, completed, depth);
+    for (i = 0; i < depth; i++)
     {
-        libusb_free_transfer(transfer);
-        free(tc);
-        return NULL;
+        /* Still in flight if event handling failed, better leak it */
+        if (transfers[i] != NULL && completed[i])
+            libusb_free_transfer(transfers[i]);
     }
-    tc->transfer = transfer;
+    free(transfers);
+    free(completed);
+    free(g);
 
-    return tc;
+    if (failed)
+        ftdi_error_return(-1, "usb bulk write failed");
+
+    return offset;
 }
 
 /**
-    Reads data from the chip. Does not wait for completion of the transfer
-    nor does it make sure that the transfer was successful.
-
-    Use libusb 1.0 asynchronous API.
+    Internal function to write data without going through the write buffer.
+    \internal
 
-    \param ftdi pointer to ftdi_context
+    \param ftdi pointer to ftdi_context, the device must be open
     \param buf Buffer with the data
     \param size Size of the buffer
 
-    \retval NULL: Some error happens when submit transfer
-    \retval !NULL: Pointer to a ftdi_transfer_control
+    \retval <0: error code from usb_bulk_write()
+    \retval >0: number of bytes written
 */
-
-struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+static int ftdi_write_data_unbuffered(struct ftdi_context *ftdi, const unsigned char *buf, int size)
 {
-    struct ftdi_transfer_control *tc;
-    struct libusb_transfer *transfer;
-    int ret;
+    int offset = 0;
+    int actual_length;
 
-    if (ftdi == NULL || ftdi->usb_dev == NULL)
-        return NULL;
+    if (ftdi->write_queue_depth > 1 && size > (int)ftdi->writebuffer_chunksize)
+    {
+        struct ftdi_iovec iov;
 
-    tc = (struct ftdi_transfer_control *) malloc (sizeof (*tc));
-    if (!tc)
-        return NULL;
-
-    tc->ftdi = ftdi;
-    tc->buf = buf;
-    tc->size = size;
+        iov.iov_base = (unsigned char *)buf;
+        iov.iov_len = size;
+        return ftdi_write_data_pipelined(ftdi, &iov, 1, size);
+    }
 
-    if (size <= (int)ftdi->readbuffer_remaining)
+    while (offset < size)
     {
-        memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, size);
+        int write_size = ftdi->writebuffer_chunksize;
 
-        // Fix offsets
-        ftdi->readbuffer_remaining -= size;
-        ftdi->readbuffer_offset += size;
+        if (offset+write_size > size)
+            write_size = size-offset;
 
-        /* printf("Returning bytes from buffer: %d - remaining: %d\n", size, ftdi->readbuffer_remaining); */
+        if (ftdi->backend->bulk_transfer(ftdi, ftdi->in_ep, (unsigned char *)buf+offset, write_size, &actual_length, ftdi->usb_write_timeout) < 0)
+            ftdi_error_return(-1, "usb bulk write failed");
 
-        tc->completed = 1;
-        tc->offset = size;
-        tc->transfer = NULL;
-        return tc;
+        offset += actual_length;
     }
 
-    tc->completed = 0;
-    if (ftdi->readbuffer_remaining != 0)
+    return offset;
+}
+
+/**
+    Writes data in chunks (see ftdi_write_data_set_chunksize()) to the chip
+
+    If the write buffer is enabled (see ftdi_write_data_set_buffer()),
+    small writes are only queued and sent later together with the
+    following ones.
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval -666: USB device unavailable
+    \retval <0: error code from usb_bulk_write()
+    \retval >0: number of bytes written or queued
+*/
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+    int ret;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    if (ftdi->write_buffer == NULL)
+        return ftdi_write_data_unbuffered(ftdi, buf, size);
+
+    // doesn't fit behind the queued data
+    if (size > (int)(ftdi->write_buffer_size - ftdi->write_buffer_used))
     {
-        memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, ftdi->readbuffer_remaining);
+        ret = ftdi_write_data_flush(ftdi);
+        if (ret < 0)
+            return ret;
+    }
 
-        tc->offset = ftdi->readbuffer_remaining;
+    // large writes gain nothing from buffering
+    if (size >= (int)ftdi->write_buffer_size)
+        return ftdi_write_data_unbuffered(ftdi, buf, size);
+
+    if (size <= 0)
+        return 0;
+
+    if (ftdi->write_buffer_used == 0)
+        gettimeofday(&ftdi->write_buffer_since, NULL);
+
+    memcpy(ftdi->write_buffer + ftdi->write_buffer_used, buf, size);
+    ftdi->write_buffer_used += size;
+
+    if (ftdi->write_buffer_used == ftdi->write_buffer_size ||
+        (ftdi->write_buffer_delay >= 0 &&
+         ftdi_elapsed_ms(&ftdi->write_buffer_since) >= ftdi->write_buffer_delay))
+    {
+        ret = ftdi_write_data_flush(ftdi);
+        if (ret < 0)
+            return ret;
     }
-    else
-        tc->offset = 0;
 
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer)
+    return size;
+}
+
+/**
+    Writes data from several segments to the chip, as if they were
+    concatenated to one buffer.
+
+    The library splits the data into chunks (see
+    ftdi_write_data_set_chunksize()) itself. Segments covering a whole
+    chunk are written from where they are, smaller ones get packed
+    together so they don't cost a USB transaction each. Like with
+    ftdi_write_data(), up to the write queue depth chunks are kept in
+    flight (see ftdi_write_data_set_queue_depth()). With the write
+    buffer enabled (see ftdi_write_data_set_buffer()), the segments are
+    queued like single ftdi_write_data() calls.
+
+    \param ftdi pointer to ftdi_context
+    \param iov Segments with the data
+    \param iovcnt Number of segments
+
+    \retval -666: USB device unavailable
+    \retval -1: usb bulk write failed
+    \retval -2: invalid segments
+    \retval -3: out of memory
+    \retval >=0: number of bytes written
+*/
+int ftdi_write_datav(struct ftdi_context *ftdi, const struct ftdi_iovec *iov, int iovcnt)
+{
+    struct ftdi_gather *g;
+    unsigned char *chunk;
+    int total, offset = 0;
+    int length, actual_length, sent, i;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    total = ftdi_gather_total(iov, iovcnt);
+    if (total < 0)
+        ftdi_error_return(-2, "invalid segments");
+
+    if (ftdi->write_buffer != NULL)
     {
-        free (tc);
-        return NULL;
+        for (i = 0; i < iovcnt; i++)
+        {
+            int ret = ftdi_write_data(ftdi, iov[i].iov_base, iov[i].iov_len);
+            if (ret < 0)
+                return ret;
+            offset += ret;
+            // the following segments would leave a hole
+            if (ret != iov[i].iov_len)
+                return offset;
+        }
+        return offset;
     }
 
-    ftdi->readbuffer_remaining = 0;
-    ftdi->readbuffer_offset = 0;
+    if (ftdi->write_queue_depth > 1 && total > (int)ftdi->writebuffer_chunksize)
+        return ftdi_write_data_pipelined(ftdi, iov, iovcnt, total);
 
-    libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->out_ep, ftdi->readbuffer, ftdi->readbuffer_chunksize, ftdi_read_data_cb, tc, ftdi->usb_read_timeout);
-    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+    g = ftdi_gather_new(iov, iovcnt, ftdi->writebuffer_chunksize, 1);
+    if (g == NULL)
+        ftdi_error_return(-3, "out of memory for write segments");
 
-    ret = libusb_submit_transfer(transfer);
-    if (ret < 0)
+    while ((length = ftdi_gather_next(g, &chunk, 0)) > 0)
     {
-        libusb_free_transfer(transfer);
-        free (tc);
-        return NULL;
+        // like ftdi_write_data(), a short write continues where it stopped
+        for (sent = 0; sent < length; sent += actual_length)
+        {
+            if (ftdi->backend->bulk_transfer(ftdi, ftdi->in_ep, chunk + sent, length - sent, &actual_length, ftdi->usb_write_timeout) < 0)
+            {
+                free(g);
+                ftdi_error_return(-1, "usb bulk write failed");
+            }
+        }
+        offset += length;
     }
-    tc->transfer = transfer;
 
-    return tc;
+    free(g);
+    return offset;
 }
 
 /**
-    Wait for completion of the transfer.
-
-    Use libusb 1.0 asynchronous API.
+    Internal function to strip the modem status bytes from a bulk transfer
+    that was received into ftdi->readbuffer.
+
+    Every packet of max_packet_size bytes starts with two modem status bytes.
+    The payload is copied straight into the caller's buffer in a single pass.
+    When the caller's buffer is full, the unconsumed payload stays in the
+    readbuffer: the partially consumed packet is left where it is and only
+    the following packets get compacted behind it.
+    \internal
 
-    \param tc pointer to ftdi_transfer_control
+    \param ftdi pointer to ftdi_context
+    \param actual_length number of bytes received into ftdi->readbuffer
+    \param buf Buffer to store data in
+    \param size Size of the buffer
 
-    \retval < 0: Some error happens
-    \retval >= 0: Data size transferred
+    \retval number of bytes copied to buf
 */
+static int ftdi_read_data_deframe(struct ftdi_context *ftdi, int actual_length,
+                                  unsigned char *buf, int size)
+{
+    int packet_size = ftdi->max_packet_size;
+    int packets = (actual_length + packet_size - 1) / packet_size;
+    int fit = size / (packet_size - 2);
+    int offset, raw_len, packet_len, part_size;
+    unsigned char *ptr, *tail;
 
-int ftdi_transfer_data_done(struct ftdi_transfer_control *tc)
+    ftdi->readbuffer_offset = 0;
+    ftdi->readbuffer_remaining = 0;
+
+    ftdi_deframe_status(ftdi, ftdi->readbuffer, actual_length);
+
+    // everything fits into the caller's buffer?
+    if (fit >= packets)
+        return ftdi_deframe(buf, ftdi->readbuffer, actual_length, packet_size);
+
+    // copy the packets that fit completely
+    raw_len = fit * packet_size;
+    offset = ftdi_deframe(buf, ftdi->readbuffer, raw_len, packet_size);
+
+    ptr = ftdi->readbuffer + raw_len;
+    actual_length -= raw_len;
+    packet_len = (actual_length < packet_size) ? actual_length : packet_size;
+    if (packet_len <= 2)
+        return offset;
+
+    // split the next packet, the rest stays in the readbuffer
+    part_size = size - offset;
+    if (part_size > packet_len - 2)
+        part_size = packet_len - 2;
+    memcpy (buf + offset, ptr + 2, part_size);
+    offset += part_size;
+
+    ftdi->readbuffer_offset = ptr + 2 + part_size - ftdi->readbuffer;
+    tail = ptr + packet_len;
+    ftdi->readbuffer_remaining = packet_len - 2 - part_size +
+                                 ftdi_deframe(tail, tail, actual_length - packet_len, packet_size);
+    if (ftdi->readbuffer_remaining == 0)
+        ftdi->readbuffer_offset = 0;
+
+    return offset;
+}
+
+/**
+ * @brief Wrapper function to export ftdi_read_data_deframe() to the unit test
+ * Do not use, it's only for the unit test framework
+ **/
+int read_data_deframe_UT_export(struct ftdi_context *ftdi, int actual_length,
+                                unsigned char *buf, int size)
 {
-    int ret;
-    struct timeval to = { 0, 0 };
-    while (!tc->completed)
+    return ftdi_read_data_deframe(ftdi, actual_length, buf, size);
+}
+
+/**
+    Internal function to get a transfer control with a libusb transfer,
+    from the pool if there is one left.
+    \internal
+
+    The transfer's status reads as completed until it gets submitted.
+
+    \param ftdi pointer to ftdi_context
+
+    \retval NULL: out of memory
+*/
+static struct ftdi_transfer_control *ftdi_transfer_control_get(struct ftdi_context *ftdi)
+{
+    struct ftdi_transfer_control *tc;
+
+    ftdi_lock(ftdi);
+    tc = ftdi->tc_pool;
+    if (tc != NULL)
     {
-        ret = libusb_handle_events_timeout_completed(tc->ftdi->usb_ctx,
-                &to, &tc->completed);
-        if (ret < 0)
+        ftdi->tc_pool = tc->next;
+        ftdi->tc_pool_count--;
+    }
+    ftdi_unlock(ftdi);
+
+    if (tc == NULL)
+    {
+        tc = (struct ftdi_transfer_control *) malloc (sizeof (*tc));
+        if (!tc)
+            return NULL;
+
+        tc->transfer = libusb_alloc_transfer(0);
+        if (!tc->transfer)
         {
-            if (ret == LIBUSB_ERROR_INTERRUPTED)
-                continue;
-            libusb_cancel_transfer(tc->transfer);
-            while (!tc->completed)
-                if (libusb_handle_events_timeout_completed(tc->ftdi->usb_ctx,
-                        &to, &tc->completed) < 0)
-                    break;
-            libusb_free_transfer(tc->transfer);
-            free (tc);
-            return ret;
+            free(tc);
+            return NULL;
         }
     }
 
-    ret = tc->offset;
-    /**
-     * tc->transfer could be NULL if "(size <= ftdi->readbuffer_remaining)"
-     * at ftdi_read_data_submit(). Therefore, we need to check it here.
-     **/
-    if (tc->transfer)
+    tc->ftdi = ftdi;
+    tc->gather = NULL;
+    tc->next = NULL;
+    tc->callback = NULL;
+    tc->userdata = NULL;
+    tc->transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    return tc;
+}
+
+/**
+    Internal function to return a transfer control which is done.
+    It is kept in the pool unless the pool is full.
+    \internal
+
+    \param tc pointer to ftdi_transfer_control
+*/
+static void ftdi_transfer_control_put(struct ftdi_transfer_control *tc)
+{
+    struct ftdi_context *ftdi = tc->ftdi;
+
+    free(tc->gather);
+    tc->gather = NULL;
+
+    ftdi_lock(ftdi);
+    if (tc->transfer != NULL && ftdi->tc_pool_count < ftdi->tc_pool_size)
     {
-        if (tc->transfer->status != LIBUSB_TRANSFER_COMPLETED)
-            ret = -1;
-        libusb_free_transfer(tc->transfer);
+        tc->next = ftdi->tc_pool;
+        ftdi->tc_pool = tc;
+        ftdi->tc_pool_count++;
+        ftdi_unlock(ftdi);
+        return;
     }
+    ftdi_unlock(ftdi);
+
+    if (tc->transfer)
+        libusb_free_transfer(tc->transfer);
     free(tc);
-    return ret;
 }
 
 /**
-    Cancel transfer and wait for completion.
+    Internal function to get the result of a completed transfer
+    \internal
 
-    Use libusb 1.0 asynchronous API.
+    \retval -1: transfer failed
+    \retval >=0: Data size transferred
+*/
+static int ftdi_transfer_data_result(struct ftdi_transfer_control *tc)
+{
+    /**
+     * tc->transfer wasn't submitted if "(size <= ftdi->readbuffer_remaining)"
+     * at ftdi_read_data_submit(), its status still reads as completed.
+     **/
+    if (tc->transfer && tc->transfer->status != LIBUSB_TRANSFER_COMPLETED)
+        return -1;
+    return tc->offset;
+}
+
+/**
+    Internal function to mark a transfer as completed.
+    Runs the completion callback, if there is one, and releases the
+    transfer control afterwards.
+    \internal
 
     \param tc pointer to ftdi_transfer_control
-    \param to pointer to timeout value or NULL for infinite
+    \param completed 1 or LIBUSB_TRANSFER_CANCELLED
 */
+static void ftdi_transfer_complete(struct ftdi_transfer_control *tc, int completed)
+{
+    tc->completed = completed;
+    if (tc->callback == NULL)
+        return;
 
-void ftdi_transfer_data_cancel(struct ftdi_transfer_control *tc,
-                               struct timeval * to)
+    tc->callback(tc, ftdi_transfer_data_result(tc), tc->userdata);
+    ftdi_transfer_control_put(tc);
+}
+
+static void LIBUSB_CALL ftdi_read_data_cb(struct libusb_transfer *transfer)
 {
-    struct timeval tv = { 0, 0 };
+    struct ftdi_transfer_control *tc = (struct ftdi_transfer_control *) transfer->user_data;
+    struct ftdi_context *ftdi = tc->ftdi;
+    int actual_length, ret;
 
-    if (!tc->completed && tc->transfer != NULL)
+    actual_length = transfer->actual_length;
+
+    // an idle line still reports modem status changes
+    if (actual_length > 0 && actual_length <= 2)
+        ftdi_deframe_status(ftdi, ftdi->readbuffer, actual_length);
+    else if (actual_length > 2)
     {
-        if (to == NULL)
-            to = &tv;
+        // strip the status bytes while copying, the rest stays in the readbuffer
+        ftdi_lock(ftdi);
+        tc->offset += ftdi_read_data_deframe(ftdi, actual_length, tc->buf + tc->offset,
+                                             tc->size - tc->offset);
+        ftdi_unlock(ftdi);
+
+        /* Did we read enough bytes? */
+        if (tc->offset == tc->size)
+        {
+            ftdi_transfer_complete(tc, 1);
+            return;
+        }
+    }
 
-        libusb_cancel_transfer(tc->transfer);
-        while (!tc->completed)
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        ftdi_transfer_complete(tc, LIBUSB_TRANSFER_CANCELLED);
+    else
+    {
+        ret = ftdi->backend->submit_transfer(ftdi, transfer);
+        if (ret < 0)
+            ftdi_transfer_complete(tc, 1);
+    }
+}
+
+
+static void LIBUSB_CALL ftdi_write_data_cb(struct libusb_transfer *transfer)
+{
+    struct ftdi_transfer_control *tc = (struct ftdi_transfer_control *) transfer->user_data;
+    struct ftdi_context *ftdi = tc->ftdi;
+
+    tc->offset += transfer->actual_length;
+
+    if (tc->offset == tc->size)
+    {
+        ftdi_transfer_complete(tc, 1);
+    }
+    else
+    {
+        int write_size = ftdi->writebuffer_chunksize;
+        int ret;
+
+        if (tc->offset + write_size > tc->size)
+            write_size = tc->size - tc->offset;
+
+        transfer->length = write_size;
+        transfer->buffer = tc->buf + tc->offset;
+
+        if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+            ftdi_transfer_complete(tc, LIBUSB_TRANSFER_CANCELLED);
+        else
         {
-            if (libusb_handle_events_timeout_completed(tc->ftdi->usb_ctx, to, &tc->completed) < 0)
-                break;
+            ret = ftdi->backend->submit_transfer(ftdi, transfer);
+            if (ret < 0)
+                ftdi_transfer_complete(tc, 1);
         }
     }
+}
 
-    if (tc->transfer)
-        libusb_free_transfer(tc->transfer);
 
-    free (tc);
+/**
+    Internal function to submit a write, see ftdi_write_data_submit()
+    and ftdi_write_data_submit_cb().
+    \internal
+*/
+static struct ftdi_transfer_control *ftdi_write_data_submit_internal(struct ftdi_context *ftdi,
+        unsigned char *buf, int size, FTDITransferCallback *callback, void *userdata)
+{
+    struct ftdi_transfer_control *tc;
+    struct libusb_transfer *transfer;
+    int write_size, ret;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        return NULL;
+
+    // keep the order of the data
+    if (ftdi_write_data_flush(ftdi) < 0)
+        return NULL;
+
+    tc = ftdi_transfer_control_get(ftdi);
+    if (!tc)
+        return NULL;
+    transfer = tc->transfer;
+
+    tc->completed = 0;
+    tc->buf = buf;
+    tc->size = size;
+    tc->offset = 0;
+    tc->callback = callback;
+    tc->userdata = userdata;
+
+    if (size < (int)ftdi->writebuffer_chunksize)
+        write_size = size;
+    else
+        write_size = ftdi->writebuffer_chunksize;
+
+    libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->in_ep, buf,
+                              write_size, ftdi_write_data_cb, tc,
+                              ftdi->usb_write_timeout);
+    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+
+    ret = ftdi->backend->submit_transfer(ftdi, transfer);
+    if (ret < 0)
+    {
+        ftdi_transfer_control_put(tc);
+        return NULL;
+    }
+
+    return tc;
+}
+
+/**
+    Writes data to the chip. Does not wait for completion of the transfer
+    nor does it make sure that the transfer was successful.
+
+    Use libusb 1.0 asynchronous API.
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval NULL: Some error happens when submit transfer
+    \retval !NULL: Pointer to a ftdi_transfer_control
+*/
+
+struct ftdi_transfer_control *ftdi_write_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+    return ftdi_write_data_submit_internal(ftdi, buf, size, NULL, NULL);
+}
+
+/**
+    Writes data to the chip and calls back when done. Does not wait for
+    completion of the transfer.
+
+    The callback runs from the libusb event handler once all data was
+    written or the transfer failed, with the result ftdi_transfer_data_done()
+    would have returned. The transfer control is released after the
+    callback returned. Don't pass it to ftdi_transfer_data_done() or
+    ftdi_transfer_data_cancel(), that would put it into the pool twice.
+
+    Use libusb 1.0 asynchronous API.
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer with the data
+    \param size Size of the buffer
+    \param callback Function to call on completion
+    \param userdata Passed to the callback
+
+    \retval  0: transfer submitted
+    \retval -1: Some error happens when submit transfer
+*/
+int ftdi_write_data_submit_cb(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                              FTDITransferCallback *callback, void *userdata)
+{
+    if (callback == NULL)
+        return -1;
+
+    if (ftdi_write_data_submit_internal(ftdi, buf, size, callback, userdata) == NULL)
+        return -1;
+
+    return 0;
+}
+
+static void LIBUSB_CALL ftdi_write_datav_cb(struct libusb_transfer *transfer)
+{
+    struct ftdi_transfer_control *tc = (struct ftdi_transfer_control *) transfer->user_data;
+    unsigned char *chunk;
+    int length, ret;
+
+    tc->offset += transfer->actual_length;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        ftdi_transfer_complete(tc, (transfer->status == LIBUSB_TRANSFER_CANCELLED) ?
+                               LIBUSB_TRANSFER_CANCELLED : 1);
+        return;
+    }
+
+    if (transfer->actual_length < transfer->length)
+    {
+        // a short write, send the rest of the chunk first
+        transfer->buffer += transfer->actual_length;
+        transfer->length -= transfer->actual_length;
+    }
+    else
+    {
+        length = ftdi_gather_next(tc->gather, &chunk, 0);
+        if (length == 0)
+        {
+            ftdi_transfer_complete(tc, 1);
+            return;
+        }
+
+        transfer->buffer = chunk;
+        transfer->length = length;
+    }
+
+    ret = tc->ftdi->backend->submit_transfer(tc->ftdi, transfer);
+    if (ret < 0)
+        ftdi_transfer_complete(tc, 1);
+}
+
+/**
+    Writes data from several segments to the chip like ftdi_write_datav().
+    Does not wait for completion of the transfer nor does it make sure
+    that the transfer was successful.
+
+    The segment list is copied, but the data has to stay valid until
+    the transfer is done.
+
+    Use libusb 1.0 asynchronous API.
+
+    \param ftdi pointer to ftdi_context
+    \param iov Segments with the data
+    \param iovcnt Number of segments
+
+    \retval NULL: Some error happens when submit transfer
+    \retval !NULL: Pointer to a ftdi_transfer_control
+*/
+struct ftdi_transfer_control *ftdi_write_datav_submit(struct ftdi_context *ftdi,
+        const struct ftdi_iovec *iov, int iovcnt)
+{
+    struct ftdi_transfer_control *tc;
+    struct libusb_transfer *transfer;
+    unsigned char *chunk;
+    int total, length;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        return NULL;
+
+    total = ftdi_gather_total(iov, iovcnt);
+    if (total < 0)
+        return NULL;
+
+    // keep the order of the data
+    if (ftdi_write_data_flush(ftdi) < 0)
+        return NULL;
+
+    tc = ftdi_transfer_control_get(ftdi);
+    if (!tc)
+        return NULL;
+    transfer = tc->transfer;
+
+    tc->gather = ftdi_gather_new(iov, iovcnt, ftdi->writebuffer_chunksize, 1);
+    if (!tc->gather)
+    {
+        ftdi_transfer_control_put(tc);
+        return NULL;
+    }
+
+    tc->buf = NULL;
+    tc->size = total;
+    tc->offset = 0;
+
+    length = ftdi_gather_next(tc->gather, &chunk, 0);
+    if (length == 0)
+    {
+        // nothing to write
+        tc->completed = 1;
+        return tc;
+    }
+
+    tc->completed = 0;
+    libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->in_ep, chunk,
+                              length, ftdi_write_datav_cb, tc,
+                              ftdi->usb_write_timeout);
+
+    if (ftdi->backend->submit_transfer(ftdi, transfer) < 0)
+    {
+        ftdi_transfer_control_put(tc);
+        return NULL;
+    }
+
+    return tc;
+}
+
+/**
+    Internal function to submit a read, see ftdi_read_data_submit()
+    and ftdi_read_data_submit_cb().
+    \internal
+
+    With a callback, a read served from the readbuffer completes right
+    away and the returned pointer is already released.
+*/
+static struct ftdi_transfer_control *ftdi_read_data_submit_internal(struct ftdi_context *ftdi,
+        unsigned char *buf, int size, FTDITransferCallback *callback, void *userdata)
+{
+    struct ftdi_transfer_control *tc;
+    struct libusb_transfer *transfer;
+    int ret;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL || ftdi->readahead != NULL)
+        return NULL;
+
+    if (ftdi_write_data_flush(ftdi) < 0)
+        return NULL;
+
+    tc = ftdi_transfer_control_get(ftdi);
+    if (!tc)
+        return NULL;
+    transfer = tc->transfer;
+
+    tc->buf = buf;
+    tc->size = size;
+    tc->callback = callback;
+    tc->userdata = userdata;
+
+    ftdi_lock(ftdi);
+    if (size <= (int)ftdi->readbuffer_remaining)
+    {
+        memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, size);
+
+        // Fix offsets
+        ftdi->readbuffer_remaining -= size;
+        ftdi->readbuffer_offset += size;
+        ftdi_unlock(ftdi);
+
+        /* printf("Returning bytes from buffer: %d - remaining: %d\n", size, ftdi->readbuffer_remaining); */
+
+        tc->offset = size;
+        ftdi_transfer_complete(tc, 1);
+        return tc;
+    }
+
+    tc->completed = 0;
+    if (ftdi->readbuffer_remaining != 0)
+    {
+        memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, ftdi->readbuffer_remaining);
+
+        tc->offset = ftdi->readbuffer_remaining;
+    }
+    else
+        tc->offset = 0;
+
+    ftdi->readbuffer_remaining = 0;
+    ftdi->readbuffer_offset = 0;
+    ftdi_unlock(ftdi);
+
+    libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->out_ep, ftdi->readbuffer, ftdi->readbuffer_chunksize, ftdi_read_data_cb, tc, ftdi->usb_read_timeout);
+    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+
+    ret = ftdi->backend->submit_transfer(ftdi, transfer);
+    if (ret < 0)
+    {
+        ftdi_transfer_control_put(tc);
+        return NULL;
+    }
+
+    return tc;
+}
+
+/**
+    Reads data from the chip. Does not wait for completion of the transfer
+    nor does it make sure that the transfer was successful.
+
+    Use libusb 1.0 asynchronous API. Not available while the read-ahead
+    of ftdi_read_data() is enabled.
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval NULL: Some error happens when submit transfer
+    \retval !NULL: Pointer to a ftdi_transfer_control
+*/
+
+struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+    return ftdi_read_data_submit_internal(ftdi, buf, size, NULL, NULL);
+}
+
+/**
+    Reads data from the chip and calls back when done. Does not wait for
+    completion of the transfer.
+
+    The callback runs from the libusb event handler once size bytes were
+    read or the transfer failed, with the result ftdi_transfer_data_done()
+    would have returned. If the readbuffer holds enough data already, the
+    callback runs before this function returns. The transfer control is
+    released after the callback returned. Don't pass it to
+    ftdi_transfer_data_done() or ftdi_transfer_data_cancel(), that would
+    put it into the pool twice.
+
+    Use libusb 1.0 asynchronous API. Not available while the read-ahead
+    of ftdi_read_data() is enabled.
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer to store data in
+    \param size Size of the buffer
+    \param callback Function to call on completion
+    \param userdata Passed to the callback
+
+    \retval  0: transfer submitted or already completed
+    \retval -1: Some error happens when submit transfer
+*/
+int ftdi_read_data_submit_cb(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                             FTDITransferCallback *callback, void *userdata)
+{
+    if (callback == NULL)
+        return -1;
+
+    if (ftdi_read_data_submit_internal(ftdi, buf, size, callback, userdata) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/**
+    Internal function to get the point in time timeout milliseconds from now
+    \internal
+*/
+static void ftdi_deadline_after(struct timeval *deadline, int timeout)
+{
+    gettimeofday(deadline, NULL);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_usec += (timeout % 1000) * 1000;
+    if (deadline->tv_usec >= 1000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_usec -= 1000000;
+    }
+}
+
+/**
+    Internal function to sleep in the libusb event handler until the
+    transfer completed.
+    \internal
+
+    Events are handled at least once, even if the deadline passed already.
+
+    \param tc pointer to ftdi_transfer_control
+    \param deadline Point in time to give up, NULL to wait forever
+
+    \retval  0: transfer completed
+    \retval LIBUSB_ERROR_TIMEOUT: deadline passed, the transfer is still running
+    \retval <0: other libusb error from event handling
+*/
+static int ftdi_transfer_wait_completed(struct ftdi_transfer_control *tc,
+                                        const struct timeval *deadline)
+{
+    struct timeval now, tv;
+    int last = 0, ret;
+
+    while (!tc->completed)
+    {
+        if (last)
+            return LIBUSB_ERROR_TIMEOUT;
+
+        if (deadline == NULL)
+        {
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+        }
+        else
+        {
+            gettimeofday(&now, NULL);
+            if (timercmp(&now, deadline, <))
+                timersub(deadline, &now, &tv);
+            else
+            {
+                // one last look at what's pending
+                timerclear(&tv);
+                last = 1;
+            }
+        }
+
+        ret = tc->ftdi->backend->handle_events(tc->ftdi,
+                &tv, &tc->completed);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+    Internal function to release a transfer control whose wait failed.
+    Cancels the transfer and waits for it.
+    \internal
+
+    \retval error The error passed in
+*/
+static int ftdi_transfer_data_abort(struct ftdi_transfer_control *tc, int error)
+{
+    struct timeval to = { 1, 0 };
+
+    tc->ftdi->backend->cancel_transfer(tc->ftdi, tc->transfer);
+    while (!tc->completed)
+        if (tc->ftdi->backend->handle_events(tc->ftdi,
+                &to, &tc->completed) < 0)
+            break;
+    ftdi_transfer_control_put(tc);
+    return error;
+}
+
+/**
+    Internal function to get the result of a completed transfer and
+    release its transfer control.
+    \internal
+
+    \retval -1: transfer failed
+    \retval >=0: Data size transferred
+*/
+static int ftdi_transfer_data_finish(struct ftdi_transfer_control *tc)
+{
+    int ret = ftdi_transfer_data_result(tc);
+
+    ftdi_transfer_control_put(tc);
+    return ret;
+}
+
+/**
+    Wait for completion of the transfer.
+
+    Sleeps in the libusb event handler until the transfer completed,
+    see ftdi_transfer_data_wait() to give up after a timeout.
+
+    Use libusb 1.0 asynchronous API.
+
+    \param tc pointer to ftdi_transfer_control
+
+    \retval < 0: Some error happens
+    \retval >= 0: Data size transferred
+*/
+
+int ftdi_transfer_data_done(struct ftdi_transfer_control *tc)
+{
+    int ret;
+
+    ret = ftdi_transfer_wait_completed(tc, NULL);
+    if (ret < 0)
+        return ftdi_transfer_data_abort(tc, ret);
+
+    return ftdi_transfer_data_finish(tc);
+}
+
+/**
+    Wait for completion of the transfer until a deadline.
+
+    Like ftdi_transfer_data_wait(), but gives up at a point in time as
+    returned by gettimeofday(). Handy to wait for several transfers
+    within one overall timeout.
+
+    \param tc pointer to ftdi_transfer_control
+    \param deadline Point in time to give up
+
+    \retval LIBUSB_ERROR_TIMEOUT: the transfer is still running, tc stays valid
+    \retval < 0: Some other error happens, tc is released
+    \retval >= 0: Data size transferred, tc is released
+*/
+int ftdi_transfer_data_wait_until(struct ftdi_transfer_control *tc,
+                                  const struct timeval *deadline)
+{
+    int ret;
+
+    ret = ftdi_transfer_wait_completed(tc, deadline);
+    if (ret == LIBUSB_ERROR_TIMEOUT)
+        return ret;
+    if (ret < 0)
+        return ftdi_transfer_data_abort(tc, ret);
+
+    return ftdi_transfer_data_finish(tc);
+}
+
+/**
+    Wait for completion of the transfer for at most timeout milliseconds.
+
+    Sleeps in the libusb event handler instead of spinning. On timeout
+    the transfer keeps running: wait again, or stop it with
+    ftdi_transfer_data_cancel().
+
+    \param tc pointer to ftdi_transfer_control
+    \param timeout Time in milliseconds to wait. 0 only handles pending
+           events and returns at once, < 0 waits like ftdi_transfer_data_done().
+
+    \retval LIBUSB_ERROR_TIMEOUT: the transfer is still running, tc stays valid
+    \retval < 0: Some other error happens, tc is released
+    \retval >= 0: Data size transferred, tc is released
+*/
+int ftdi_transfer_data_wait(struct ftdi_transfer_control *tc, int timeout)
+{
+    struct timeval deadline;
+
+    if (timeout < 0)
+        return ftdi_transfer_data_done(tc);
+
+    ftdi_deadline_after(&deadline, timeout);
+    return ftdi_transfer_data_wait_until(tc, &deadline);
+}
+
+/**
+    Internal function to check whether the events of two contexts are
+    handled together. Contexts sharing a libusb context are, emulated
+    devices only handle their own events.
+    \internal
+*/
+static int ftdi_shares_events(struct ftdi_context *a, struct ftdi_context *b)
+{
+    if (a->backend != b->backend)
+        return 0;
+    if (a->backend == &ftdi_libusb_backend)
+        return a->usb_ctx == b->usb_ctx;
+    return a == b;
+}
+
+/**
+    Internal function to wait for one or all of several transfers
+    \internal
+
+    Transfers of contexts sharing a libusb context are served by a single
+    sleeping event handler. Different libusb contexts are polled in turn.
+
+    \param tcs Transfer controls, NULL entries are skipped
+    \param count Number of entries in tcs
+    \param all Wait for all transfers instead of the first one
+    \param timeout Time in milliseconds to wait, < 0 waits forever
+
+    \retval >=0: index of a completed transfer, 0 if all are completed
+    \retval LIBUSB_ERROR_TIMEOUT: nothing (or not everything) completed in time
+    \retval LIBUSB_ERROR_INVALID_PARAM: no transfer given
+    \retval <0: other libusb error from event handling
+*/
+static int ftdi_transfer_wait_many(struct ftdi_transfer_control **tcs, int count,
+                                   int all, int timeout)
+{
+    struct timeval deadline, now, tv;
+    int last = 0;
+    int i, j, ret;
+
+    if (tcs == NULL || count <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    if (timeout >= 0)
+        ftdi_deadline_after(&deadline, timeout);
+
+    for (;;)
+    {
+        struct ftdi_context *first = NULL;
+        int valid = 0, pending = 0, shared = 1;
+
+        for (i = 0; i < count; i++)
+        {
+            if (tcs[i] == NULL)
+                continue;
+            valid++;
+
+            if (tcs[i]->completed)
+            {
+                if (!all)
+                    return i;
+                continue;
+            }
+
+            pending++;
+            if (first == NULL)
+                first = tcs[i]->ftdi;
+            else if (!ftdi_shares_events(first, tcs[i]->ftdi))
+                shared = 0;
+        }
+
+        if (valid == 0)
+            return LIBUSB_ERROR_INVALID_PARAM;
+        if (pending == 0)
+            return 0;
+        if (last)
+            return LIBUSB_ERROR_TIMEOUT;
+
+        if (timeout < 0)
+        {
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+        }
+        else
+        {
+            gettimeofday(&now, NULL);
+            if (timercmp(&now, &deadline, <))
+                timersub(&deadline, &now, &tv);
+            else
+            {
+                // one last look at what's pending
+                timerclear(&tv);
+                last = 1;
+            }
+        }
+
+        if (shared)
+        {
+            ret = first->backend->handle_events(first, &tv, NULL);
+            if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+                return ret;
+            continue;
+        }
+
+        // no single event handler to sleep in, poll each one
+        if (tv.tv_sec > 0 || tv.tv_usec > 1000)
+        {
+            tv.tv_sec = 0;
+            tv.tv_usec = 1000;
+        }
+        for (i = 0; i < count; i++)
+        {
+            if (tcs[i] == NULL || tcs[i]->completed)
+                continue;
+
+            // handle every event source once
+            for (j = 0; j < i; j++)
+                if (tcs[j] != NULL && !tcs[j]->completed &&
+                    ftdi_shares_events(tcs[j]->ftdi, tcs[i]->ftdi))
+                    break;
+            if (j < i)
+                continue;
+
+            ret = tcs[i]->ftdi->backend->handle_events(tcs[i]->ftdi, &tv, NULL);
+            if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+                return ret;
+        }
+    }
+}
+
+/**
+    Wait until one of several transfers completed.
+
+    The transfers may belong to different contexts. Contexts sharing a
+    libusb context are served by one event handler, so waiting for many
+    transfers doesn't cost one wakeup per transfer.
+
+    The completed transfer is not released, collect its result with
+    ftdi_transfer_data_done(), which returns at once, and set its entry
+    to NULL or remove it before waiting again.
+
+    \param tcs Transfer controls, NULL entries are skipped
+    \param count Number of entries in tcs
+    \param timeout Time in milliseconds to wait, < 0 waits forever
+
+    \retval >=0: index of a completed transfer in tcs
+    \retval LIBUSB_ERROR_TIMEOUT: no transfer completed in time
+    \retval LIBUSB_ERROR_INVALID_PARAM: no transfer given
+    \retval <0: other libusb error from event handling
+*/
+int ftdi_transfer_data_wait_any(struct ftdi_transfer_control **tcs, int count, int timeout)
+{
+    return ftdi_transfer_wait_many(tcs, count, 0, timeout);
+}
+
+/**
+    Wait until all of several transfers completed.
+
+    Like ftdi_transfer_data_wait_any(), but returns once every transfer
+    completed. None of them is released, collect the results with
+    ftdi_transfer_data_done().
+
+    \param tcs Transfer controls, NULL entries are skipped
+    \param count Number of entries in tcs
+    \param timeout Time in milliseconds to wait, < 0 waits forever
+
+    \retval 0: all transfers completed
+    \retval LIBUSB_ERROR_TIMEOUT: some transfers are still running
+    \retval LIBUSB_ERROR_INVALID_PARAM: no transfer given
+    \retval <0: other libusb error from event handling
+*/
+int ftdi_transfer_data_wait_all(struct ftdi_transfer_control **tcs, int count, int timeout)
+{
+    return ftdi_transfer_wait_many(tcs, count, 1, timeout);
+}
+
+/**
+    Cancel transfer and wait for completion.
+
+    Use libusb 1.0 asynchronous API.
+
+    \param tc pointer to ftdi_transfer_control
+    \param to pointer to timeout value or NULL for infinite
+*/
+
+void ftdi_transfer_data_cancel(struct ftdi_transfer_control *tc,
+                               struct timeval * to)
+{
+    struct timeval tv = { 1, 0 };
+
+    if (!tc->completed && tc->transfer != NULL)
+    {
+        if (to == NULL)
+            to = &tv;
+
+        tc->ftdi->backend->cancel_transfer(tc->ftdi, tc->transfer);
+        while (!tc->completed)
+        {
+            if (tc->ftdi->backend->handle_events(tc->ftdi, to, &tc->completed) < 0)
+                break;
+        }
+    }
+
+    ftdi_transfer_control_put(tc);
+}
+
+/**
+    Writes a command to the chip and reads the response in one go.
+
+    The read gets submitted before the write, so the chip is polled as
+    soon as the command went out. Both transfers are handled by one event
+    loop and the function returns once the complete response of rsize
+    bytes arrived. An MPSSE round trip this way costs a single wait
+    instead of a ftdi_write_data() and a ftdi_read_data() call.
+
+    Data left in the readbuffer from earlier reads is returned first, as
+    the start of the response. Call ftdi_tciflush() before if the response
+    must only hold what the chip sent for this command.
+    The whole transaction may take up to usb_read_timeout.
+
+    \param ftdi pointer to ftdi_context
+    \param wbuf Buffer with the command
+    \param wsize Size of the command
+    \param rbuf Buffer to store the response in
+    \param rsize Expected size of the response
+
+    \retval -666: USB device unavailable
+    \retval -1: invalid buffer size
+    \retval -2: not available while the read-ahead or the reader thread is active
+    \retval -3: submitting the transfers failed
+    \retval -4: usb bulk write failed
+    \retval -5: timeout, the response is incomplete
+    \retval >=0: number of bytes read, always rsize
+*/
+int ftdi_transact(struct ftdi_context *ftdi, const unsigned char *wbuf, int wsize,
+                  unsigned char *rbuf, int rsize)
+{
+    struct ftdi_transfer_control *rtc, *wtc;
+    struct timeval deadline, now, tv;
+    int written, ret;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    if (wsize <= 0 || rsize < 0)
+        ftdi_error_return(-1, "invalid buffer size");
+
+    if (ftdi->readahead != NULL || ftdi->reader != NULL)
+        ftdi_error_return(-2, "not available while reading ahead");
+
+    rtc = ftdi_read_data_submit(ftdi, rbuf, rsize);
+    if (rtc == NULL)
+        ftdi_error_return(-3, "submitting the read failed");
+
+    wtc = ftdi_write_data_submit(ftdi, (unsigned char *)wbuf, wsize);
+    if (wtc == NULL)
+    {
+        ftdi_transfer_data_cancel(rtc, NULL);
+        ftdi_error_return(-3, "submitting the write failed");
+    }
+
+    ftdi_deadline_after(&deadline, ftdi->usb_read_timeout);
+
+    while (!rtc->completed || !wtc->completed)
+    {
+        // a failed write won't ever get a response
+        if (wtc->completed && wtc->transfer->status != LIBUSB_TRANSFER_COMPLETED)
+            break;
+
+        gettimeofday(&now, NULL);
+        if (!timercmp(&now, &deadline, <))
+            break;
+        timersub(&deadline, &now, &tv);
+
+        ret = ftdi->backend->handle_events(ftdi, &tv,
+                wtc->completed ? &rtc->completed : &wtc->completed);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            break;
+    }
+
+    if (!wtc->completed || !rtc->completed)
+    {
+        int write_failed = wtc->completed &&
+                           wtc->transfer->status != LIBUSB_TRANSFER_COMPLETED;
+
+        ftdi_transfer_data_cancel(wtc, NULL);
+        ftdi_transfer_data_cancel(rtc, NULL);
+        if (write_failed)
+            ftdi_error_return(-4, "usb bulk write failed");
+        ftdi_error_return(-5, "timeout waiting for the response");
+    }
+
+    written = ftdi_transfer_data_done(wtc);
+    ret = ftdi_transfer_data_done(rtc);
+    if (written != wsize)
+        ftdi_error_return(-4, "usb bulk write failed");
+    if (ret != rsize)
+        ftdi_error_return(-5, "timeout waiting for the response");
+
+    return ret;
+}
+
+/**
+    Set the size of the transfer control pool.
+    Default is 8.
+
+    The async functions like ftdi_write_data_submit() and
+    ftdi_read_data_submit() take their ftdi_transfer_control and the
+    libusb transfer from a pool of the context. ftdi_transfer_data_done()
+    and ftdi_transfer_data_cancel() put them back, so a steady stream of
+    async transfers doesn't hit the heap. The pool is filled on demand,
+    this function also allocates the given number of controls up front.
+
+    \param ftdi pointer to ftdi_context
+    \param size Number of transfer controls to keep, 0 disables the pool
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+    \retval -2: invalid size
+    \retval -3: out of memory, the pool is only partially filled
+*/
+int ftdi_set_transfer_pool(struct ftdi_context *ftdi, int size)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    if (size < 0)
+        ftdi_error_return(-2, "invalid transfer pool size");
+
+    ftdi_lock(ftdi);
+    ftdi->tc_pool_size = size;
+
+    // drop what doesn't fit anymore
+    while (ftdi->tc_pool_count > size)
+    {
+        struct ftdi_transfer_control *tc = ftdi->tc_pool;
+
+        ftdi->tc_pool = tc->next;
+        ftdi->tc_pool_count--;
+        libusb_free_transfer(tc->transfer);
+        free(tc);
+    }
+
+    while (ftdi->tc_pool_count < size)
+    {
+        struct ftdi_transfer_control *tc;
+
+        tc = (struct ftdi_transfer_control *) malloc (sizeof (*tc));
+        if (tc != NULL)
+        {
+            tc->transfer = libusb_alloc_transfer(0);
+            if (!tc->transfer)
+            {
+                free(tc);
+                tc = NULL;
+            }
+        }
+        if (tc == NULL)
+        {
+            ftdi_unlock(ftdi);
+            ftdi_error_return(-3, "out of memory for transfer pool");
+        }
+        tc->ftdi = ftdi;
+        tc->gather = NULL;
+        ftdi_transfer_control_put(tc);
+    }
+    ftdi_unlock(ftdi);
+
+    return 0;
+}
+
+/**
+    Configure write buffer chunk size.
+    Default is 4096.
+
+    \param ftdi pointer to ftdi_context
+    \param chunksize Chunk size
+
+    \retval 0: all fine
+    \retval -1: ftdi context invalid
+*/
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    ftdi->writebuffer_chunksize = chunksize;
+    return 0;
+}
+
+/**
+    Get write buffer chunk size.
+
+    \param ftdi pointer to ftdi_context
+    \param chunksize Pointer to store chunk size in
+
+    \retval 0: all fine
+    \retval -1: ftdi context invalid
+*/
+int ftdi_write_data_get_chunksize(struct ftdi_context *ftdi, unsigned int *chunksize)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    *chunksize = ftdi->writebuffer_chunksize;
+    return 0;
+}
+
+/**
+    Configure the number of write chunks ftdi_write_data() keeps in flight.
+    Default is 1.
+
+    With a depth > 1, writes larger than the write chunk size are split into
+    chunks which are submitted up to depth at a time, so the bus doesn't idle
+    while a chunk completes. The data still arrives in order and
+    ftdi_write_data() still returns once everything is written.
+
+    \param ftdi pointer to ftdi_context
+    \param depth Number of chunks in flight, 1 writes one chunk after the other
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+    \retval -2: invalid depth
+*/
+int ftdi_write_data_set_queue_depth(struct ftdi_context *ftdi, int depth)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    if (depth < 1)
+        ftdi_error_return(-2, "invalid write queue depth");
+
+    ftdi->write_queue_depth = depth;
+    return 0;
+}
+
+/**
+    Get the number of write chunks ftdi_write_data() keeps in flight.
+
+    \param ftdi pointer to ftdi_context
+    \param depth Pointer to store the depth in
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+*/
+int ftdi_write_data_get_queue_depth(struct ftdi_context *ftdi, int *depth)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    *depth = ftdi->write_queue_depth;
+    return 0;
+}
+
+/**
+    Enable the write buffer of ftdi_write_data().
+    Disabled by default.
+
+    Every ftdi_write_data() call costs at least one USB transaction. With
+    the write buffer enabled, writes are collected and sent as one bulk
+    transfer instead, which pays off for code issuing lots of small
+    writes like MPSSE commands or bitbang patterns.
+
+    The buffered data is sent
+    - when ftdi_write_data_flush() gets called
+    - when the next write doesn't fit into the buffer anymore
+    - by the first ftdi_write_data() call after the oldest buffered
+      byte waited for delay milliseconds. There is no timer, an idle
+      application has to call ftdi_write_data_flush() itself.
+    - before reading, as the chip might only answer to the buffered data
+    - before changing the bitmode, async writes and ftdi_usb_close()
+
+    ftdi_tcoflush() discards the buffered data.
+
+    \param ftdi pointer to ftdi_context
+    \param size Buffer size in bytes, 0 disables the write buffer
+    \param delay Time in milliseconds data may wait in the buffer,
+           -1 waits until the buffer is full or flushed
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+    \retval -2: can't allocate the write buffer
+    \retval -3: sending the data of the old buffer failed
+*/
+int ftdi_write_data_set_buffer(struct ftdi_context *ftdi, unsigned int size, int delay)
+{
+    unsigned char *new_buf = NULL;
+
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    if (ftdi->write_buffer_used > 0 && ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-3, "flushing the write buffer failed");
+
+    if (size > 0)
+    {
+        new_buf = (unsigned char *)malloc(size);
+        if (new_buf == NULL)
+            ftdi_error_return(-2, "out of memory for write buffer");
+    }
+
+    free(ftdi->write_buffer);
+    ftdi->write_buffer = new_buf;
+    ftdi->write_buffer_size = size;
+    ftdi->write_buffer_used = 0;
+    ftdi->write_buffer_delay = delay;
+    return 0;
+}
+
+/**
+    Send the data waiting in the write buffer to the chip.
+
+    Nothing to do if the write buffer is disabled or empty.
+    The buffered data is discarded even if sending it failed.
+
+    \param ftdi pointer to ftdi_context
+
+    \retval -666: USB device unavailable
+    \retval <0: error code from usb_bulk_write()
+    \retval  0: all fine
+*/
+int ftdi_write_data_flush(struct ftdi_context *ftdi)
+{
+    int used, ret;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    used = ftdi->write_buffer_used;
+    if (used == 0)
+        return 0;
+
+    ftdi->write_buffer_used = 0;
+    ret = ftdi_write_data_unbuffered(ftdi, ftdi->write_buffer, used);
+    if (ret < 0)
+        return ret;
+
+    return 0;
+}
+
+/**
+    Reads data in chunks (see ftdi_read_data_set_chunksize()) from the chip.
+
+    Automatically strips the two modem status bytes transfered during every read.
+    If the read-ahead is enabled, the data is taken from the queued transfers,
+    see ftdi_read_data_set_readahead().
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer to store data in
+    \param size Size of the buffer
+
+    \retval -666: USB device unavailable
+    \retval <0: error code from libusb_bulk_transfer()
+    \retval  0: no data was available
+    \retval >0: number of bytes read
+
+*/
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+    return ftdi_read_data_blocking(ftdi, buf, size, 0, 0);
+}
+
+/**
+    Internal function to get the size of the next bulk IN transfer.
+    This is the read chunk size unless the adaptive mode is enabled.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+
+    \retval transfer size in bytes
+*/
+unsigned int ftdi_read_transfer_size(struct ftdi_context *ftdi)
+{
+    unsigned int chunksize = ftdi->readbuffer_chunksize;
+    unsigned int packet_size = ftdi->max_packet_size;
+
+    if (!ftdi->read_adaptive || packet_size == 0 || chunksize < packet_size)
+        return chunksize;
+
+    // (re)start with the largest multiple of packet_size
+    if (ftdi->read_transfer_size == 0 || ftdi->read_transfer_size > chunksize)
+    {
+        ftdi->read_transfer_size = chunksize - chunksize % packet_size;
+        ftdi->read_fill_avg = 128;
+    }
+
+    return ftdi->read_transfer_size;
 }
 
 /**
-    Configure write buffer chunk size.
-    Default is 4096.
+    Internal function to adjust the transfer size to the received amount of data.
 
-    \param ftdi pointer to ftdi_context
-    \param chunksize Chunk size
+    A transfer coming back full means the chip has more data waiting,
+    so the next transfers get twice as large. If the transfers stay mostly
+    empty, the traffic is sparse and smaller transfers keep the latency low,
+    because the chip can send a short packet to end the transfer sooner.
 
-    \retval 0: all fine
-    \retval -1: ftdi context invalid
+    The fill level is taken against the size the transfer was submitted
+    with. Read-ahead transfers were queued before the last adjustment,
+    comparing them against the current size would make it oscillate.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+    \param requested length the last transfer was submitted with
+    \param actual_length number of bytes received by the last transfer
 */
-int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
+static void ftdi_read_data_adapt(struct ftdi_context *ftdi, int requested, int actual_length)
 {
-    if (ftdi == NULL)
-        ftdi_error_return(-1, "ftdi context invalid");
+    unsigned int size = requested;
+    unsigned int packet_size = ftdi->max_packet_size;
+    int fill;
 
-    ftdi->writebuffer_chunksize = chunksize;
-    return 0;
+    if (!ftdi->read_adaptive || packet_size == 0 || size < packet_size)
+        return;
+
+    // fill level in 1/256, averaged over about eight transfers
+    fill = (int)((unsigned int)actual_length * 256 / size);
+    ftdi->read_fill_avg += (fill - ftdi->read_fill_avg) / 8;
+
+    if ((unsigned int)actual_length >= size)
+    {
+        size *= 2;
+        if (size > ftdi->readbuffer_chunksize)
+            size = ftdi->readbuffer_chunksize - ftdi->readbuffer_chunksize % packet_size;
+        ftdi->read_fill_avg = 128;
+    }
+    else if (ftdi->read_fill_avg < 32 && size > packet_size)
+    {
+        size /= 2;
+        size -= size % packet_size;
+        if (size < packet_size)
+            size = packet_size;
+        ftdi->read_fill_avg = 128;
+    }
+
+    ftdi->read_transfer_size = size;
 }
 
 /**
-    Get write buffer chunk size.
+ * @brief Wrapper function to export ftdi_read_data_adapt() to the unit test
+ * Do not use, it's only for the unit test framework
+ **/
+void read_data_adapt_UT_export(struct ftdi_context *ftdi, int requested, int actual_length)
+{
+    ftdi_read_data_adapt(ftdi, requested, actual_length);
+}
+
+/**
+    Internal function to receive the next bulk transfer into ftdi->readbuffer.
+    Takes it from the read-ahead queue if that is enabled.
+    The status of a transfer without payload is recorded right away,
+    the callers only de-frame transfers carrying data.
+    \internal
 
     \param ftdi pointer to ftdi_context
-    \param chunksize Pointer to store chunk size in
 
-    \retval 0: all fine
-    \retval -1: ftdi context invalid
+    \retval >=0: number of raw bytes received, including the status bytes
+    \retval  <0: error code from libusb_bulk_transfer()
 */
-int ftdi_write_data_get_chunksize(struct ftdi_context *ftdi, unsigned int *chunksize)
+static int ftdi_read_data_fill(struct ftdi_context *ftdi)
 {
-    if (ftdi == NULL)
-        ftdi_error_return(-1, "ftdi context invalid");
+    int actual_length, requested, ret;
 
-    *chunksize = ftdi->writebuffer_chunksize;
-    return 0;
+    ftdi_lock(ftdi);
+    ftdi->readbuffer_remaining = 0;
+    ftdi->readbuffer_offset = 0;
+    ftdi_unlock(ftdi);
+
+    if (ftdi->readahead != NULL)
+    {
+        /* swaps the oldest completed transfer into the readbuffer */
+        actual_length = ftdi_readahead_next(ftdi, &requested);
+        if (actual_length < 0)
+            ftdi_error_return(actual_length, "usb bulk read failed");
+    }
+    else
+    {
+        /* returns how much received */
+        requested = ftdi_read_transfer_size(ftdi);
+        ret = ftdi->backend->bulk_transfer(ftdi, ftdi->out_ep, ftdi->readbuffer, requested, &actual_length, ftdi->usb_read_timeout);
+        if (ret < 0)
+            ftdi_error_return(ret, "usb bulk read failed");
+    }
+
+    if (actual_length <= 2)
+        ftdi_deframe_status(ftdi, ftdi->readbuffer, actual_length);
+    ftdi_read_data_adapt(ftdi, requested, actual_length);
+    return actual_length;
 }
 
 /**
-    Reads data in chunks (see ftdi_read_data_set_chunksize()) from the chip.
+    Reads data from the chip like ftdi_read_data(), but waits for data
+    the way a termios read() with VMIN and VTIME does.
 
-    Automatically strips the two modem status bytes transfered during every read.
+    ftdi_read_data() returns as soon as a transfer comes back without
+    payload. This function keeps on submitting transfers inside the
+    library instead, which sleep in the kernel until the chip's latency
+    timer expires. An idle port costs next to no CPU time, unlike calling
+    ftdi_read_data() in a loop.
+
+    - vmin = 0, vtime = 0: same as ftdi_read_data()
+    - vmin > 0, vtime = 0: wait until at least vmin bytes arrived
+    - vmin = 0, vtime > 0: wait until any data arrived or vtime passed
+    - vmin > 0, vtime > 0: wait until at least vmin bytes arrived. Once
+      the first byte arrived, also return when no more data came in for vtime.
+
+    Like ftdi_read_data(), data keeps being read into buf while the chip
+    sends it, so more than vmin bytes may be returned. vmin is limited to size.
 
     \param ftdi pointer to ftdi_context
     \param buf Buffer to store data in
     \param size Size of the buffer
+    \param vmin Minimum number of bytes to wait for
+    \param vtime Timeout in milliseconds, see above
 
     \retval -666: USB device unavailable
     \retval <0: error code from libusb_bulk_transfer()
-    \retval  0: no data was available
+    \retval  0: no data was available before the timeout
     \retval >0: number of bytes read
-
 */
-int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+int ftdi_read_data_blocking(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                            int vmin, int vtime)
 {
-    int offset = 0, ret, i, num_of_chunks, chunk_remains;
+    int offset = 0;
     int packet_size;
-    int actual_length = 1;
+    int actual_length;
+    struct timeval start, last_data;
 
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-666, "USB device unavailable");
@@ -2018,7 +3790,25 @@ int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
     if (packet_size == 0)
         ftdi_error_return(-1, "max_packet_size is bogus (zero)");
 
+    /* The chip might only answer to the buffered writes. The reader
+       thread leaves them to the application, which keeps writing */
+    if (ftdi->reader == NULL)
+    {
+        int ret = ftdi_write_data_flush(ftdi);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (vmin > size)
+        vmin = size;
+    if (vtime > 0)
+    {
+        gettimeofday(&start, NULL);
+        last_data = start;
+    }
+
     // everything we want is still in the readbuffer?
+    ftdi_lock(ftdi);
     if (size <= (int)ftdi->readbuffer_remaining)
     {
         memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, size);
@@ -2026,6 +3816,7 @@ int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
         // Fix offsets
         ftdi->readbuffer_remaining -= size;
         ftdi->readbuffer_offset += size;
+        ftdi_unlock(ftdi);
 
         /* printf("Returning bytes from buffer: %d - remaining: %d\n", size, ftdi->readbuffer_remaining); */
 
@@ -2039,107 +3830,198 @@ int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
         // Fix offset
         offset += ftdi->readbuffer_remaining;
     }
+    ftdi_unlock(ftdi);
     // do the actual USB read
-    while (offset < size && actual_length > 0)
+    while (offset < size)
     {
-        ftdi->readbuffer_remaining = 0;
-        ftdi->readbuffer_offset = 0;
-        /* returns how much received */
-        ret = libusb_bulk_transfer (ftdi->usb_dev, ftdi->out_ep, ftdi->readbuffer, ftdi->readbuffer_chunksize, &actual_length, ftdi->usb_read_timeout);
-        if (ret < 0)
-            ftdi_error_return(ret, "usb bulk read failed");
+        actual_length = ftdi_read_data_fill(ftdi);
+        if (actual_length < 0)
+            return actual_length;
 
-        if (actual_length > 2)
+        // no more data to read?
+        if (actual_length <= 2)
         {
-            // skip FTDI status bytes.
-            // Maybe stored in the future to enable modem use
-            num_of_chunks = actual_length / packet_size;
-            chunk_remains = actual_length % packet_size;
-            //printf("actual_length = %X, num_of_chunks = %X, chunk_remains = %X, readbuffer_offset = %X\n", actual_length, num_of_chunks, chunk_remains, ftdi->readbuffer_offset);
+            if (vmin == 0 && (vtime <= 0 || offset > 0))
+                return offset;
+            if (vmin > 0 && offset >= vmin)
+                return offset;
+            // overall timeout without vmin, inter-byte timeout after the first byte
+            if (vtime > 0 && (vmin == 0 || offset > 0) &&
+                ftdi_elapsed_ms(vmin == 0 ? &start : &last_data) >= vtime)
+                return offset;
+            continue;
+        }
 
-            ftdi->readbuffer_offset += 2;
-            actual_length -= 2;
+        // strip the status bytes while copying, the rest stays in the readbuffer
+        ftdi_lock(ftdi);
+        offset += ftdi_read_data_deframe(ftdi, actual_length, buf + offset, size - offset);
+        ftdi_unlock(ftdi);
+        if (vtime > 0)
+            gettimeofday(&last_data, NULL);
+    }
 
-            if (actual_length > packet_size - 2)
-            {
-                for (i = 1; i < num_of_chunks; i++)
-                    memmove (ftdi->readbuffer+ftdi->readbuffer_offset+(packet_size - 2)*i,
-                             ftdi->readbuffer+ftdi->readbuffer_offset+packet_size*i,
-                             packet_size - 2);
-                if (chunk_remains > 2)
-                {
-                    memmove (ftdi->readbuffer+ftdi->readbuffer_offset+(packet_size - 2)*i,
-                             ftdi->readbuffer+ftdi->readbuffer_offset+packet_size*i,
-                             chunk_remains-2);
-                    actual_length -= 2*num_of_chunks;
-                }
-                else
-                    actual_length -= 2*(num_of_chunks-1)+chunk_remains;
-            }
-        }
-        else if (actual_length <= 2)
+    return offset;
+}
+
+/**
+    Internal function to find the first delimiter in a block of data.
+    Uses memchr() for every delimiter and only searches in front of
+    the earliest match found so far.
+    \internal
+
+    \retval NULL: no delimiter found
+*/
+static unsigned char *ftdi_find_delimiter(unsigned char *data, int size,
+                                          const unsigned char *delims, int num_delims)
+{
+    unsigned char *hit = NULL;
+    int i;
+
+    for (i = 0; i < num_delims && size > 0; i++)
+    {
+        unsigned char *p = (unsigned char *)memchr(data, delims[i], size);
+
+        if (p != NULL)
         {
-            // no more data to read?
-            return offset;
+            hit = p;
+            size = p - data;
         }
-        if (actual_length > 0)
+    }
+
+    return hit;
+}
+
+/**
+    Reads data from the chip up to and including the first delimiter.
+
+    The received data is searched for any of the delimiters in the
+    readbuffer. Only the data up to the delimiter is copied to buf, the
+    rest stays in the readbuffer for the next read.
+
+    Set the chip's event character to the delimiter with
+    ftdi_set_event_char() to have it send the data as soon as the
+    delimiter arrives instead of waiting for the latency timer.
+
+    \param ftdi pointer to ftdi_context
+    \param buf Buffer to store data in
+    \param size Size of the buffer
+    \param delims Delimiters to look for
+    \param num_delims Number of delimiters
+    \param timeout Time in milliseconds to wait for a delimiter.
+           0 returns as soon as no more data is available, like ftdi_read_data().
+
+    \retval -666: USB device unavailable
+    \retval -1: max_packet_size is bogus or no delimiter given
+    \retval <0: error code from libusb_bulk_transfer()
+    \retval  0: no data was available
+    \retval >0: number of bytes read. The last one is a delimiter unless
+                buf is full or the timeout expired.
+*/
+int ftdi_read_data_until(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                         const unsigned char *delims, int num_delims, int timeout)
+{
+    int offset = 0;
+    int actual_length;
+    struct timeval start;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    // Packet size sanity check (avoid division by zero)
+    if (ftdi->max_packet_size == 0)
+        ftdi_error_return(-1, "max_packet_size is bogus (zero)");
+
+    if (delims == NULL || num_delims <= 0)
+        ftdi_error_return(-1, "no delimiter given");
+
+    if (ftdi->reader == NULL)
+    {
+        int ret = ftdi_write_data_flush(ftdi);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (size <= 0)
+        return 0;
+
+    if (timeout > 0)
+        gettimeofday(&start, NULL);
+
+    for (;;)
+    {
+        ftdi_lock(ftdi);
+        if (ftdi->readbuffer_remaining > 0)
         {
-            // data still fits in buf?
-            if (offset+actual_length <= size)
-            {
-                memcpy (buf+offset, ftdi->readbuffer+ftdi->readbuffer_offset, actual_length);
-                //printf("buf[0] = %X, buf[1] = %X\n", buf[0], buf[1]);
-                offset += actual_length;
-
-                /* Did we read exactly the right amount of bytes? */
-                if (offset == size)
-                    //printf("read_data exact rem %d offset %d\n",
-                    //ftdi->readbuffer_remaining, offset);
-                    return offset;
-            }
-            else
-            {
-                // only copy part of the data or size <= readbuffer_chunksize
-                int part_size = size-offset;
-                memcpy (buf+offset, ftdi->readbuffer+ftdi->readbuffer_offset, part_size);
+            unsigned char *data = ftdi->readbuffer + ftdi->readbuffer_offset;
+            unsigned char *hit;
+            int len = ftdi->readbuffer_remaining;
+
+            if (len > size - offset)
+                len = size - offset;
 
-                ftdi->readbuffer_offset += part_size;
-                ftdi->readbuffer_remaining = actual_length-part_size;
-                offset += part_size;
+            hit = ftdi_find_delimiter(data, len, delims, num_delims);
+            if (hit != NULL)
+                len = hit - data + 1;
 
-                /* printf("Returning part: %d - size: %d - offset: %d - actual_length: %d - remaining: %d\n",
-                part_size, size, offset, actual_length, ftdi->readbuffer_remaining); */
+            memcpy (buf + offset, data, len);
+            offset += len;
+            ftdi->readbuffer_remaining -= len;
+            ftdi->readbuffer_offset += len;
 
+            if (hit != NULL || offset == size)
+            {
+                ftdi_unlock(ftdi);
                 return offset;
             }
         }
+        ftdi_unlock(ftdi);
+
+        actual_length = ftdi_read_data_fill(ftdi);
+        if (actual_length < 0)
+            return actual_length;
+
+        // no more data to read?
+        if (actual_length <= 2)
+        {
+            if (timeout <= 0 || ftdi_elapsed_ms(&start) >= timeout)
+                return offset;
+            continue;
+        }
+
+        // strip the status bytes in place, all payload stays in the readbuffer
+        ftdi_lock(ftdi);
+        ftdi_read_data_deframe(ftdi, actual_length, buf + offset, 0);
+        ftdi_unlock(ftdi);
     }
-    // never reached
-    return -127;
 }
 
 /**
     Configure read buffer chunk size.
     Default is 4096.
 
-    Automatically reallocates the buffer.
+    Automatically reallocates the buffer. The read-ahead transfers
+    get restarted with the new size.
 
     \param ftdi pointer to ftdi_context
     \param chunksize Chunk size
 
     \retval 0: all fine
     \retval -1: ftdi context invalid
+    \retval -2: restarting the read-ahead transfers failed
 */
 int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
 {
     unsigned char *new_buf;
+    int readahead_depth = 0;
 
     if (ftdi == NULL)
         ftdi_error_return(-1, "ftdi context invalid");
 
     // Invalidate all remaining data
+    ftdi_lock(ftdi);
     ftdi->readbuffer_offset = 0;
     ftdi->readbuffer_remaining = 0;
+    ftdi_unlock(ftdi);
 #ifdef __linux__
     /* We can't set readbuffer_chunksize larger than MAX_BULK_BUFFER_LENGTH,
        which is defined in libusb-1.0.  Otherwise, each USB read request will
@@ -2149,12 +4031,21 @@ int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksi
         chunksize = 16384;
 #endif
 
+    if (ftdi->readahead != NULL)
+    {
+        readahead_depth = ftdi->readahead->depth;
+        ftdi_readahead_stop(ftdi);
+    }
+
     if ((new_buf = (unsigned char *)realloc(ftdi->readbuffer, chunksize)) == NULL)
         ftdi_error_return(-1, "out of memory for readbuffer");
 
     ftdi->readbuffer = new_buf;
     ftdi->readbuffer_chunksize = chunksize;
 
+    if (readahead_depth > 0 && ftdi_readahead_start(ftdi, readahead_depth) < 0)
+        ftdi_error_return(-2, "Restarting the read-ahead transfers failed");
+
     return 0;
 }
 
@@ -2176,6 +4067,115 @@ int ftdi_read_data_get_chunksize(struct ftdi_context *ftdi, unsigned int *chunks
     return 0;
 }
 
+/**
+    Enable/disable the adaptive transfer size of the read functions.
+    Default is disabled.
+
+    When enabled, the size of the bulk transfers follows the traffic, in
+    multiples of the USB packet size between one packet and the read chunk
+    size: it grows while the transfers come back full and shrinks while they
+    stay mostly empty. Bulk traffic gets large transfers for throughput,
+    sparse traffic small ones for low latency. The read chunk size, see
+    ftdi_read_data_set_chunksize(), is the upper limit.
+
+    \param ftdi pointer to ftdi_context
+    \param enable 1 to enable, 0 to always use the read chunk size
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+*/
+int ftdi_read_data_set_adaptive(struct ftdi_context *ftdi, int enable)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    ftdi->read_adaptive = enable ? 1 : 0;
+    ftdi->read_transfer_size = 0;
+    return 0;
+}
+
+/**
+    Get the size of the next bulk IN transfer of the read functions.
+    Differs from the read chunk size in adaptive mode only.
+
+    \param ftdi pointer to ftdi_context
+    \param size Pointer to store the transfer size in
+
+    \retval  0: all fine
+    \retval -1: FTDI context invalid
+*/
+int ftdi_read_data_get_transfer_size(struct ftdi_context *ftdi, unsigned int *size)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "FTDI context invalid");
+
+    *size = ftdi_read_transfer_size(ftdi);
+    return 0;
+}
+
+/**
+    Configure the read-ahead of ftdi_read_data().
+    Default is 0 (disabled).
+
+    ftdi_read_data() normally issues one blocking bulk transfer at a time.
+    Between two calls nobody fetches data from the chip and at high data
+    rates its FIFO overflows. With a read-ahead depth > 0, this number of
+    bulk transfers of the read chunk size stays submitted all the time and
+    ftdi_read_data() takes the data from the oldest completed one.
+
+    Only use ftdi_read_data() to read while the read-ahead is enabled,
+    ftdi_read_data_submit() fails and ftdi_readstream() would compete for
+    the data. Data in transfers that were not consumed yet is discarded when
+    the depth is changed or the RX buffer is purged. Closing the device
+    disables the read-ahead. Not available while the context is attached
+    to a running event loop, see ftdi_event_loop_start().
+
+    \param ftdi pointer to ftdi_context
+    \param depth Number of transfers to keep in flight, 0 disables the read-ahead
+
+    \retval  0: all fine
+    \retval -1: invalid depth
+    \retval -2: USB device unavailable
+    \retval -3: submitting the read-ahead transfers failed
+    \retval -4: attached to a running event loop
+*/
+int ftdi_read_data_set_readahead(struct ftdi_context *ftdi, int depth)
+{
+    if (depth < 0)
+        ftdi_error_return(-1, "invalid read-ahead depth");
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-2, "USB device unavailable");
+
+    if (depth > 0 && ftdi_event_loop_running(ftdi))
+        ftdi_error_return(-4, "attached to a running event loop");
+
+    ftdi_readahead_stop(ftdi);
+
+    if (depth > 0 && ftdi_readahead_start(ftdi, depth) < 0)
+        ftdi_error_return(-3, "Submitting the read-ahead transfers failed");
+
+    return 0;
+}
+
+/**
+    Get the read-ahead depth of ftdi_read_data().
+
+    \param ftdi pointer to ftdi_context
+    \param depth Pointer to store the number of transfers kept in flight in
+
+    \retval  0: all fine
+    \retval -1: FTDI context invalid
+*/
+int ftdi_read_data_get_readahead(struct ftdi_context *ftdi, int *depth)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "FTDI context invalid");
+
+    *depth = ftdi->readahead ? ftdi->readahead->depth : 0;
+    return 0;
+}
+
 /**
     Enable/disable bitbang modes.
 
@@ -2195,9 +4195,13 @@ int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char bitmask, unsigned
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
+    // buffered data was meant for the old mode
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
     usb_val = bitmask; // low byte: bitmask
     usb_val |= (mode << 8);
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_BITMODE_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_BITMODE_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "unable to configure bitbang mode. Perhaps not a BM/2232C type chip?");
 
     ftdi->bitbang_mode = mode;
@@ -2219,7 +4223,10 @@ int ftdi_disable_bitbang(struct ftdi_context *ftdi)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_BITMODE_REQUEST, 0, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_BITMODE_REQUEST, 0, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "unable to leave bitbang mode. Perhaps not a BM type chip?");
 
     ftdi->bitbang_enabled = 0;
@@ -2242,7 +4249,10 @@ int ftdi_read_pins(struct ftdi_context *ftdi, unsigned char *pins)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE, SIO_READ_PINS_REQUEST, 0, ftdi->index, (unsigned char *)pins, 1, ftdi->usb_read_timeout) != 1)
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE, SIO_READ_PINS_REQUEST, 0, ftdi->index, (unsigned char *)pins, 1, ftdi->usb_read_timeout) != 1)
         ftdi_error_return(-1, "read pins failed");
 
     return 0;
@@ -2274,7 +4284,12 @@ int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency)
         ftdi_error_return(-3, "USB device unavailable");
 
     usb_val = latency;
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_LATENCY_TIMER_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
+
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-2, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_LATENCY_TIMER_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-2, "unable to set latency timer");
 
     return 0;
@@ -2297,7 +4312,7 @@ int ftdi_get_latency_timer(struct ftdi_context *ftdi, unsigned char *latency)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE, SIO_GET_LATENCY_TIMER_REQUEST, 0, ftdi->index, (unsigned char *)&usb_val, 1, ftdi->usb_read_timeout) != 1)
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE, SIO_GET_LATENCY_TIMER_REQUEST, 0, ftdi->index, (unsigned char *)&usb_val, 1, ftdi->usb_read_timeout) != 1)
         ftdi_error_return(-1, "reading latency timer failed");
 
     *latency = (unsigned char)usb_val;
@@ -2351,7 +4366,7 @@ int ftdi_poll_modem_status(struct ftdi_context *ftdi, unsigned short *status)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE, SIO_POLL_MODEM_STATUS_REQUEST, 0, ftdi->index, (unsigned char *)usb_val, 2, ftdi->usb_read_timeout) != 2)
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE, SIO_POLL_MODEM_STATUS_REQUEST, 0, ftdi->index, (unsigned char *)usb_val, 2, ftdi->usb_read_timeout) != 2)
         ftdi_error_return(-1, "getting modem status failed");
 
     *status = (usb_val[1] << 8) | (usb_val[0] & 0xFF);
@@ -2359,6 +4374,71 @@ int ftdi_poll_modem_status(struct ftdi_context *ftdi, unsigned short *status)
     return 0;
 }
 
+/**
+    Get the modem status received with the last data
+
+    Every packet the chip sends starts with the two status bytes
+    described at ftdi_poll_modem_status(). The read functions remember
+    the status of the last packet they received, so this function
+    doesn't cause any USB traffic. The status is as recent as the last
+    call to ftdi_read_data() or ftdi_read_data_submit().
+
+    \param ftdi pointer to ftdi_context
+    \param status Pointer to store status information in. Same layout as
+           ftdi_poll_modem_status().
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+*/
+int ftdi_get_modem_status(struct ftdi_context *ftdi, unsigned short *status)
+{
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    ftdi_lock(ftdi);
+    *status = ftdi->modem_status;
+    ftdi_unlock(ftdi);
+    return 0;
+}
+
+/**
+    Fetch the modem status changes seen by the read functions
+
+    Whenever a bit of FTDI_STATUS_EVENT_MASK (modem lines and receive
+    errors) changes from one packet to the next, the read functions record
+    the new status together with the number of payload bytes received
+    before it. This allows to locate overrun, parity and framing errors
+    in the data stream without calling ftdi_poll_modem_status().
+
+    At most FTDI_STATUS_EVENTS changes are kept, older ones get overwritten.
+    The returned events are removed, oldest first.
+
+    \param ftdi pointer to ftdi_context
+    \param events Array to store the events in
+    \param max_events Size of the array
+
+    \retval >=0: number of events stored
+    \retval  -1: ftdi context invalid
+*/
+int ftdi_read_status_events(struct ftdi_context *ftdi, struct ftdi_status_event *events, int max_events)
+{
+    int count = 0;
+
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    ftdi_lock(ftdi);
+    while (count < max_events && ftdi->status_events_count > 0)
+    {
+        events[count++] = ftdi->status_events[ftdi->status_events_first];
+        ftdi->status_events_first = (ftdi->status_events_first + 1) % FTDI_STATUS_EVENTS;
+        ftdi->status_events_count--;
+    }
+    ftdi_unlock(ftdi);
+
+    return count;
+}
+
 /**
     Set flowcontrol for ftdi chip
 
@@ -2377,7 +4457,11 @@ int ftdi_setflowctrl(struct ftdi_context *ftdi, int flowctrl)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_FLOW_CTRL_REQUEST, 0, (flowctrl | ftdi->index),
                                 NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "set flow control failed");
@@ -2402,7 +4486,12 @@ int ftdi_setflowctrl_xonxoff(struct ftdi_context *ftdi, unsigned char xon, unsig
         ftdi_error_return(-2, "USB device unavailable");
 
     uint16_t xonxoff = xon | (xoff << 8);
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_FLOW_CTRL_REQUEST, xonxoff, (SIO_XON_XOFF_HS | ftdi->index),
                                 NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "set flow control failed");
@@ -2432,7 +4521,11 @@ int ftdi_setdtr(struct ftdi_context *ftdi, int state)
     else
         usb_val = SIO_SET_DTR_LOW;
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_MODEM_CTRL_REQUEST, usb_val, ftdi->index,
                                 NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "set dtr failed");
@@ -2462,7 +4555,11 @@ int ftdi_setrts(struct ftdi_context *ftdi, int state)
     else
         usb_val = SIO_SET_RTS_LOW;
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_MODEM_CTRL_REQUEST, usb_val, ftdi->index,
                                 NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "set of rts failed");
@@ -2498,7 +4595,11 @@ int ftdi_setdtr_rts(struct ftdi_context *ftdi, int dtr, int rts)
     else
         usb_val |= SIO_SET_RTS_LOW;
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_SET_MODEM_CTRL_REQUEST, usb_val, ftdi->index,
                                 NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "set of rts/dtr failed");
@@ -2529,7 +4630,11 @@ int ftdi_set_event_char(struct ftdi_context *ftdi,
     if (enable)
         usb_val |= 1 << 8;
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_EVENT_CHAR_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_EVENT_CHAR_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "setting event character failed");
 
     return 0;
@@ -2558,7 +4663,11 @@ int ftdi_set_error_char(struct ftdi_context *ftdi,
     if (enable)
         usb_val |= 1 << 8;
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_ERROR_CHAR_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
+    // buffered data goes out with the old settings
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-1, "unable to send the buffered data");
+
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_SET_ERROR_CHAR_REQUEST, usb_val, ftdi->index, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "setting error character failed");
 
     return 0;
@@ -4431,7 +6540,7 @@ int ftdi_read_eeprom_location (struct ftdi_context *ftdi, int eeprom_addr, unsig
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE, SIO_READ_EEPROM_REQUEST, 0, eeprom_addr, buf, 2, ftdi->usb_read_timeout) != 2)
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE, SIO_READ_EEPROM_REQUEST, 0, eeprom_addr, buf, 2, ftdi->usb_read_timeout) != 2)
         ftdi_error_return(-1, "reading eeprom failed");
 
     *eeprom_val = (0xff & buf[0]) | (buf[1] << 8);
@@ -4459,8 +6568,7 @@ int ftdi_read_eeprom(struct ftdi_context *ftdi)
 
     for (i = 0; i < FTDI_MAX_EEPROM_SIZE/2; i++)
     {
-        if (libusb_control_transfer(
-                    ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE,SIO_READ_EEPROM_REQUEST, 0, i,
+        if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE,SIO_READ_EEPROM_REQUEST, 0, i,
                     buf+(i*2), 2, ftdi->usb_read_timeout) != 2)
             ftdi_error_return(-1, "reading eeprom failed");
     }
@@ -4514,10 +6622,10 @@ int ftdi_read_chipid(struct ftdi_context *ftdi, unsigned int *chipid)
     if (ftdi == NULL || ftdi->usb_dev == NULL)
         ftdi_error_return(-2, "USB device unavailable");
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE, SIO_READ_EEPROM_REQUEST, 0, 0x43, (unsigned char *)&a, 2, ftdi->usb_read_timeout) == 2)
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE, SIO_READ_EEPROM_REQUEST, 0, 0x43, (unsigned char *)&a, 2, ftdi->usb_read_timeout) == 2)
     {
         a = a << 8 | a >> 8;
-        if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_IN_REQTYPE, SIO_READ_EEPROM_REQUEST, 0, 0x44, (unsigned char *)&b, 2, ftdi->usb_read_timeout) == 2)
+        if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_IN_REQTYPE, SIO_READ_EEPROM_REQUEST, 0, 0x44, (unsigned char *)&b, 2, ftdi->usb_read_timeout) == 2)
         {
             b = b << 8 | b >> 8;
             a = (a << 16) | (b & 0xFFFF);
@@ -4583,7 +6691,7 @@ int ftdi_write_eeprom_location(struct ftdi_context *ftdi, int eeprom_addr,
         ftdi_error_return(-6, "EEPROM is not of 93x66");
     }
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_WRITE_EEPROM_REQUEST, eeprom_val, eeprom_addr,
                                 NULL, 0, ftdi->usb_write_timeout) != 0)
         ftdi_error_return(-1, "unable to write eeprom");
@@ -4632,7 +6740,7 @@ int ftdi_write_eeprom(struct ftdi_context *ftdi)
         }
         usb_val = eeprom[i*2];
         usb_val += eeprom[(i*2)+1] << 8;
-        if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+        if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                     SIO_WRITE_EEPROM_REQUEST, usb_val, i,
                                     NULL, 0, ftdi->usb_write_timeout) < 0)
             ftdi_error_return(-1, "unable to write eeprom");
@@ -4668,7 +6776,7 @@ int ftdi_erase_eeprom(struct ftdi_context *ftdi)
         return 0;
     }
 
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_ERASE_EEPROM_REQUEST,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_ERASE_EEPROM_REQUEST,
                                 0, 0, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "unable to erase eeprom");
 
@@ -4677,7 +6785,7 @@ int ftdi_erase_eeprom(struct ftdi_context *ftdi)
        Chip is 93x46 if magic is read at word position 0x00, as wraparound happens around 0x40
        Chip is 93x56 if magic is read at word position 0x40, as wraparound happens around 0x80
        Chip is 93x66 if magic is only read at word position 0xc0*/
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE,
                                 SIO_WRITE_EEPROM_REQUEST, MAGIC, 0xc0,
                                 NULL, 0, ftdi->usb_write_timeout) != 0)
         ftdi_error_return(-3, "Writing magic failed");
@@ -4705,7 +6813,7 @@ int ftdi_erase_eeprom(struct ftdi_context *ftdi)
             }
         }
     }
-    if (libusb_control_transfer(ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE, SIO_ERASE_EEPROM_REQUEST,
+    if (ftdi->backend->control_transfer(ftdi, FTDI_DEVICE_OUT_REQTYPE, SIO_ERASE_EEPROM_REQUEST,
                                 0, 0, NULL, 0, ftdi->usb_write_timeout) < 0)
         ftdi_error_return(-1, "unable to erase eeprom");
     return 0;
@@ -253,6 +253,80 @@ enum ftdi_module_detach_mode
 #endif
 #endif
 
+/** Number of modem status changes remembered by the read functions */
+#define FTDI_STATUS_EVENTS 16
+
+/** Status bits that generate a status event: CTS, DSR, RI, RLSD and the
+    overrun, parity, framing, break and RCVR FIFO error bits */
+#define FTDI_STATUS_EVENT_MASK 0x9ef0
+
+/**
+    \brief Modem status change found in the data stream
+
+    See ftdi_read_status_events()
+*/
+struct ftdi_status_event
+{
+    /** Number of payload bytes received before the changed status */
+    uint64_t offset;
+    /** New status, same layout as ftdi_poll_modem_status() */
+    unsigned short status;
+};
+
+/** Echo round trip used by ftdi_profile_latency() */
+enum ftdi_profile_method
+{
+    /** Write one byte and read it back, needs a loopback in UART or FIFO mode */
+    PROFILE_LOOPBACK = 0,
+    /** GET_BITS_LOW and SEND_IMMEDIATE, the chip must be in MPSSE mode */
+    PROFILE_MPSSE = 1
+};
+
+/**
+    \brief Candidate settings for ftdi_profile_latency() and their result
+
+    The settings are filled in by the caller, the round trip times in
+    microseconds by ftdi_profile_latency().
+*/
+struct ftdi_latency_profile
+{
+    /** Latency timer in milliseconds */
+    unsigned char latency;
+    /** Read chunk size, 0 keeps the current one */
+    unsigned int chunksize;
+    /** Event character, written as the echo byte if enabled */
+    unsigned char event_char;
+    /** Enable the event character */
+    unsigned char event_char_enable;
+
+    /** Fastest round trip */
+    unsigned int min;
+    /** Median round trip */
+    unsigned int p50;
+    /** 90th percentile */
+    unsigned int p90;
+    /** 99th percentile */
+    unsigned int p99;
+    /** Slowest round trip */
+    unsigned int max;
+    /** Number of failed round trips */
+    int errors;
+};
+
+struct ftdi_transfer_control;
+
+/**
+    \brief Completion callback of ftdi_read_data_submit_cb() and
+    ftdi_write_data_submit_cb()
+
+    result is what ftdi_transfer_data_done() would return: the number of
+    bytes transferred or < 0 on errors. tc is released after the callback,
+    it must not be passed to ftdi_transfer_data_done() or
+    ftdi_transfer_data_cancel().
+*/
+typedef void (FTDITransferCallback)(struct ftdi_transfer_control *tc, int result,
+                                    void *userdata);
+
 struct ftdi_transfer_control
 {
     int completed;
@@ -261,6 +335,14 @@ struct ftdi_transfer_control
     int offset;
     struct ftdi_context *ftdi;
     struct libusb_transfer *transfer;
+    /** Segments of ftdi_write_datav_submit(), NULL for the other transfers */
+    struct ftdi_gather *gather;
+    /** Next free transfer control in the pool of the context */
+    struct ftdi_transfer_control *next;
+    /** Completion callback, see ftdi_read_data_submit_cb(). NULL if none */
+    FTDITransferCallback *callback;
+    /** User data passed to the completion callback */
+    void *userdata;
 };
 
 /**
@@ -321,6 +403,68 @@ struct ftdi_context
 
     /** Defines behavior in case a kernel module is already attached to the device */
     enum ftdi_module_detach_mode module_detach_mode;
+
+    /** Last modem status received with the data, see ftdi_get_modem_status() */
+    unsigned short modem_status;
+    /** Number of payload bytes received since the device was opened */
+    uint64_t read_total;
+    /** Ring buffer of modem status changes, see ftdi_read_status_events() */
+    struct ftdi_status_event status_events[FTDI_STATUS_EVENTS];
+    /** Index of the oldest entry in status_events */
+    unsigned int status_events_first;
+    /** Number of valid entries in status_events */
+    unsigned int status_events_count;
+
+    /** Read-ahead queue of ftdi_read_data(), NULL if disabled */
+    struct ftdi_readahead *readahead;
+    /** Background reader thread, see ftdi_reader_start(). NULL if not running */
+    struct ftdi_reader *reader;
+
+    /** Adaptive read transfer size enabled, see ftdi_read_data_set_adaptive() */
+    int read_adaptive;
+    /** Current read transfer size in adaptive mode, 0 if not determined yet */
+    unsigned int read_transfer_size;
+    /** Average fill level of the read transfers in 1/256 */
+    int read_fill_avg;
+
+    /** Number of write chunks kept in flight, see ftdi_write_data_set_queue_depth() */
+    int write_queue_depth;
+
+    /** Buffer of the buffered write mode, NULL if disabled, see ftdi_write_data_set_buffer() */
+    unsigned char *write_buffer;
+    /** Size of write_buffer */
+    unsigned int write_buffer_size;
+    /** Number of bytes waiting in write_buffer */
+    unsigned int write_buffer_used;
+    /** Time in milliseconds data may wait in write_buffer, -1 for no limit */
+    int write_buffer_delay;
+    /** Time the oldest byte in write_buffer was queued */
+    struct timeval write_buffer_since;
+
+    /** Free transfer controls of the async functions, see ftdi_set_transfer_pool() */
+    struct ftdi_transfer_control *tc_pool;
+    /** Number of transfer controls in tc_pool */
+    int tc_pool_count;
+    /** Maximum number of transfer controls kept in tc_pool */
+    int tc_pool_size;
+
+    /** Shared event loop providing usb_ctx, see ftdi_set_event_loop(). NULL if none */
+    struct ftdi_event_loop *event_loop;
+    /** Guards the state shared with the event thread, NULL if not attached */
+    struct ftdi_state_lock *state_lock;
+
+    /** Transport the device is accessed through, libusb unless emulated */
+    const struct ftdi_backend *backend;
+    /** Private state of the backend */
+    void *backend_data;
+
+    /** Number of bulk transfers reading from the chip since the device was opened */
+    uint64_t bulk_in_transfers;
+    /** Number of bulk transfers writing to the chip since the device was opened */
+    uint64_t bulk_out_transfers;
+
+    /** Traffic recording, see ftdi_capture_start(). NULL if not capturing */
+    struct ftdi_capture *capture;
 };
 
 /**
@@ -473,7 +617,7 @@ enum ftdi_cbusx_func
 #define HIGH_CURRENT_DRIVE_R 0x04
 
 /**
-    \brief Progress Info for streaming read
+    \brief Progress Info for streaming read and write
 */
 struct size_and_time
 {
@@ -494,6 +638,31 @@ typedef struct
 typedef int (FTDIStreamCallback)(uint8_t *buffer, int length,
                                  FTDIProgressInfo *progress, void *userdata);
 
+/**
+    \brief Payload of one USB packet, see ftdi_readstreamv(),
+    or one segment of the data for ftdi_write_datav()
+*/
+struct ftdi_iovec
+{
+    /** Start of the payload, behind the modem status bytes */
+    uint8_t *iov_base;
+    /** Number of payload bytes */
+    int iov_len;
+};
+
+typedef int (FTDIStreamVecCallback)(struct ftdi_iovec *iov, int iovcnt,
+                                    FTDIProgressInfo *progress, void *userdata);
+
+/**
+    \brief Data source of ftdi_writestream()
+
+    Fill buffer with up to length bytes and return their number,
+    0 at the end of the data or a negative value to abort.
+    Progress is reported with buffer = NULL.
+*/
+typedef int (FTDIWriteStreamCallback)(uint8_t *buffer, int length,
+                                      FTDIProgressInfo *progress, void *userdata);
+
 /**
  * Provide libftdi version information
  * major: Library major version
@@ -555,6 +724,8 @@ extern "C"
     int ftdi_usb_open_bus_addr(struct ftdi_context *ftdi, uint8_t bus, uint8_t addr);
     int ftdi_usb_open_dev(struct ftdi_context *ftdi, struct libusb_device *dev);
     int ftdi_usb_open_string(struct ftdi_context *ftdi, const char* description);
+    int ftdi_usb_open_emulated(struct ftdi_context *ftdi, enum ftdi_chip_type type, int loopback);
+    int ftdi_usb_open_replay(struct ftdi_context *ftdi, const char *filename, double speed);
 
     int ftdi_usb_close(struct ftdi_context *ftdi);
     int ftdi_usb_reset(struct ftdi_context *ftdi);
@@ -573,20 +744,66 @@ extern "C"
                                 enum ftdi_break_type break_type);
 
     int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size);
+    int ftdi_read_data_blocking(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                                int vmin, int vtime);
+    int ftdi_read_data_until(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                             const unsigned char *delims, int num_delims, int timeout);
     int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize);
     int ftdi_read_data_get_chunksize(struct ftdi_context *ftdi, unsigned int *chunksize);
+    int ftdi_read_data_set_readahead(struct ftdi_context *ftdi, int depth);
+    int ftdi_read_data_get_readahead(struct ftdi_context *ftdi, int *depth);
+    int ftdi_read_data_set_adaptive(struct ftdi_context *ftdi, int enable);
+    int ftdi_read_data_get_transfer_size(struct ftdi_context *ftdi, unsigned int *size);
 
     int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size);
     int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize);
     int ftdi_write_data_get_chunksize(struct ftdi_context *ftdi, unsigned int *chunksize);
+    int ftdi_write_data_set_queue_depth(struct ftdi_context *ftdi, int depth);
+    int ftdi_write_data_get_queue_depth(struct ftdi_context *ftdi, int *depth);
+    int ftdi_write_data_set_buffer(struct ftdi_context *ftdi, unsigned int size, int delay);
+    int ftdi_write_data_flush(struct ftdi_context *ftdi);
 
     int ftdi_readstream(struct ftdi_context *ftdi, FTDIStreamCallback *callback,
                         void *userdata, int packetsPerTransfer, int numTransfers);
+    int ftdi_readstream_generic(struct ftdi_context *ftdi, FTDIStreamCallback *callback,
+                                void *userdata, int packetsPerTransfer, int numTransfers);
+    int ftdi_readstreamv(struct ftdi_context *ftdi, FTDIStreamVecCallback *callback,
+                         void *userdata, int packetsPerTransfer, int numTransfers);
+    int ftdi_writestream(struct ftdi_context *ftdi, FTDIWriteStreamCallback *callback,
+                         void *userdata, int packetsPerTransfer, int numTransfers);
     struct ftdi_transfer_control *ftdi_write_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size);
+    int ftdi_write_datav(struct ftdi_context *ftdi, const struct ftdi_iovec *iov, int iovcnt);
+    struct ftdi_transfer_control *ftdi_write_datav_submit(struct ftdi_context *ftdi,
+            const struct ftdi_iovec *iov, int iovcnt);
 
     struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size);
+    int ftdi_write_data_submit_cb(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                                  FTDITransferCallback *callback, void *userdata);
+    int ftdi_read_data_submit_cb(struct ftdi_context *ftdi, unsigned char *buf, int size,
+                                 FTDITransferCallback *callback, void *userdata);
     int ftdi_transfer_data_done(struct ftdi_transfer_control *tc);
+    int ftdi_transfer_data_wait(struct ftdi_transfer_control *tc, int timeout);
+    int ftdi_transfer_data_wait_until(struct ftdi_transfer_control *tc,
+                                      const struct timeval *deadline);
+    int ftdi_transfer_data_wait_any(struct ftdi_transfer_control **tcs, int count, int timeout);
+    int ftdi_transfer_data_wait_all(struct ftdi_transfer_control **tcs, int count, int timeout);
     void ftdi_transfer_data_cancel(struct ftdi_transfer_control *tc, struct timeval * to);
+    int ftdi_transact(struct ftdi_context *ftdi, const unsigned char *wbuf, int wsize,
+                      unsigned char *rbuf, int rsize);
+    int ftdi_set_transfer_pool(struct ftdi_context *ftdi, int size);
+
+    struct ftdi_event_loop *ftdi_event_loop_new(void);
+    int ftdi_event_loop_start(struct ftdi_event_loop *loop, int cpu, int priority);
+    int ftdi_event_loop_stop(struct ftdi_event_loop *loop);
+    int ftdi_event_loop_free(struct ftdi_event_loop *loop);
+    int ftdi_set_event_loop(struct ftdi_context *ftdi, struct ftdi_event_loop *loop);
+
+    int ftdi_reader_start(struct ftdi_context *ftdi, unsigned int ring_size);
+    int ftdi_reader_stop(struct ftdi_context *ftdi);
+    int ftdi_reader_peek(struct ftdi_context *ftdi, unsigned char **data);
+    int ftdi_reader_consume(struct ftdi_context *ftdi, int size);
+    int ftdi_reader_wait(struct ftdi_context *ftdi, int timeout);
+    int ftdi_reader_get_dropped(struct ftdi_context *ftdi, unsigned long *dropped);
 
     int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode);
     int ftdi_disable_bitbang(struct ftdi_context *ftdi);
@@ -596,6 +813,8 @@ extern "C"
     int ftdi_get_latency_timer(struct ftdi_context *ftdi, unsigned char *latency);
 
     int ftdi_poll_modem_status(struct ftdi_context *ftdi, unsigned short *status);
+    int ftdi_get_modem_status(struct ftdi_context *ftdi, unsigned short *status);
+    int ftdi_read_status_events(struct ftdi_context *ftdi, struct ftdi_status_event *events, int max_events);
 
     /* flow control */
     int ftdi_setflowctrl(struct ftdi_context *ftdi, int flowctrl);
@@ -607,6 +826,13 @@ extern "C"
     int ftdi_set_event_char(struct ftdi_context *ftdi, unsigned char eventch, unsigned char enable);
     int ftdi_set_error_char(struct ftdi_context *ftdi, unsigned char errorch, unsigned char enable);
 
+    int ftdi_profile_latency(struct ftdi_context *ftdi, enum ftdi_profile_method method,
+                             struct ftdi_latency_profile *profiles, int count, int rounds);
+    int ftdi_profile_best(const struct ftdi_latency_profile *profiles, int count);
+
+    int ftdi_capture_start(struct ftdi_context *ftdi, const char *filename);
+    int ftdi_capture_stop(struct ftdi_context *ftdi);
+
     /* init eeprom for the given FTDI type */
     int ftdi_eeprom_initdefaults(struct ftdi_context *ftdi,
                                  char * manufacturer, char *product,
@@ -0,0 +1,1041 @@
+/***************************************************************************
+                          ftdi_capture.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Capture and replay of USB traffic
+ *
+ * ftdi_capture_start() puts a recording transport in front of the one of
+ * the open device. It logs every control and bulk transfer to a file.
+ * ftdi_usb_open_replay() opens such a file as a device: reads get the
+ * recorded data with the recorded timing, so the read, write and stream
+ * paths can be profiled against real traffic without the hardware.
+ *
+ * The file starts with a 16 byte header:
+ *
+ *   0  "FTDICAP" and the format version 1
+ *   8  chip type, one byte, then one reserved byte
+ *   10 max packet size, 16 bit
+ *   12 reserved, 32 bit
+ *
+ * followed by one record per transfer, a 32 byte header and the data:
+ *
+ *   0  kind: 1 control, 2 synchronous bulk, 3 async bulk
+ *   1  request type of a control transfer, endpoint of a bulk one
+ *   2  request of a control transfer
+ *   3  libusb_transfer_status of an async transfer
+ *   4  value and index of a control transfer, 16 bit each
+ *   8  result of the call, the submit for async transfers, signed 32 bit
+ *   12 requested length, 32 bit
+ *   16 transferred length, 32 bit, that many data bytes follow the header
+ *   20 start in microseconds since the capture started, 64 bit
+ *   28 duration in microseconds, 32 bit
+ *
+ * All numbers are little endian. The data is what went over the wire in
+ * either direction, the bulk IN data including the modem status bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <libusb.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+#define CAPTURE_MAGIC "FTDICAP\001"
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_SIZE 32
+
+#define CAPTURE_CONTROL 1
+#define CAPTURE_BULK    2
+#define CAPTURE_ASYNC   3
+
+/** Async transfer in flight while capturing, its callback is borrowed.
+    Freed by the callback, cap is NULL once the capture stopped. */
+struct ftdi_capture_pending
+{
+    struct ftdi_context *ftdi;
+    struct ftdi_capture *cap;
+    struct libusb_transfer *transfer;
+    libusb_transfer_cb_fn callback;
+    void *user_data;
+    struct timeval submitted;
+    struct ftdi_capture_pending *prev;
+    struct ftdi_capture_pending *next;
+};
+
+struct ftdi_capture
+{
+    /** Transport the traffic really goes through */
+    const struct ftdi_backend *inner;
+    FILE *file;
+    struct timeval started;
+    /** Set once writing to the file failed */
+    int failed;
+    /** Async transfers in flight */
+    struct ftdi_capture_pending *pending;
+};
+
+struct ftdi_replay_record
+{
+    int kind;
+    int endpoint;
+    int request;
+    int status;
+    int value;
+    int index;
+    int result;
+    int length;
+    int actual;
+    long duration;
+    const unsigned char *data;
+};
+
+struct ftdi_replay_queued
+{
+    struct libusb_transfer *transfer;
+    /** NULL once the recording ran out */
+    const struct ftdi_replay_record *record;
+    struct timeval due;
+    /** Recorded as cancelled without data, waits for the cancel */
+    int idle;
+    int cancelled;
+};
+
+struct ftdi_replay
+{
+    /** The whole capture file, the records point into it */
+    unsigned char *file;
+    struct ftdi_replay_record *records;
+    int count;
+    /** Where the search for the next record of each kind starts */
+    int next_control;
+    int next_in;
+    int next_out;
+    /** Time scale, 0 to not wait at all */
+    double speed;
+    /** Submitted async transfers, oldest first */
+    struct ftdi_replay_queued *queue;
+    int queue_count;
+    int queue_size;
+    /** Set while closing, no more transfers are accepted */
+    int gone;
+};
+
+static void ftdi_capture_put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void ftdi_capture_put32(unsigned char *p, unsigned long v)
+{
+    ftdi_capture_put16(p, v & 0xffff);
+    ftdi_capture_put16(p + 2, (v >> 16) & 0xffff);
+}
+
+static unsigned int ftdi_capture_get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long ftdi_capture_get32(const unsigned char *p)
+{
+    return ftdi_capture_get16(p) | ((unsigned long) ftdi_capture_get16(p + 2) << 16);
+}
+
+static uint64_t ftdi_capture_usec(const struct timeval *tv)
+{
+    return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+    Append one record to the capture file, called with the state lock
+    held as async transfers may complete in the event thread
+    \internal
+*/
+static void ftdi_capture_record(struct ftdi_capture *cap, int kind, int endpoint,
+                                int request, int status, int value, int index,
+                                int result, int length, int actual,
+                                const unsigned char *data, const struct timeval *start)
+{
+    unsigned char header[CAPTURE_RECORD_SIZE];
+    struct timeval now;
+    uint64_t offset;
+
+    gettimeofday(&now, NULL);
+    offset = ftdi_capture_usec(start) - ftdi_capture_usec(&cap->started);
+    if (actual < 0 || data == NULL)
+        actual = 0;
+
+    header[0] = kind;
+    header[1] = endpoint;
+    header[2] = request;
+    header[3] = status;
+    ftdi_capture_put16(header + 4, value);
+    ftdi_capture_put16(header + 6, index);
+    ftdi_capture_put32(header + 8, (unsigned long) result);
+    ftdi_capture_put32(header + 12, length);
+    ftdi_capture_put32(header + 16, actual);
+    ftdi_capture_put32(header + 20, (unsigned long) (offset & 0xffffffff));
+    ftdi_capture_put32(header + 24, (unsigned long) (offset >> 32));
+    ftdi_capture_put32(header + 28, ftdi_capture_usec(&now) - ftdi_capture_usec(start));
+
+    if (fwrite(header, sizeof(header), 1, cap->file) != 1 ||
+        (actual > 0 && fwrite(data, actual, 1, cap->file) != 1))
+        cap->failed = 1;
+}
+
+static int ftdi_capture_control_transfer(struct ftdi_context *ftdi, int request_type,
+                                         int request, int value, int index,
+                                         unsigned char *data, int length, int timeout)
+{
+    struct ftdi_capture *cap = ftdi->capture;
+    struct timeval start;
+    int ret;
+
+    gettimeofday(&start, NULL);
+    ret = cap->inner->control_transfer(ftdi, request_type, request, value, index,
+                                       data, length, timeout);
+    ftdi_lock(ftdi);
+    ftdi_capture_record(cap, CAPTURE_CONTROL, request_type, request, 0, value, index,
+                        ret, length, ret, data, &start);
+    ftdi_unlock(ftdi);
+    return ret;
+}
+
+static int ftdi_capture_bulk_transfer(struct ftdi_context *ftdi, int endpoint,
+                                      unsigned char *data, int length,
+                                      int *transferred, int timeout)
+{
+    struct ftdi_capture *cap = ftdi->capture;
+    struct timeval start;
+    int ret;
+
+    gettimeofday(&start, NULL);
+    *transferred = 0;
+    ret = cap->inner->bulk_transfer(ftdi, endpoint, data, length, transferred, timeout);
+    ftdi_lock(ftdi);
+    ftdi_capture_record(cap, CAPTURE_BULK, endpoint, 0, 0, 0, 0,
+                        ret, length, *transferred, data, &start);
+    ftdi_unlock(ftdi);
+    return ret;
+}
+
+static void LIBUSB_CALL ftdi_capture_callback(struct libusb_transfer *transfer)
+{
+    struct ftdi_capture_pending *pending = (struct ftdi_capture_pending *) transfer->user_data;
+    struct ftdi_context *ftdi = pending->ftdi;
+    struct ftdi_capture *cap;
+
+    // may run in the event thread while the application submits
+    ftdi_lock(ftdi);
+    cap = pending->cap;
+    transfer->callback = pending->callback;
+    transfer->user_data = pending->user_data;
+    if (cap != NULL)
+    {
+        ftdi_capture_record(cap, CAPTURE_ASYNC, transfer->endpoint, 0, transfer->status,
+                            0, 0, 0, transfer->length, transfer->actual_length,
+                            transfer->buffer, &pending->submitted);
+
+        if (pending->prev)
+            pending->prev->next = pending->next;
+        else
+            cap->pending = pending->next;
+        if (pending->next)
+            pending->next->prev = pending->prev;
+    }
+    ftdi_unlock(ftdi);
+    free(pending);
+
+    transfer->callback(transfer);
+}
+
+static int ftdi_capture_submit_transfer(struct ftdi_context *ftdi,
+                                        struct libusb_transfer *transfer)
+{
+    struct ftdi_capture *cap = ftdi->capture;
+    struct ftdi_capture_pending *pending;
+    int ret;
+
+    pending = (struct ftdi_capture_pending *) malloc(sizeof(*pending));
+    if (pending == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    pending->ftdi = ftdi;
+    pending->cap = cap;
+    pending->transfer = transfer;
+    pending->callback = transfer->callback;
+    pending->user_data = transfer->user_data;
+    gettimeofday(&pending->submitted, NULL);
+
+    // linked before the transfer can complete in the event thread
+    ftdi_lock(ftdi);
+    pending->prev = NULL;
+    pending->next = cap->pending;
+    if (cap->pending)
+        cap->pending->prev = pending;
+    cap->pending = pending;
+    ftdi_unlock(ftdi);
+
+    transfer->callback = ftdi_capture_callback;
+    transfer->user_data = pending;
+    ret = cap->inner->submit_transfer(ftdi, transfer);
+    if (ret < 0)
+    {
+        transfer->callback = pending->callback;
+        transfer->user_data = pending->user_data;
+
+        ftdi_lock(ftdi);
+        if (pending->prev)
+            pending->prev->next = pending->next;
+        else
+            cap->pending = pending->next;
+        if (pending->next)
+            pending->next->prev = pending->prev;
+        ftdi_capture_record(cap, CAPTURE_ASYNC, transfer->endpoint, 0, 0, 0, 0,
+                            ret, transfer->length, 0, NULL, &pending->submitted);
+        ftdi_unlock(ftdi);
+        free(pending);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int ftdi_capture_cancel_transfer(struct ftdi_context *ftdi,
+                                        struct libusb_transfer *transfer)
+{
+    return ftdi->capture->inner->cancel_transfer(ftdi, transfer);
+}
+
+static int ftdi_capture_handle_events(struct ftdi_context *ftdi, struct timeval *tv,
+                                      int *completed)
+{
+    return ftdi->capture->inner->handle_events(ftdi, tv, completed);
+}
+
+static int ftdi_capture_release_interface(struct ftdi_context *ftdi)
+{
+    return ftdi->capture->inner->release_interface(ftdi);
+}
+
+/**
+    Stop capturing and free the capture state
+    \internal
+
+    \retval  0: all fine
+    \retval -1: writing the capture file failed
+*/
+static int ftdi_capture_finish(struct ftdi_context *ftdi)
+{
+    struct ftdi_capture *cap = ftdi->capture;
+    struct ftdi_capture_pending *pending;
+    int failed;
+
+    /* Transfers outliving the capture complete to their own callbacks,
+       unrecorded. The event thread may be completing one right now, so
+       its node stays for the callback to free */
+    ftdi_lock(ftdi);
+    for (pending = cap->pending; pending != NULL; pending = pending->next)
+        pending->cap = NULL;
+    cap->pending = NULL;
+    failed = cap->failed;
+    ftdi_unlock(ftdi);
+
+    if (fclose(cap->file) != 0)
+        failed = 1;
+    ftdi_transport_lock(ftdi);
+    ftdi->backend = cap->inner;
+    ftdi->capture = NULL;
+    ftdi_transport_unlock(ftdi);
+    free(cap);
+    return failed ? -1 : 0;
+}
+
+/**
+    Internal function to get the transport the traffic really goes
+    through, below a running capture.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+
+    \retval the backend below the capture, ftdi->backend without one
+*/
+const struct ftdi_backend *ftdi_capture_transport(struct ftdi_context *ftdi)
+{
+    return (ftdi->capture != NULL) ? ftdi->capture->inner : ftdi->backend;
+}
+
+static void ftdi_capture_close(struct ftdi_context *ftdi)
+{
+    // the transfers failing on close are still recorded
+    ftdi->capture->inner->close(ftdi);
+    ftdi_capture_finish(ftdi);
+}
+
+static const struct ftdi_backend ftdi_capture_backend =
+{
+    ftdi_capture_control_transfer,
+    ftdi_capture_bulk_transfer,
+    ftdi_capture_submit_transfer,
+    ftdi_capture_cancel_transfer,
+    ftdi_capture_handle_events,
+    ftdi_capture_release_interface,
+    ftdi_capture_close
+};
+
+/**
+    Starts logging the USB traffic of the open device to a file.
+
+    Every control and bulk transfer is recorded with its direction,
+    endpoint, length, data, result and timing until ftdi_capture_stop()
+    or ftdi_usb_close(). The file can be opened as a device with
+    ftdi_usb_open_replay().
+
+    \param ftdi pointer to ftdi_context
+    \param filename File to write, an existing one is overwritten
+
+    \retval  0: all fine
+    \retval -1: no file name given
+    \retval -2: already capturing
+    \retval -3: out of memory
+    \retval -4: can't write the capture file
+    \retval -666: USB device unavailable
+*/
+int ftdi_capture_start(struct ftdi_context *ftdi, const char *filename)
+{
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    struct ftdi_capture *cap;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    if (filename == NULL)
+        ftdi_error_return(-1, "no capture file name given");
+
+    if (ftdi->capture != NULL)
+        ftdi_error_return(-2, "already capturing");
+
+    cap = (struct ftdi_capture *) calloc(1, sizeof(*cap));
+    if (cap == NULL)
+        ftdi_error_return(-3, "out of memory for the capture");
+
+    cap->file = fopen(filename, "wb");
+    if (cap->file == NULL)
+    {
+        free(cap);
+        ftdi_error_return(-4, "can't open the capture file");
+    }
+
+    memcpy(header, CAPTURE_MAGIC, 8);
+    header[8] = ftdi->type;
+    header[9] = 0;
+    ftdi_capture_put16(header + 10, ftdi->max_packet_size);
+    ftdi_capture_put32(header + 12, 0);
+    if (fwrite(header, sizeof(header), 1, cap->file) != 1)
+    {
+        fclose(cap->file);
+        free(cap);
+        ftdi_error_return(-4, "can't write the capture file");
+    }
+
+    gettimeofday(&cap->started, NULL);
+    ftdi_transport_lock(ftdi);
+    cap->inner = ftdi->backend;
+    ftdi->capture = cap;
+    ftdi->backend = &ftdi_capture_backend;
+    ftdi_transport_unlock(ftdi);
+    return 0;
+}
+
+/**
+    Stops logging the USB traffic started with ftdi_capture_start().
+
+    \param ftdi pointer to ftdi_context
+
+    \retval  0: all fine
+    \retval -1: not capturing
+    \retval -2: async transfers still in flight
+    \retval -3: writing the capture file failed, it is incomplete
+*/
+int ftdi_capture_stop(struct ftdi_context *ftdi)
+{
+    if (ftdi == NULL || ftdi->capture == NULL)
+        ftdi_error_return(-1, "not capturing");
+
+    if (ftdi->capture->pending != NULL)
+        ftdi_error_return(-2, "async transfers still in flight");
+
+    if (ftdi_capture_finish(ftdi) < 0)
+        ftdi_error_return(-3, "writing the capture file failed");
+
+    return 0;
+}
+
+static void ftdi_replay_sleep(long usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+/**
+    Time a recorded transfer takes in the replay, in microseconds
+    \internal
+*/
+static long ftdi_replay_duration(struct ftdi_replay *rp, const struct ftdi_replay_record *record)
+{
+    if (rp->speed <= 0)
+        return 0;
+    return (long) (record->duration / rp->speed);
+}
+
+/**
+    libusb error code for the status of an async transfer
+    \internal
+*/
+static int ftdi_replay_error(int status)
+{
+    switch (status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+        case LIBUSB_TRANSFER_CANCELLED:
+            return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+    }
+    return LIBUSB_ERROR_IO;
+}
+
+/**
+    Async transfer status for a libusb error code
+    \internal
+*/
+static int ftdi_replay_status(int result)
+{
+    switch (result)
+    {
+        case 0:
+            return LIBUSB_TRANSFER_COMPLETED;
+        case LIBUSB_ERROR_TIMEOUT:
+            return LIBUSB_TRANSFER_TIMED_OUT;
+        case LIBUSB_ERROR_PIPE:
+            return LIBUSB_TRANSFER_STALL;
+        case LIBUSB_ERROR_NO_DEVICE:
+            return LIBUSB_TRANSFER_NO_DEVICE;
+        case LIBUSB_ERROR_OVERFLOW:
+            return LIBUSB_TRANSFER_OVERFLOW;
+    }
+    return LIBUSB_TRANSFER_ERROR;
+}
+
+/**
+    Whether a record is an async transfer cancelled before any data came
+    \internal
+*/
+static int ftdi_replay_idle(const struct ftdi_replay_record *record)
+{
+    return record->kind == CAPTURE_ASYNC && record->result == 0 &&
+           record->status == LIBUSB_TRANSFER_CANCELLED && record->actual == 0;
+}
+
+/**
+    Next recorded bulk transfer in the given direction
+    \internal
+
+    \param rp replay state
+    \param is_in 1 for the read direction
+    \param skip_idle skip async transfers cancelled before any data came
+
+    \retval the record, NULL if the recording ran out
+*/
+static const struct ftdi_replay_record *ftdi_replay_next(struct ftdi_replay *rp, int is_in,
+                                                         int skip_idle)
+{
+    int *next = is_in ? &rp->next_in : &rp->next_out;
+
+    for (; *next < rp->count; (*next)++)
+    {
+        const struct ftdi_replay_record *record = &rp->records[*next];
+
+        if (record->kind == CAPTURE_CONTROL ||
+            ((record->endpoint & LIBUSB_ENDPOINT_IN) != 0) != is_in)
+            continue;
+        if (skip_idle && ftdi_replay_idle(record))
+            continue;
+
+        (*next)++;
+        return record;
+    }
+    return NULL;
+}
+
+/**
+    Copy recorded IN data to the caller, as much as fits
+    \internal
+*/
+static int ftdi_replay_copy(const struct ftdi_replay_record *record, unsigned char *data,
+                            int length)
+{
+    int n = record->actual < length ? record->actual : length;
+
+    if (n > 0 && (record->endpoint & LIBUSB_ENDPOINT_IN))
+        memcpy(data, record->data, n);
+    return n;
+}
+
+static int ftdi_replay_control_transfer(struct ftdi_context *ftdi, int request_type,
+                                        int request, int value, int index,
+                                        unsigned char *data, int length, int timeout)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    int i;
+
+    (void) timeout;
+
+    for (i = rp->next_control; i < rp->count; i++)
+    {
+        const struct ftdi_replay_record *record = &rp->records[i];
+
+        if (record->kind != CAPTURE_CONTROL || record->endpoint != (request_type & 0xff) ||
+            record->request != (request & 0xff) || record->value != (value & 0xffff) ||
+            record->index != (index & 0xffff))
+            continue;
+
+        rp->next_control = i + 1;
+        ftdi_replay_sleep(ftdi_replay_duration(rp, record));
+        if (record->result < 0)
+            return record->result;
+        return ftdi_replay_copy(record, data, length);
+    }
+
+    // not recorded, answer like an agreeable chip
+    if (request_type & LIBUSB_ENDPOINT_IN)
+    {
+        memset(data, 0, length);
+        return length;
+    }
+    return 0;
+}
+
+static int ftdi_replay_submit_transfer(struct ftdi_context *ftdi,
+                                       struct libusb_transfer *transfer)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    const struct ftdi_replay_record *record;
+    struct ftdi_replay_queued *queued;
+    struct timeval now, wait;
+    long usec;
+
+    if (rp->gone)
+        return LIBUSB_ERROR_NO_DEVICE;
+    ftdi_count_transfer(ftdi, transfer->endpoint);
+
+    if (rp->queue_count == rp->queue_size)
+    {
+        int size = rp->queue_size ? rp->queue_size * 2 : 16;
+
+        queued = (struct ftdi_replay_queued *) realloc(rp->queue, size * sizeof(*queued));
+        if (queued == NULL)
+            return LIBUSB_ERROR_NO_MEM;
+        rp->queue = queued;
+        rp->queue_size = size;
+    }
+
+    record = ftdi_replay_next(rp, (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0, 0);
+    if (record != NULL && record->kind == CAPTURE_ASYNC && record->result < 0)
+        return record->result;
+
+    gettimeofday(&now, NULL);
+    usec = record ? ftdi_replay_duration(rp, record) : 0;
+    wait.tv_sec = usec / 1000000;
+    wait.tv_usec = usec % 1000000;
+
+    transfer->actual_length = 0;
+    queued = &rp->queue[rp->queue_count++];
+    queued->transfer = transfer;
+    queued->record = record;
+    timeradd(&now, &wait, &queued->due);
+    queued->idle = record && ftdi_replay_idle(record);
+    queued->cancelled = 0;
+    return 0;
+}
+
+static int ftdi_replay_cancel_transfer(struct ftdi_context *ftdi,
+                                       struct libusb_transfer *transfer)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    int i;
+
+    for (i = 0; i < rp->queue_count; i++)
+    {
+        if (rp->queue[i].transfer == transfer && !rp->queue[i].cancelled)
+        {
+            rp->queue[i].cancelled = 1;
+            return 0;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/**
+    Complete the transfers queued right now whose recorded time is up
+
+    Transfers complete in order within each direction.
+    \internal
+
+    \retval number of completed transfers
+*/
+static int ftdi_replay_complete(struct ftdi_context *ftdi)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    int count = rp->queue_count;
+    int done = 0, in_blocked = 0, out_blocked = 0;
+    struct timeval now;
+    int i = 0;
+
+    gettimeofday(&now, NULL);
+
+    // transfers submitted by the callbacks wait for the next round
+    while (i < count)
+    {
+        struct libusb_transfer *transfer = rp->queue[i].transfer;
+        const struct ftdi_replay_record *record = rp->queue[i].record;
+        int *blocked = (transfer->endpoint & LIBUSB_ENDPOINT_IN) ? &in_blocked : &out_blocked;
+
+        if (rp->queue[i].cancelled)
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        else if (record == NULL)
+            transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+        else if (*blocked || rp->queue[i].idle || timercmp(&now, &rp->queue[i].due, <))
+        {
+            *blocked = 1;
+            i++;
+            continue;
+        }
+        else
+        {
+            if (record->kind == CAPTURE_ASYNC)
+                transfer->status = record->status == LIBUSB_TRANSFER_CANCELLED ?
+                                   LIBUSB_TRANSFER_COMPLETED : record->status;
+            else
+                transfer->status = ftdi_replay_status(record->result < 0 ? record->result : 0);
+            transfer->actual_length = ftdi_replay_copy(record, transfer->buffer,
+                                                       transfer->length);
+        }
+
+        memmove(&rp->queue[i], &rp->queue[i + 1],
+                (rp->queue_count - i - 1) * sizeof(*rp->queue));
+        rp->queue_count--;
+        count--;
+        done++;
+
+        transfer->callback(transfer);
+    }
+
+    return done;
+}
+
+static int ftdi_replay_bulk_transfer(struct ftdi_context *ftdi, int endpoint,
+                                     unsigned char *data, int length,
+                                     int *transferred, int timeout)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    const struct ftdi_replay_record *record;
+
+    (void) timeout;
+
+    // like libusb, also handle the pending async transfers
+    ftdi_replay_complete(ftdi);
+    ftdi_count_transfer(ftdi, endpoint);
+
+    *transferred = 0;
+    // nothing cancels a synchronous transfer
+    record = ftdi_replay_next(rp, (endpoint & LIBUSB_ENDPOINT_IN) != 0, 1);
+    if (record == NULL)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    ftdi_replay_sleep(ftdi_replay_duration(rp, record));
+    *transferred = ftdi_replay_copy(record, data, length);
+    if (record->kind == CAPTURE_ASYNC && record->result == 0)
+        return ftdi_replay_error(record->status);
+    return record->result;
+}
+
+static int ftdi_replay_handle_events(struct ftdi_context *ftdi, struct timeval *tv,
+                                     int *completed)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    struct timeval deadline, now, next;
+    int i;
+
+    gettimeofday(&deadline, NULL);
+    if (tv != NULL)
+        timeradd(&deadline, tv, &deadline);
+
+    for (;;)
+    {
+        if (ftdi_replay_complete(ftdi) > 0)
+            return 0;
+        if (completed != NULL && *completed)
+            return 0;
+
+        gettimeofday(&now, NULL);
+        if (rp->queue_count == 0 || !timercmp(&now, &deadline, <))
+        {
+            // nothing will ever complete, don't spin in the caller
+            if (rp->queue_count == 0 && tv != NULL)
+                ftdi_replay_sleep(tv->tv_sec * 1000000L + tv->tv_usec);
+            return 0;
+        }
+
+        // sleep until the first transfer is due
+        next = deadline;
+        for (i = 0; i < rp->queue_count; i++)
+        {
+            if (!rp->queue[i].idle && timercmp(&rp->queue[i].due, &next, <))
+                next = rp->queue[i].due;
+        }
+        if (timercmp(&now, &next, <))
+        {
+            timersub(&next, &now, &next);
+            ftdi_replay_sleep(next.tv_sec * 1000000L + next.tv_usec);
+        }
+    }
+}
+
+static int ftdi_replay_release_interface(struct ftdi_context *ftdi)
+{
+    (void) ftdi;
+    return 0;
+}
+
+static void ftdi_replay_close(struct ftdi_context *ftdi)
+{
+    struct ftdi_replay *rp = (struct ftdi_replay *) ftdi->backend_data;
+    int i;
+
+    // like a vanishing device
+    rp->gone = 1;
+    while (rp->queue_count > 0)
+    {
+        struct libusb_transfer *transfer = rp->queue[0].transfer;
+
+        for (i = 1; i < rp->queue_count; i++)
+            rp->queue[i - 1] = rp->queue[i];
+        rp->queue_count--;
+
+        transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+        transfer->callback(transfer);
+    }
+
+    free(rp->queue);
+    free(rp->records);
+    free(rp->file);
+    free(rp);
+    ftdi->backend_data = NULL;
+}
+
+static const struct ftdi_backend ftdi_replay_backend =
+{
+    ftdi_replay_control_transfer,
+    ftdi_replay_bulk_transfer,
+    ftdi_replay_submit_transfer,
+    ftdi_replay_cancel_transfer,
+    ftdi_replay_handle_events,
+    ftdi_replay_release_interface,
+    ftdi_replay_close
+};
+
+/**
+    Read a capture file into memory
+    \internal
+
+    \retval  0: all fine
+    \retval -3: out of memory
+    \retval -4: can't read the file
+*/
+static int ftdi_replay_load(struct ftdi_replay *rp, const char *filename, long *size)
+{
+    FILE *file;
+    int ret = 0;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+        return -4;
+
+    if (fseek(file, 0, SEEK_END) != 0 || (*size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) != 0)
+        ret = -4;
+    else if ((rp->file = (unsigned char *) malloc(*size > 0 ? *size : 1)) == NULL)
+        ret = -3;
+    else if (*size > 0 && fread(rp->file, *size, 1, file) != 1)
+        ret = -4;
+
+    fclose(file);
+    return ret;
+}
+
+/**
+    Split the capture file into records
+    \internal
+
+    \retval  0: all fine
+    \retval -3: out of memory
+*/
+static int ftdi_replay_parse(struct ftdi_replay *rp, long size)
+{
+    long pos = CAPTURE_HEADER_SIZE;
+    int allocated = 0;
+
+    // a record cut off at the end of the file is dropped
+    while (size - pos >= CAPTURE_RECORD_SIZE)
+    {
+        const unsigned char *p = rp->file + pos;
+        struct ftdi_replay_record *record;
+        uint32_t actual = ftdi_capture_get32(p + 16);
+
+        if (actual > (unsigned long) (size - pos - CAPTURE_RECORD_SIZE))
+            break;
+
+        if (rp->count == allocated)
+        {
+            int count = allocated ? allocated * 2 : 256;
+
+            record = (struct ftdi_replay_record *) realloc(rp->records, count * sizeof(*record));
+            if (record == NULL)
+                return -3;
+            rp->records = record;
+            allocated = count;
+        }
+
+        record = &rp->records[rp->count++];
+        record->kind = p[0];
+        record->endpoint = p[1];
+        record->request = p[2];
+        record->status = p[3];
+        record->value = ftdi_capture_get16(p + 4);
+        record->index = ftdi_capture_get16(p + 6);
+        record->result = (int32_t) ftdi_capture_get32(p + 8);
+        record->length = ftdi_capture_get32(p + 12);
+        record->actual = actual;
+        record->duration = ftdi_capture_get32(p + 28);
+        record->data = p + CAPTURE_RECORD_SIZE;
+
+        pos += CAPTURE_RECORD_SIZE + actual;
+    }
+    return 0;
+}
+
+/**
+    Opens a capture file written by ftdi_capture_start() as a device.
+
+    Bulk reads get the recorded data, including the modem status bytes,
+    writes are accepted with the recorded result. Each transfer takes the
+    recorded time divided by speed, 1 replays at the original pace, 10 ten
+    times faster and 0 as fast as possible. Control requests are answered
+    from the next matching record, ones missing in the capture succeed
+    without doing anything. Async transfers recorded as cancelled before
+    any data came stay pending until they are cancelled. Once the
+    recorded transfers of a direction ran out the device looks unplugged.
+
+    Nothing is sent while opening, unlike the other open functions.
+    Close it with ftdi_usb_close() as usual. The replay is meant for one
+    thread, it can't be opened on a context attached to an event loop.
+
+    \param ftdi pointer to ftdi_context
+    \param filename Capture file
+    \param speed Time scale of the replay, 0 to not wait at all
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid or invalid arguments
+    \retval -2: a device is already open
+    \retval -3: out of memory
+    \retval -4: can't read the capture file
+    \retval -5: not a capture file or an invalid packet size
+    \retval -6: attached to an event loop
+*/
+int ftdi_usb_open_replay(struct ftdi_context *ftdi, const char *filename, double speed)
+{
+    struct ftdi_replay *rp;
+    long size = 0;
+    int ret;
+
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    if (filename == NULL || speed < 0)
+        ftdi_error_return(-1, "invalid replay arguments");
+
+    if (ftdi->usb_dev != NULL)
+        ftdi_error_return(-2, "a device is already open");
+
+    if (ftdi->event_loop != NULL)
+        ftdi_error_return(-6, "attached to an event loop");
+
+    rp = (struct ftdi_replay *) calloc(1, sizeof(*rp));
+    if (rp == NULL)
+        ftdi_error_return(-3, "out of memory for the replay");
+    rp->speed = speed;
+
+    ret = ftdi_replay_load(rp, filename, &size);
+    if (ret == 0 && (size < CAPTURE_HEADER_SIZE || memcmp(rp->file, CAPTURE_MAGIC, 8) != 0))
+        ret = -5;
+    // full and high speed chips are the only ones there are
+    if (ret == 0 && ftdi_capture_get16(rp->file + 10) != 64 && ftdi_capture_get16(rp->file + 10) != 512)
+        ret = -5;
+    if (ret == 0)
+        ret = ftdi_replay_parse(rp, size);
+    if (ret < 0)
+    {
+        free(rp->records);
+        free(rp->file);
+        free(rp);
+        if (ret == -3)
+            ftdi_error_return(-3, "out of memory for the replay");
+        if (ret == -4)
+            ftdi_error_return(-4, "can't read the capture file");
+        ftdi_error_return(-5, "not a capture file");
+    }
+
+    ftdi->backend = &ftdi_replay_backend;
+    ftdi->backend_data = rp;
+    // never handed to libusb, only marks the device as open
+    ftdi->usb_dev = (struct libusb_device_handle *) rp;
+
+    ftdi->type = (enum ftdi_chip_type) rp->file[8];
+    ftdi->max_packet_size = ftdi_capture_get16(rp->file + 10);
+    ftdi->modem_status = 0;
+    ftdi->read_total = 0;
+    ftdi->status_events_first = 0;
+    ftdi->status_events_count = 0;
+    ftdi->bulk_in_transfers = 0;
+    ftdi->bulk_out_transfers = 0;
+    return 0;
+}
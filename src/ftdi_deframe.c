@@ -0,0 +1,365 @@
+/***************************************************************************
+                          ftdi_deframe.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Packet de-framing kernel
+ *
+ * Every USB packet the chip sends starts with two modem status bytes.
+ * The functions below compact the payload of consecutive packets into one
+ * contiguous block. They are used by all read paths and are the hottest
+ * loop when draining several high speed channels, so there are SSE2 and
+ * AVX2 versions which are selected at runtime.
+ *
+ * The destination may overlap the source as long as it starts at most two
+ * bytes after it (dst <= src + 2). This allows compacting in place.
+ */
+
+#include <string.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FTDI_DEFRAME_X86
+#include <immintrin.h>
+#endif
+
+typedef int (*ftdi_deframe_func)(unsigned char *dst, const unsigned char *src,
+                                 int length, int packet_size);
+
+/**
+    Portable implementation of the de-framing kernel
+    \internal
+*/
+static int ftdi_deframe_generic(unsigned char *dst, const unsigned char *src,
+                                int length, int packet_size)
+{
+    unsigned char *start = dst;
+
+    while (length > 2)
+    {
+        int packet_len = (length < packet_size) ? length : packet_size;
+
+        memmove(dst, src + 2, packet_len - 2);
+        dst += packet_len - 2;
+        src += packet_len;
+        length -= packet_len;
+    }
+
+    return dst - start;
+}
+
+#ifdef FTDI_DEFRAME_X86
+/*
+ * The vector kernels copy one packet payload at a time. The last, possibly
+ * overlapping, vector of a payload is loaded before anything gets stored
+ * and all loads of an unrolled step happen before its stores. With
+ * dst <= src every store only hits bytes that were already loaded, so the
+ * forward copy stays correct for in place compaction.
+ *
+ * They pay off for the short payloads of full speed chips. For the 510 byte
+ * payloads of high speed chips the C library's memmove() is at least as fast,
+ * so longer payloads are handed to it.
+ */
+#define FTDI_DEFRAME_VECTOR_MAX 256
+
+/**
+    SSE2 implementation of the de-framing kernel
+    \internal
+*/
+__attribute__((target("sse2")))
+static int ftdi_deframe_sse2(unsigned char *dst, const unsigned char *src,
+                             int length, int packet_size)
+{
+    unsigned char *start = dst;
+
+    while (length > 2)
+    {
+        int packet_len = (length < packet_size) ? length : packet_size;
+        int payload_len = packet_len - 2;
+        const unsigned char *payload = src + 2;
+
+        if (payload_len > FTDI_DEFRAME_VECTOR_MAX)
+            memmove(dst, payload, payload_len);
+        else if (payload_len >= 16)
+        {
+            __m128i last = _mm_loadu_si128((const __m128i *)(payload + payload_len - 16));
+            int i = 0;
+
+            for (; i + 64 <= payload_len; i += 64)
+            {
+                __m128i v0 = _mm_loadu_si128((const __m128i *)(payload + i));
+                __m128i v1 = _mm_loadu_si128((const __m128i *)(payload + i + 16));
+                __m128i v2 = _mm_loadu_si128((const __m128i *)(payload + i + 32));
+                __m128i v3 = _mm_loadu_si128((const __m128i *)(payload + i + 48));
+                _mm_storeu_si128((__m128i *)(dst + i), v0);
+                _mm_storeu_si128((__m128i *)(dst + i + 16), v1);
+                _mm_storeu_si128((__m128i *)(dst + i + 32), v2);
+                _mm_storeu_si128((__m128i *)(dst + i + 48), v3);
+            }
+            for (; i + 16 <= payload_len; i += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i *)(payload + i));
+                _mm_storeu_si128((__m128i *)(dst + i), v);
+            }
+            _mm_storeu_si128((__m128i *)(dst + payload_len - 16), last);
+        }
+        else if (payload_len > 0)
+            memmove(dst, payload, payload_len);
+
+        dst += payload_len;
+        src += packet_len;
+        length -= packet_len;
+    }
+
+    return dst - start;
+}
+
+/**
+    AVX2 implementation of the de-framing kernel
+    \internal
+*/
+__attribute__((target("avx2")))
+static int ftdi_deframe_avx2(unsigned char *dst, const unsigned char *src,
+                             int length, int packet_size)
+{
+    unsigned char *start = dst;
+
+    while (length > 2)
+    {
+        int packet_len = (length < packet_size) ? length : packet_size;
+        int payload_len = packet_len - 2;
+        const unsigned char *payload = src + 2;
+
+        if (payload_len > FTDI_DEFRAME_VECTOR_MAX)
+            memmove(dst, payload, payload_len);
+        else if (payload_len >= 32)
+        {
+            __m256i last = _mm256_loadu_si256((const __m256i *)(payload + payload_len - 32));
+            int i = 0;
+
+            for (; i + 128 <= payload_len; i += 128)
+            {
+                __m256i v0 = _mm256_loadu_si256((const __m256i *)(payload + i));
+                __m256i v1 = _mm256_loadu_si256((const __m256i *)(payload + i + 32));
+                __m256i v2 = _mm256_loadu_si256((const __m256i *)(payload + i + 64));
+                __m256i v3 = _mm256_loadu_si256((const __m256i *)(payload + i + 96));
+                _mm256_storeu_si256((__m256i *)(dst + i), v0);
+                _mm256_storeu_si256((__m256i *)(dst + i + 32), v1);
+                _mm256_storeu_si256((__m256i *)(dst + i + 64), v2);
+                _mm256_storeu_si256((__m256i *)(dst + i + 96), v3);
+            }
+            for (; i + 32 <= payload_len; i += 32)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(payload + i));
+                _mm256_storeu_si256((__m256i *)(dst + i), v);
+            }
+            _mm256_storeu_si256((__m256i *)(dst + payload_len - 32), last);
+        }
+        else if (payload_len >= 16)
+        {
+            __m128i first = _mm_loadu_si128((const __m128i *)payload);
+            __m128i last = _mm_loadu_si128((const __m128i *)(payload + payload_len - 16));
+            _mm_storeu_si128((__m128i *)dst, first);
+            _mm_storeu_si128((__m128i *)(dst + payload_len - 16), last);
+        }
+        else if (payload_len > 0)
+            memmove(dst, payload, payload_len);
+
+        dst += payload_len;
+        src += packet_len;
+        length -= packet_len;
+    }
+    _mm256_zeroupper();
+
+    return dst - start;
+}
+#endif
+
+/**
+    Select the best kernel for the CPU we are running on
+    \internal
+*/
+static ftdi_deframe_func ftdi_deframe_select(void)
+{
+#ifdef FTDI_DEFRAME_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ftdi_deframe_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return ftdi_deframe_sse2;
+#endif
+    return ftdi_deframe_generic;
+}
+
+/* Selected once on first use. Concurrent first calls store the same value. */
+static ftdi_deframe_func ftdi_deframe_impl = NULL;
+
+/**
+    Compact the payload of consecutive packets into a contiguous block.
+
+    The last packet may be shorter than packet_size. Packets carrying
+    only the two status bytes contribute nothing.
+    \internal
+
+    \param dst Destination buffer, must be able to hold the payload.
+           May overlap src if dst <= src + 2.
+    \param src Raw data as received from the chip
+    \param length Number of raw bytes in src
+    \param packet_size USB packet size (max_packet_size)
+
+    \retval number of payload bytes stored in dst
+*/
+int ftdi_deframe(unsigned char *dst, const unsigned char *src,
+                 int length, int packet_size)
+{
+    ftdi_deframe_func impl = ftdi_deframe_impl;
+
+    if (impl == NULL)
+    {
+        impl = ftdi_deframe_select();
+        ftdi_deframe_impl = impl;
+    }
+
+    return impl(dst, src, length, packet_size);
+}
+
+/**
+    Track the modem status bytes of the packets in a transfer.
+
+    Updates ftdi->modem_status and ftdi->read_total and records a
+    status event whenever one of the bits in FTDI_STATUS_EVENT_MASK
+    differs from the previous packet. When the ring is full, the oldest
+    event gets overwritten.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+    \param src Raw data as received from the chip
+    \param length Number of raw bytes in src
+*/
+void ftdi_deframe_status(struct ftdi_context *ftdi, const unsigned char *src,
+                         int length)
+{
+    int packet_size = ftdi->max_packet_size;
+    unsigned short modem_status;
+    uint64_t read_total;
+
+    ftdi_lock(ftdi);
+    modem_status = ftdi->modem_status;
+    read_total = ftdi->read_total;
+    while (length >= 2)
+    {
+        int packet_len = (length < packet_size) ? length : packet_size;
+        unsigned short status = src[0] | (src[1] << 8);
+
+        if ((status ^ modem_status) & FTDI_STATUS_EVENT_MASK)
+        {
+            unsigned int pos = (ftdi->status_events_first + ftdi->status_events_count) % FTDI_STATUS_EVENTS;
+
+            ftdi->status_events[pos].offset = read_total;
+            ftdi->status_events[pos].status = status;
+            if (ftdi->status_events_count < FTDI_STATUS_EVENTS)
+                ftdi->status_events_count++;
+            else
+                ftdi->status_events_first = (ftdi->status_events_first + 1) % FTDI_STATUS_EVENTS;
+        }
+        modem_status = status;
+        read_total += packet_len - 2;
+
+        src += packet_len;
+        length -= packet_len;
+    }
+
+    ftdi->modem_status = modem_status;
+    ftdi->read_total = read_total;
+    ftdi_unlock(ftdi);
+}
+
+/**
+    Describe the payload of consecutive packets without moving it.
+
+    Packets carrying only the two status bytes are skipped.
+    \internal
+
+    \param iov Array to fill, must have room for one entry per packet
+    \param src Raw data as received from the chip
+    \param length Number of raw bytes in src
+    \param packet_size USB packet size (max_packet_size)
+
+    \retval number of entries stored in iov
+*/
+int ftdi_deframe_iov(struct ftdi_iovec *iov, unsigned char *src,
+                     int length, int packet_size)
+{
+    int iovcnt = 0;
+
+    while (length > 2)
+    {
+        int packet_len = (length < packet_size) ? length : packet_size;
+
+        if (packet_len > 2)
+        {
+            iov[iovcnt].iov_base = src + 2;
+            iov[iovcnt].iov_len = packet_len - 2;
+            iovcnt++;
+        }
+        src += packet_len;
+        length -= packet_len;
+    }
+
+    return iovcnt;
+}
+
+/**
+ * @brief Wrapper function to export ftdi_deframe_iov() to the unit test
+ * Do not use, it's only for the unit test framework
+ **/
+int deframe_iov_UT_export(struct ftdi_iovec *iov, unsigned char *src,
+                          int length, int packet_size)
+{
+    return ftdi_deframe_iov(iov, src, length, packet_size);
+}
+
+/**
+ * @brief Wrapper function to export the single de-framing kernels to the unit test
+ * Do not use, it's only for the unit test framework
+ *
+ * kernel: 0 portable, 1 SSE2, 2 AVX2. Returns -1 if the kernel is not
+ * available on this machine.
+ **/
+int deframe_UT_export(int kernel, unsigned char *dst, const unsigned char *src,
+                      int length, int packet_size)
+{
+    switch (kernel)
+    {
+        case 0:
+            return ftdi_deframe_generic(dst, src, length, packet_size);
+#ifdef FTDI_DEFRAME_X86
+        case 1:
+            if (__builtin_cpu_supports("sse2"))
+                return ftdi_deframe_sse2(dst, src, length, packet_size);
+            break;
+        case 2:
+            if (__builtin_cpu_supports("avx2"))
+                return ftdi_deframe_avx2(dst, src, length, packet_size);
+            break;
+#endif
+        default:
+            break;
+    }
+    return -1;
+}
@@ -0,0 +1,667 @@
+/***************************************************************************
+                          ftdi_emulated.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Emulated FTDI device
+ *
+ * A transport which doesn't talk to USB at all but to a model of the chip,
+ * so the read and write paths can be tested and benchmarked without
+ * hardware. The model covers what matters for them:
+ *
+ * - The max packet size of the chip type, 64 bytes for full speed chips
+ *   and 512 bytes for the high speed ones.
+ * - Every packet sent to the host starts with the two modem status bytes.
+ * - Data is sent once a full packet is available. Less than that is held
+ *   back until the latency timer expires, then a short packet is sent,
+ *   only carrying the status bytes if there is no data at all. An enabled
+ *   event character in the data sends it at once.
+ * - In loopback mode written data shows up on the read side, otherwise
+ *   it is discarded. Like a loopback plug, RTS then drives CTS and DTR
+ *   drives DSR, as seen in the status bytes.
+ *
+ * Async transfers complete from the backend's event handling, in the order
+ * they were submitted. Transfer timeouts are not modelled, the latency
+ * timer completes every read anyway. Like libusb, the device may be used
+ * from several threads, the completion callbacks run with its lock held.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <libusb.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+/** Status bytes of an idle chip: no modem lines, transmitter empty */
+#define EMULATED_STATUS0 0x01
+#define EMULATED_STATUS1 0x60
+/** Modem status bits in the first status byte */
+#define EMULATED_CTS 0x10
+#define EMULATED_DSR 0x20
+
+struct ftdi_emulated_queued
+{
+    struct libusb_transfer *transfer;
+    int cancelled;
+};
+
+struct ftdi_emulated
+{
+    /** Writes show up on the read side */
+    int loopback;
+    /** Data waiting to be sent to the host */
+    unsigned char *fifo;
+    int fifo_start;
+    int fifo_used;
+    int fifo_size;
+    /** Latency timer in milliseconds */
+    int latency;
+    /** Event character, flushes the data like an expired latency timer */
+    int event_char;
+    int event_char_enable;
+    /** When the last packet was sent to the host */
+    struct timeval last_sent;
+    /** DTR and RTS as set by SIO_SET_MODEM_CTRL_REQUEST */
+    int modem_ctrl;
+    /** Bitmode and the pins driven in it */
+    unsigned char bitmode;
+    unsigned char pins;
+    /** Submitted async transfers, oldest first */
+    struct ftdi_emulated_queued *queue;
+    int queue_count;
+    int queue_size;
+    /** Set while closing, no more transfers are accepted */
+    int gone;
+#ifdef HAVE_PTHREAD
+    /** Recursive, the callbacks may submit again */
+    pthread_mutex_t lock;
+#endif
+};
+
+static void ftdi_emulated_lock(struct ftdi_emulated *emu)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&emu->lock);
+#else
+    (void) emu;
+#endif
+}
+
+static void ftdi_emulated_unlock(struct ftdi_emulated *emu)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&emu->lock);
+#else
+    (void) emu;
+#endif
+}
+
+/**
+    Time until the latency timer expires, in microseconds, 0 if it has
+    \internal
+*/
+static long ftdi_emulated_latency_left(struct ftdi_emulated *emu)
+{
+    struct timeval now, elapsed;
+    long left;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &emu->last_sent, &elapsed);
+    left = emu->latency * 1000L - (elapsed.tv_sec * 1000000L + elapsed.tv_usec);
+    return left > 0 ? left : 0;
+}
+
+static void ftdi_emulated_sleep(long usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+/**
+    First status byte, with the modem lines of the loopback plug
+    \internal
+*/
+static unsigned char ftdi_emulated_status0(struct ftdi_emulated *emu)
+{
+    unsigned char status = EMULATED_STATUS0;
+
+    if (emu->loopback && (emu->modem_ctrl & SIO_SET_RTS_MASK))
+        status |= EMULATED_CTS;
+    if (emu->loopback && (emu->modem_ctrl & SIO_SET_DTR_MASK))
+        status |= EMULATED_DSR;
+    return status;
+}
+
+/**
+    Append data to the fifo, growing it as needed
+    \internal
+*/
+static int ftdi_emulated_push(struct ftdi_emulated *emu, const unsigned char *data, int length)
+{
+    if (emu->fifo_start > 0 && emu->fifo_start + emu->fifo_used + length > emu->fifo_size)
+    {
+        memmove(emu->fifo, emu->fifo + emu->fifo_start, emu->fifo_used);
+        emu->fifo_start = 0;
+    }
+    if (emu->fifo_used + length > emu->fifo_size)
+    {
+        int size = emu->fifo_size ? emu->fifo_size : 4096;
+        unsigned char *fifo;
+
+        while (size < emu->fifo_used + length)
+            size *= 2;
+        fifo = (unsigned char *) realloc(emu->fifo, size);
+        if (fifo == NULL)
+            return LIBUSB_ERROR_NO_MEM;
+        emu->fifo = fifo;
+        emu->fifo_size = size;
+    }
+    memcpy(emu->fifo + emu->fifo_start + emu->fifo_used, data, length);
+    emu->fifo_used += length;
+    return 0;
+}
+
+/**
+    Data written by the host
+    \internal
+*/
+static int ftdi_emulated_out(struct ftdi_context *ftdi, const unsigned char *data, int length)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+
+    if (length > 0 && emu->bitmode != BITMODE_RESET)
+        emu->pins = data[length - 1];
+
+    if (!emu->loopback)
+        return 0;
+    return ftdi_emulated_push(emu, data, length);
+}
+
+/**
+    Fill a bulk IN transfer the way the chip would
+
+    Sends as many full packets as fit, a short one only once the latency
+    timer expired. A transfer already carrying full packets ends instead
+    of waiting for the latency timer.
+    \internal
+
+    \retval >=0: number of bytes placed in data
+    \retval  -1: nothing to send before the latency timer expires
+*/
+static int ftdi_emulated_in(struct ftdi_context *ftdi, unsigned char *data, int length)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    int payload = ftdi->max_packet_size - 2;
+    int pos = 0;
+
+    while (length - pos >= 2)
+    {
+        int n = (emu->fifo_used < payload) ? emu->fifo_used : payload;
+
+        // the rest of the packet follows in the next transfer
+        if (n > length - pos - 2)
+            n = length - pos - 2;
+
+        if (emu->fifo_used < payload && ftdi_emulated_latency_left(emu) > 0 &&
+            !(emu->event_char_enable &&
+              memchr(emu->fifo + emu->fifo_start, emu->event_char, emu->fifo_used)))
+        {
+            if (pos == 0)
+                return -1;
+            break;
+        }
+
+        data[pos] = ftdi_emulated_status0(emu);
+        data[pos + 1] = EMULATED_STATUS1;
+        memcpy(data + pos + 2, emu->fifo + emu->fifo_start, n);
+        emu->fifo_start += n;
+        emu->fifo_used -= n;
+        pos += n + 2;
+
+        // a short packet ends the transfer
+        if (n < payload)
+            break;
+    }
+
+    if (emu->fifo_used == 0)
+        emu->fifo_start = 0;
+    gettimeofday(&emu->last_sent, NULL);
+    return pos;
+}
+
+/**
+    Handle a control request, called with the lock held
+    \internal
+*/
+static int ftdi_emulated_control(struct ftdi_context *ftdi, int request_type,
+                                 int request, int value, unsigned char *data, int length)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+
+    switch (request)
+    {
+        case SIO_RESET_REQUEST:
+            if (value == SIO_RESET_SIO || value == SIO_TCIFLUSH)
+            {
+                emu->fifo_start = 0;
+                emu->fifo_used = 0;
+            }
+            return 0;
+        case SIO_SET_MODEM_CTRL_REQUEST:
+            emu->modem_ctrl = (emu->modem_ctrl & ~(value >> 8)) | (value & (value >> 8));
+            return 0;
+        case SIO_SET_LATENCY_TIMER_REQUEST:
+            emu->latency = value & 0xff;
+            return 0;
+        case SIO_SET_EVENT_CHAR_REQUEST:
+            emu->event_char = value & 0xff;
+            emu->event_char_enable = (value >> 8) & 1;
+            return 0;
+        case SIO_GET_LATENCY_TIMER_REQUEST:
+            if (length < 1)
+                return LIBUSB_ERROR_OVERFLOW;
+            data[0] = (unsigned char) emu->latency;
+            return 1;
+        case SIO_SET_BITMODE_REQUEST:
+            emu->bitmode = (value >> 8) & 0xff;
+            return 0;
+        case SIO_READ_PINS_REQUEST:
+            if (length < 1)
+                return LIBUSB_ERROR_OVERFLOW;
+            data[0] = emu->pins;
+            return 1;
+        case SIO_POLL_MODEM_STATUS_REQUEST:
+            if (length < 2)
+                return LIBUSB_ERROR_OVERFLOW;
+            data[0] = ftdi_emulated_status0(emu);
+            data[1] = EMULATED_STATUS1;
+            return 2;
+        case SIO_READ_EEPROM_REQUEST:
+            // blank eeprom
+            memset(data, 0xff, length);
+            return length;
+    }
+
+    // settings the model doesn't care about
+    if (request_type & LIBUSB_ENDPOINT_IN)
+    {
+        memset(data, 0, length);
+        return length;
+    }
+    return 0;
+}
+
+static int ftdi_emulated_control_transfer(struct ftdi_context *ftdi, int request_type,
+                                          int request, int value, int index,
+                                          unsigned char *data, int length, int timeout)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    int ret;
+
+    (void) index;
+    (void) timeout;
+
+    ftdi_emulated_lock(emu);
+    ret = ftdi_emulated_control(ftdi, request_type, request, value, data, length);
+    ftdi_emulated_unlock(emu);
+    return ret;
+}
+
+static int ftdi_emulated_submit_transfer(struct ftdi_context *ftdi,
+                                         struct libusb_transfer *transfer)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    int ret = 0;
+
+    ftdi_emulated_lock(emu);
+    if (emu->gone)
+        ret = LIBUSB_ERROR_NO_DEVICE;
+    else if (emu->queue_count == emu->queue_size)
+    {
+        int size = emu->queue_size ? emu->queue_size * 2 : 16;
+        struct ftdi_emulated_queued *queue;
+
+        queue = (struct ftdi_emulated_queued *) realloc(emu->queue, size * sizeof(*queue));
+        if (queue == NULL)
+            ret = LIBUSB_ERROR_NO_MEM;
+        else
+        {
+            emu->queue = queue;
+            emu->queue_size = size;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ftdi_count_transfer(ftdi, transfer->endpoint);
+        transfer->actual_length = 0;
+        emu->queue[emu->queue_count].transfer = transfer;
+        emu->queue[emu->queue_count].cancelled = 0;
+        emu->queue_count++;
+    }
+    ftdi_emulated_unlock(emu);
+    return ret;
+}
+
+static int ftdi_emulated_cancel_transfer(struct ftdi_context *ftdi,
+                                         struct libusb_transfer *transfer)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    int ret = LIBUSB_ERROR_NOT_FOUND;
+    int i;
+
+    ftdi_emulated_lock(emu);
+    for (i = 0; i < emu->queue_count; i++)
+    {
+        if (emu->queue[i].transfer == transfer && !emu->queue[i].cancelled)
+        {
+            emu->queue[i].cancelled = 1;
+            ret = 0;
+            break;
+        }
+    }
+    ftdi_emulated_unlock(emu);
+    return ret;
+}
+
+/**
+    Complete what can be completed of the transfers queued right now,
+    called with the lock held
+    \internal
+
+    \retval number of completed transfers
+*/
+static int ftdi_emulated_complete(struct ftdi_context *ftdi)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    int count = emu->queue_count;
+    int done = 0, in_blocked = 0;
+    int i = 0;
+
+    // transfers submitted by the callbacks wait for the next round
+    while (i < count)
+    {
+        struct libusb_transfer *transfer = emu->queue[i].transfer;
+        int is_in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+
+        if (emu->queue[i].cancelled)
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        else if (!is_in)
+        {
+            if (ftdi_emulated_out(ftdi, transfer->buffer, transfer->length) < 0)
+                transfer->status = LIBUSB_TRANSFER_ERROR;
+            else
+            {
+                transfer->status = LIBUSB_TRANSFER_COMPLETED;
+                transfer->actual_length = transfer->length;
+            }
+        }
+        else
+        {
+            int ret = in_blocked ? -1 : ftdi_emulated_in(ftdi, transfer->buffer,
+                                                         transfer->length);
+
+            // reads complete in order
+            if (ret < 0)
+            {
+                in_blocked = 1;
+                i++;
+                continue;
+            }
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            transfer->actual_length = ret;
+        }
+
+        memmove(&emu->queue[i], &emu->queue[i + 1],
+                (emu->queue_count - i - 1) * sizeof(*emu->queue));
+        emu->queue_count--;
+        count--;
+        done++;
+
+        transfer->callback(transfer);
+    }
+
+    return done;
+}
+
+static int ftdi_emulated_bulk_transfer(struct ftdi_context *ftdi, int endpoint,
+                                       unsigned char *data, int length,
+                                       int *transferred, int timeout)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    long waited = 0;
+    int ret;
+
+    ftdi_emulated_lock(emu);
+    // like libusb, also handle the pending async transfers
+    ftdi_emulated_complete(ftdi);
+    ftdi_count_transfer(ftdi, endpoint);
+
+    *transferred = 0;
+    if (!(endpoint & LIBUSB_ENDPOINT_IN))
+    {
+        ret = ftdi_emulated_out(ftdi, data, length);
+        if (ret == 0)
+            *transferred = length;
+        ftdi_emulated_unlock(emu);
+        return ret;
+    }
+
+    // another thread may take the data while this one sleeps
+    while ((ret = ftdi_emulated_in(ftdi, data, length)) < 0)
+    {
+        long left = ftdi_emulated_latency_left(emu);
+
+        ftdi_emulated_unlock(emu);
+        if (timeout > 0 && waited + left > timeout * 1000L)
+        {
+            ftdi_emulated_sleep(timeout * 1000L - waited);
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        ftdi_emulated_sleep(left);
+        waited += left;
+        ftdi_emulated_lock(emu);
+    }
+    *transferred = ret;
+    ftdi_emulated_unlock(emu);
+    return 0;
+}
+
+static int ftdi_emulated_handle_events(struct ftdi_context *ftdi, struct timeval *tv,
+                                       int *completed)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    struct timeval deadline, now, left;
+
+    gettimeofday(&deadline, NULL);
+    if (tv != NULL)
+        timeradd(&deadline, tv, &deadline);
+
+    for (;;)
+    {
+        long wait;
+        int done, queued;
+
+        ftdi_emulated_lock(emu);
+        done = ftdi_emulated_complete(ftdi);
+        queued = emu->queue_count;
+        wait = ftdi_emulated_latency_left(emu);
+        ftdi_emulated_unlock(emu);
+
+        if (done > 0)
+            return 0;
+        if (completed != NULL && *completed)
+            return 0;
+
+        gettimeofday(&now, NULL);
+        if (queued == 0 || !timercmp(&now, &deadline, <))
+        {
+            // nothing will ever complete, don't spin in the caller
+            if (queued == 0 && tv != NULL)
+                ftdi_emulated_sleep(tv->tv_sec * 1000000L + tv->tv_usec);
+            return 0;
+        }
+
+        // only reads wait, for the latency timer
+        timersub(&deadline, &now, &left);
+        if (wait > left.tv_sec * 1000000L + left.tv_usec)
+            wait = left.tv_sec * 1000000L + left.tv_usec;
+        ftdi_emulated_sleep(wait);
+    }
+}
+
+static int ftdi_emulated_release_interface(struct ftdi_context *ftdi)
+{
+    (void) ftdi;
+    return 0;
+}
+
+static void ftdi_emulated_close(struct ftdi_context *ftdi)
+{
+    struct ftdi_emulated *emu = (struct ftdi_emulated *) ftdi->backend_data;
+    int i;
+
+    // like a vanishing device
+    ftdi_emulated_lock(emu);
+    emu->gone = 1;
+    while (emu->queue_count > 0)
+    {
+        struct libusb_transfer *transfer = emu->queue[0].transfer;
+
+        for (i = 1; i < emu->queue_count; i++)
+            emu->queue[i - 1] = emu->queue[i];
+        emu->queue_count--;
+
+        transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+        transfer->callback(transfer);
+    }
+    ftdi_emulated_unlock(emu);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&emu->lock);
+#endif
+    free(emu->queue);
+    free(emu->fifo);
+    free(emu);
+    ftdi->backend_data = NULL;
+}
+
+const struct ftdi_backend ftdi_emulated_backend =
+{
+    ftdi_emulated_control_transfer,
+    ftdi_emulated_bulk_transfer,
+    ftdi_emulated_submit_transfer,
+    ftdi_emulated_cancel_transfer,
+    ftdi_emulated_handle_events,
+    ftdi_emulated_release_interface,
+    ftdi_emulated_close
+};
+
+/**
+    Opens an emulated device instead of a real one.
+
+    The emulated device models the USB side of a chip of the given type:
+    its max packet size, the modem status bytes at the start of every
+    packet, and the latency timer holding back data less than a packet.
+    In loopback mode everything written can be read back, otherwise writes
+    are discarded. The serial line itself and the MPSSE engine are not
+    emulated. Meant for tests and benchmarks of the read and write paths
+    on machines without the hardware. Close it with ftdi_usb_close() as
+    usual.
+
+    \param ftdi pointer to ftdi_context
+    \param type Chip type to model
+    \param loopback 1 to read back the written data, 0 to discard it
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+    \retval -2: a device is already open
+    \retval -3: out of memory
+    \retval -4: ftdi_usb_reset failed
+    \retval -5: set baudrate failed
+*/
+int ftdi_usb_open_emulated(struct ftdi_context *ftdi, enum ftdi_chip_type type, int loopback)
+{
+    struct ftdi_emulated *emu;
+
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    if (ftdi->usb_dev != NULL)
+        ftdi_error_return(-2, "a device is already open");
+
+    emu = (struct ftdi_emulated *) calloc(1, sizeof(*emu));
+    if (emu == NULL)
+        ftdi_error_return(-3, "out of memory for the emulated device");
+    emu->loopback = loopback;
+    emu->latency = 16;
+    gettimeofday(&emu->last_sent, NULL);
+#ifdef HAVE_PTHREAD
+    {
+        pthread_mutexattr_t attr;
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&emu->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+#endif
+
+    // the event thread polls the device from now on
+    ftdi_transport_lock(ftdi);
+    ftdi->backend = &ftdi_emulated_backend;
+    ftdi->backend_data = emu;
+    // never handed to libusb, only marks the device as open
+    ftdi->usb_dev = (struct libusb_device_handle *) emu;
+    ftdi_transport_unlock(ftdi);
+
+    ftdi->type = type;
+    ftdi->modem_status = 0;
+    ftdi->read_total = 0;
+    ftdi->status_events_first = 0;
+    ftdi->status_events_count = 0;
+    ftdi->bulk_in_transfers = 0;
+    ftdi->bulk_out_transfers = 0;
+    if (type == TYPE_2232H || type == TYPE_4232H || type == TYPE_232H)
+        ftdi->max_packet_size = 512;
+    else
+        ftdi->max_packet_size = 64;
+
+    if (ftdi_usb_reset(ftdi) != 0)
+    {
+        ftdi_usb_close(ftdi);
+        ftdi_error_return(-4, "ftdi_usb_reset failed");
+    }
+
+    if (ftdi_set_baudrate(ftdi, 9600) != 0)
+    {
+        ftdi_usb_close(ftdi);
+        ftdi_error_return(-5, "set baudrate failed");
+    }
+
+    return 0;
+}
@@ -0,0 +1,520 @@
+/***************************************************************************
+                          ftdi_event.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Shared event loop
+ *
+ * Every ftdi_context normally owns a libusb context and whoever waits for
+ * a transfer drives its events. An event loop owns one libusb context
+ * instead, which any number of ftdi contexts can be attached to, and
+ * optionally a thread which handles the events of all of them. Completion
+ * callbacks of the async functions then run in that thread. The waiting
+ * functions keep working, libusb hands the event handling over between
+ * the threads. Emulated devices don't go through libusb, the thread polls
+ * them in between, also while captured. Replays are limited to one thread
+ * and can't be attached.
+ *
+ * The callbacks touch the transfer pool, the readbuffer and the modem
+ * status of their context while the application uses it. An attached
+ * context gets a state lock for them, taken for short sections which never
+ * call into the transport. Locks are taken in the order: loop lock, lock of
+ * the emulated device, state lock.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <libusb.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+struct ftdi_event_loop
+{
+    /** libusb context shared by the attached ftdi contexts */
+    libusb_context *usb_ctx;
+    /** Number of attached ftdi contexts */
+    int users;
+    /** Set while the event thread runs */
+    int running;
+    /** Set to end the event thread */
+    int stop;
+    /** The attached ftdi contexts, users entries */
+    struct ftdi_context **contexts;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+    /** Guards contexts and the transports of the attached contexts */
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+struct ftdi_state_lock
+{
+    pthread_mutex_t mutex;
+};
+
+static void ftdi_mutex_init_recursive(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Complete the transfers of the attached emulated devices, also captured
+   ones, without waiting. Replays can't be attached */
+static int ftdi_event_poll(struct ftdi_event_loop *loop)
+{
+    int i, polled = 0;
+
+    pthread_mutex_lock(&loop->lock);
+    for (i = 0; i < loop->users; i++)
+    {
+        struct ftdi_context *ftdi = loop->contexts[i];
+        struct timeval tv = { 0, 0 };
+
+        if (ftdi_capture_transport(ftdi) != &ftdi_emulated_backend || ftdi->usb_dev == NULL)
+            continue;
+
+        ftdi->backend->handle_events(ftdi, &tv, NULL);
+        polled = 1;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    return polled;
+}
+
+static void *ftdi_event_thread(void *arg)
+{
+    struct ftdi_event_loop *loop = (struct ftdi_event_loop *) arg;
+
+    /* Wake up now and then to notice the stop request,
+       libusb_interrupt_event_handler() isn't available everywhere */
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_RELAXED))
+    {
+        struct timeval tv = { 0, 100000 };
+
+        if (ftdi_event_poll(loop))
+            tv.tv_usec = 1000;
+        libusb_handle_events_timeout_completed(loop->usb_ctx, &tv, &loop->stop);
+    }
+
+    return NULL;
+}
+#endif
+
+/**
+    Allocate and initialize a shared event loop.
+
+    Attach ftdi contexts with ftdi_set_event_loop() and start the event
+    thread with ftdi_event_loop_start(). Free it with ftdi_event_loop_free()
+    once all attached contexts are freed.
+
+    \retval NULL: libusb_init() failed or out of memory
+    \retval !NULL: pointer to the event loop
+*/
+struct ftdi_event_loop *ftdi_event_loop_new(void)
+{
+    struct ftdi_event_loop *loop;
+
+    loop = (struct ftdi_event_loop *) calloc(1, sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+
+    if (libusb_init(&loop->usb_ctx) < 0)
+    {
+        free(loop);
+        return NULL;
+    }
+#ifdef HAVE_PTHREAD
+    ftdi_mutex_init_recursive(&loop->lock);
+#endif
+
+    return loop;
+}
+
+/**
+    Start the thread handling the events of all attached contexts.
+
+    With an event thread, the completion callbacks of
+    ftdi_read_data_submit_cb() and ftdi_write_data_submit_cb() run without
+    anybody waiting for them. A host with many ports this way has a single
+    event loop instead of one poller per port.
+
+    The read-ahead and the reader thread use the readbuffer without the
+    state lock, they are not available on the attached contexts while the
+    thread runs. A read submitted with a callback owns the readbuffer until
+    the callback ran, don't call the other read functions of the context
+    meanwhile.
+
+    Not available if libftdi was built without pthreads.
+
+    \param loop pointer to the event loop
+    \param cpu CPU to run the thread on, < 0 for any (Linux only)
+    \param priority SCHED_FIFO priority of the thread, 0 for normal
+           scheduling. Usually needs privileges.
+
+    \retval  0: all fine
+    \retval -1: event loop invalid
+    \retval -2: event thread already running
+    \retval -3: can't create thread
+    \retval -4: can't set the CPU affinity
+    \retval -5: can't set the priority
+    \retval -6: an attached context reads ahead or runs a reader thread
+*/
+int ftdi_event_loop_start(struct ftdi_event_loop *loop, int cpu, int priority)
+{
+#ifdef HAVE_PTHREAD
+    pthread_attr_t attr;
+    int i, err;
+
+    if (loop == NULL)
+        return -1;
+
+    if (loop->running)
+        return -2;
+
+    for (i = 0; i < loop->users; i++)
+        if (loop->contexts[i]->readahead != NULL || loop->contexts[i]->reader != NULL)
+            return -6;
+
+    // the thread starts right away with its CPU and priority
+    pthread_attr_init(&attr);
+    if (cpu >= 0)
+    {
+#ifdef __linux__
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0)
+        {
+            pthread_attr_destroy(&attr);
+            return -4;
+        }
+#else
+        pthread_attr_destroy(&attr);
+        return -4;
+#endif
+    }
+
+    if (priority > 0)
+    {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) != 0 ||
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO) != 0 ||
+            pthread_attr_setschedparam(&attr, &param) != 0)
+        {
+            pthread_attr_destroy(&attr);
+            return -5;
+        }
+    }
+
+    loop->stop = 0;
+    err = pthread_create(&loop->thread, &attr, ftdi_event_thread, loop);
+    pthread_attr_destroy(&attr);
+    if (err == EPERM && priority > 0)
+        return -5;
+    if (err == EINVAL && cpu >= 0)
+        return -4;
+    if (err != 0)
+        return -3;
+    loop->running = 1;
+
+    return 0;
+#else
+    (void) loop;
+    (void) cpu;
+    (void) priority;
+    return -3;
+#endif
+}
+
+/**
+    Stop the event thread. Waits for events being handled right now.
+
+    \param loop pointer to the event loop
+
+    \retval  0: all fine, also if the thread wasn't running
+    \retval -1: event loop invalid
+*/
+int ftdi_event_loop_stop(struct ftdi_event_loop *loop)
+{
+    if (loop == NULL)
+        return -1;
+
+    if (!loop->running)
+        return 0;
+
+#ifdef HAVE_PTHREAD
+    __atomic_store_n(&loop->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(loop->thread, NULL);
+#endif
+    loop->running = 0;
+    return 0;
+}
+
+/**
+    Stop the event thread and free the event loop.
+
+    \param loop pointer to the event loop
+
+    \retval  0: all fine
+    \retval -1: event loop invalid
+    \retval -2: ftdi contexts are still attached
+*/
+int ftdi_event_loop_free(struct ftdi_event_loop *loop)
+{
+    if (loop == NULL)
+        return -1;
+
+    if (loop->users > 0)
+        return -2;
+
+    ftdi_event_loop_stop(loop);
+    libusb_exit(loop->usb_ctx);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&loop->lock);
+#endif
+    free(loop->contexts);
+    free(loop);
+    return 0;
+}
+
+/* Add a context to the ones the thread polls, it keeps its state lock
+   when moving from one loop to the other */
+static int ftdi_event_loop_add(struct ftdi_event_loop *loop, struct ftdi_context *ftdi)
+{
+    struct ftdi_context **contexts;
+
+#ifdef HAVE_PTHREAD
+    if (ftdi->state_lock == NULL)
+    {
+        ftdi->state_lock = (struct ftdi_state_lock *) malloc(sizeof(*ftdi->state_lock));
+        if (ftdi->state_lock == NULL)
+            return -1;
+        ftdi_mutex_init_recursive(&ftdi->state_lock->mutex);
+    }
+    pthread_mutex_lock(&loop->lock);
+#endif
+    contexts = (struct ftdi_context **) realloc(loop->contexts,
+                                                (loop->users + 1) * sizeof(*contexts));
+    if (contexts != NULL)
+    {
+        loop->contexts = contexts;
+        loop->contexts[loop->users++] = ftdi;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&loop->lock);
+#endif
+
+    return (contexts != NULL) ? 0 : -1;
+}
+
+static void ftdi_event_loop_remove(struct ftdi_event_loop *loop, struct ftdi_context *ftdi)
+{
+    int i;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&loop->lock);
+#endif
+    for (i = 0; i < loop->users; i++)
+    {
+        if (loop->contexts[i] == ftdi)
+        {
+            loop->contexts[i] = loop->contexts[--loop->users];
+            break;
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&loop->lock);
+#endif
+}
+
+static void ftdi_state_lock_free(struct ftdi_context *ftdi)
+{
+#ifdef HAVE_PTHREAD
+    if (ftdi->state_lock == NULL)
+        return;
+
+    pthread_mutex_destroy(&ftdi->state_lock->mutex);
+    free(ftdi->state_lock);
+    ftdi->state_lock = NULL;
+#else
+    (void) ftdi;
+#endif
+}
+
+/**
+    Attach a context to a shared event loop, or detach it.
+
+    The context drops its own libusb context and uses the one of the
+    event loop, so its transfers are handled by the event thread and
+    ftdi_transfer_data_wait_any() can wait for transfers of several
+    contexts in one go. Only possible while no device is open.
+
+    \param ftdi pointer to ftdi_context
+    \param loop pointer to the event loop, NULL to go back to an own
+           libusb context
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+    \retval -2: device is open
+    \retval -3: libusb_init() failed
+    \retval -4: out of memory
+*/
+int ftdi_set_event_loop(struct ftdi_context *ftdi, struct ftdi_event_loop *loop)
+{
+    libusb_context *usb_ctx = NULL;
+
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    if (ftdi->usb_dev != NULL)
+        ftdi_error_return(-2, "device is open");
+
+    if (loop == ftdi->event_loop)
+        return 0;
+
+    if (loop != NULL)
+    {
+        if (ftdi_event_loop_add(loop, ftdi) < 0)
+            ftdi_error_return(-4, "out of memory for the event loop");
+        usb_ctx = loop->usb_ctx;
+    }
+    else if (libusb_init(&usb_ctx) < 0)
+        ftdi_error_return(-3, "libusb_init() failed");
+
+    // pooled transfers don't depend on the libusb context, keep them
+    if (ftdi->event_loop != NULL)
+        ftdi_event_loop_remove(ftdi->event_loop, ftdi);
+    else if (ftdi->usb_ctx != NULL)
+        libusb_exit(ftdi->usb_ctx);
+
+    ftdi->usb_ctx = usb_ctx;
+    ftdi->event_loop = loop;
+    if (loop == NULL)
+        ftdi_state_lock_free(ftdi);
+
+    return 0;
+}
+
+/**
+    Internal function to detach a context from its event loop on deinit.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+*/
+void ftdi_event_loop_detach(struct ftdi_context *ftdi)
+{
+    if (ftdi->event_loop == NULL)
+        return;
+
+    ftdi_event_loop_remove(ftdi->event_loop, ftdi);
+    ftdi_state_lock_free(ftdi);
+    ftdi->event_loop = NULL;
+    ftdi->usb_ctx = NULL;
+}
+
+/**
+    Internal function to check for an event thread handling the
+    transfers of a context.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+
+    \retval 1: attached to a running event loop
+    \retval 0: no event thread
+*/
+int ftdi_event_loop_running(struct ftdi_context *ftdi)
+{
+    return ftdi->event_loop != NULL && ftdi->event_loop->running;
+}
+
+/**
+    Internal functions to guard the transfer pool, the readbuffer and the
+    modem status against the event thread. Recursive, no-ops unless the
+    context is attached to an event loop. Never call the transport while
+    holding the lock, the event thread takes it from within.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+*/
+void ftdi_lock(struct ftdi_context *ftdi)
+{
+#ifdef HAVE_PTHREAD
+    if (ftdi->state_lock != NULL)
+        pthread_mutex_lock(&ftdi->state_lock->mutex);
+#else
+    (void) ftdi;
+#endif
+}
+
+void ftdi_unlock(struct ftdi_context *ftdi)
+{
+#ifdef HAVE_PTHREAD
+    if (ftdi->state_lock != NULL)
+        pthread_mutex_unlock(&ftdi->state_lock->mutex);
+#else
+    (void) ftdi;
+#endif
+}
+
+/**
+    Internal functions to keep the event thread away from a transport
+    which gets opened, closed or wrapped. Recursive, no-ops unless the
+    context is attached to an event loop.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+*/
+void ftdi_transport_lock(struct ftdi_context *ftdi)
+{
+#ifdef HAVE_PTHREAD
+    if (ftdi->event_loop != NULL)
+        pthread_mutex_lock(&ftdi->event_loop->lock);
+#else
+    (void) ftdi;
+#endif
+}
+
+void ftdi_transport_unlock(struct ftdi_context *ftdi)
+{
+#ifdef HAVE_PTHREAD
+    if (ftdi->event_loop != NULL)
+        pthread_mutex_unlock(&ftdi->event_loop->lock);
+#else
+    (void) ftdi;
+#endif
+}
@@ -142,3 +142,119 @@ struct ftdi_eeprom
     int release_number;
 };
 
+
+#ifndef SWIG
+/* Set the error string of the context and return, needs <stdio.h> */
+#define ftdi_error_return(code, str) do {  \
+        if ( ftdi )                        \
+            ftdi->error_str = str;         \
+        else                               \
+            fprintf(stderr, str);          \
+        return code;                       \
+   } while(0);
+
+struct ftdi_context;
+struct ftdi_iovec;
+struct libusb_transfer;
+struct timeval;
+
+/**
+    \brief Transport used to talk to the chip
+
+    All USB traffic of an open device goes through ftdi->backend. The
+    transfers of the async functions are filled with
+    libusb_fill_bulk_transfer() in any case, the backend only decides
+    what submitting them and handling their events means.
+*/
+struct ftdi_backend
+{
+    /** Like libusb_control_transfer() */
+    int (*control_transfer)(struct ftdi_context *ftdi, int request_type, int request,
+                            int value, int index, unsigned char *data, int length,
+                            int timeout);
+    /** Like libusb_bulk_transfer() */
+    int (*bulk_transfer)(struct ftdi_context *ftdi, int endpoint, unsigned char *data,
+                         int length, int *transferred, int timeout);
+    /** Like libusb_submit_transfer() */
+    int (*submit_transfer)(struct ftdi_context *ftdi, struct libusb_transfer *transfer);
+    /** Like libusb_cancel_transfer() */
+    int (*cancel_transfer)(struct ftdi_context *ftdi, struct libusb_transfer *transfer);
+    /** Like libusb_handle_events_timeout_completed(), completed may be NULL */
+    int (*handle_events)(struct ftdi_context *ftdi, struct timeval *tv, int *completed);
+    /** Release the claimed interface */
+    int (*release_interface)(struct ftdi_context *ftdi);
+    /** Close the device, ftdi->usb_dev is reset by the caller */
+    void (*close)(struct ftdi_context *ftdi);
+};
+
+/* Transfer statistics of the transports, see ftdi.c */
+void ftdi_count_transfer(struct ftdi_context *ftdi, int endpoint);
+
+/* Transports, see ftdi.c and ftdi_emulated.c */
+extern const struct ftdi_backend ftdi_libusb_backend;
+extern const struct ftdi_backend ftdi_emulated_backend;
+
+/* Transport below a running capture, see ftdi_capture.c */
+const struct ftdi_backend *ftdi_capture_transport(struct ftdi_context *ftdi);
+
+/* Packet de-framing kernel, see ftdi_deframe.c */
+int ftdi_deframe(unsigned char *dst, const unsigned char *src,
+                 int length, int packet_size);
+void ftdi_deframe_status(struct ftdi_context *ftdi, const unsigned char *src,
+                         int length);
+int ftdi_deframe_iov(struct ftdi_iovec *iov, unsigned char *src,
+                     int length, int packet_size);
+
+/**
+    \brief Read-ahead queue state, see ftdi_read_data_set_readahead()
+*/
+struct ftdi_readahead
+{
+    /** Number of transfers kept in flight */
+    int depth;
+    /** Index of the oldest transfer, the next one to complete */
+    int head;
+    /** Sticky libusb error, stops the queue */
+    int error;
+    /** The transfers, each one owns a buffer of readbuffer_chunksize bytes */
+    struct libusb_transfer **transfers;
+    /** Completion flags of the transfers */
+    int *completed;
+};
+
+/* Read-ahead queue, see ftdi_readahead.c */
+int ftdi_readahead_start(struct ftdi_context *ftdi, int depth);
+void ftdi_readahead_stop(struct ftdi_context *ftdi);
+int ftdi_readahead_restart(struct ftdi_context *ftdi);
+int ftdi_readahead_next(struct ftdi_context *ftdi, int *requested);
+
+/**
+    \brief Scatter-gather state of ftdi_write_datav()
+*/
+struct ftdi_gather
+{
+    /** The segments to write */
+    const struct ftdi_iovec *iov;
+    /** Number of segments */
+    int iovcnt;
+    /** Segment the next chunk starts in */
+    int index;
+    /** Offset of the next chunk in that segment */
+    int offset;
+    /** Chunk size, the maximum size of a bulk transfer */
+    int chunksize;
+    /** Buffers to pack segments smaller than a chunk into, one per chunk in flight */
+    unsigned char *staging;
+};
+
+/* Shared event loop, see ftdi_event.c */
+void ftdi_event_loop_detach(struct ftdi_context *ftdi);
+int ftdi_event_loop_running(struct ftdi_context *ftdi);
+void ftdi_lock(struct ftdi_context *ftdi);
+void ftdi_unlock(struct ftdi_context *ftdi);
+void ftdi_transport_lock(struct ftdi_context *ftdi);
+void ftdi_transport_unlock(struct ftdi_context *ftdi);
+
+/* Size of the next bulk IN transfer, see ftdi.c */
+unsigned int ftdi_read_transfer_size(struct ftdi_context *ftdi);
+#endif
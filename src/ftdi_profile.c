@@ -0,0 +1,242 @@
+/***************************************************************************
+                          ftdi_profile.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Round trip latency profiler
+ *
+ * The latency of a request/response exchange depends on the latency timer,
+ * the read chunk size and the event character, in ways that differ between
+ * chips, modes and hosts. ftdi_profile_latency() measures echo round trips
+ * with each candidate setting, so a tool can pick the fastest one for the
+ * device at hand instead of guessing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <libusb.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+/* A candidate is given up after this many failed round trips in a row */
+#define PROFILE_MAX_FAILURES 3
+
+static int ftdi_profile_compare(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+    Nearest rank percentile of sorted samples
+    \internal
+*/
+static unsigned int ftdi_profile_percentile(const unsigned int *samples, int count, int permille)
+{
+    int rank = (count * permille + 999) / 1000;
+
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+    Internal function to measure the round trips of one candidate
+
+    \retval  0: all fine, failed round trips are counted in profile->errors
+    \retval -3: applying the settings or flushing the receive buffer failed
+*/
+static int ftdi_profile_run(struct ftdi_context *ftdi, enum ftdi_profile_method method,
+                            struct ftdi_latency_profile *profile, int rounds,
+                            unsigned int *samples)
+{
+    unsigned char request[2];
+    unsigned char response;
+    int wsize, count = 0, failures = 0;
+    int i;
+
+    if (ftdi_set_latency_timer(ftdi, profile->latency) < 0 ||
+        ftdi_set_event_char(ftdi, profile->event_char, profile->event_char_enable) < 0)
+        ftdi_error_return(-3, "applying the profile settings failed");
+    if (profile->chunksize > 0 && ftdi_read_data_set_chunksize(ftdi, profile->chunksize) < 0)
+        ftdi_error_return(-3, "applying the profile settings failed");
+
+    // bytes left over from before would pass for an instant response
+    if (ftdi_tciflush(ftdi) < 0)
+        ftdi_error_return(-3, "flushing the receive buffer failed");
+
+    if (method == PROFILE_MPSSE)
+    {
+        request[0] = GET_BITS_LOW;
+        request[1] = SEND_IMMEDIATE;
+        wsize = 2;
+    }
+    else
+    {
+        // the event character flushes the chip's buffer at once
+        request[0] = profile->event_char_enable ? profile->event_char : 0x55;
+        wsize = 1;
+    }
+
+    profile->errors = 0;
+    for (i = 0; i < rounds && failures < PROFILE_MAX_FAILURES; i++)
+    {
+        struct timeval start, end, elapsed;
+
+        gettimeofday(&start, NULL);
+        if (ftdi_transact(ftdi, request, wsize, &response, 1) != 1)
+        {
+            profile->errors++;
+            failures++;
+            // don't let a late response spoil the next round
+            ftdi_tciflush(ftdi);
+            continue;
+        }
+        gettimeofday(&end, NULL);
+        failures = 0;
+
+        timersub(&end, &start, &elapsed);
+        samples[count++] = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+    }
+    profile->errors += rounds - i;
+
+    if (count == 0)
+    {
+        profile->min = profile->p50 = profile->p90 = profile->p99 = profile->max = 0;
+        return 0;
+    }
+
+    qsort(samples, count, sizeof(*samples), ftdi_profile_compare);
+    profile->min = samples[0];
+    profile->p50 = ftdi_profile_percentile(samples, count, 500);
+    profile->p90 = ftdi_profile_percentile(samples, count, 900);
+    profile->p99 = ftdi_profile_percentile(samples, count, 990);
+    profile->max = samples[count - 1];
+    return 0;
+}
+
+/**
+    Measure echo round trips with several candidate settings.
+
+    For each entry of profiles the latency timer, read chunk size and
+    event character are applied, then rounds request/response round trips
+    are timed with ftdi_transact(). The distribution of the round trip
+    times is stored in the entry. Pick the best one with
+    ftdi_profile_best().
+
+    PROFILE_LOOPBACK writes one byte and expects it back, the event
+    character if enabled. That needs the TX and RX lines connected in UART
+    mode, or another loopback in the current mode. PROFILE_MPSSE reads the
+    low GPIO byte, the chip must be in MPSSE mode already.
+
+    The latency timer and the read chunk size are restored afterwards.
+    The event character is disabled afterwards if any candidate enabled
+    it, the chip can't report the previous setting.
+
+    \param ftdi pointer to ftdi_context
+    \param method Kind of round trip
+    \param profiles Candidate settings, the results are filled in
+    \param count Number of candidates
+    \param rounds Number of round trips per candidate
+
+    \retval  0: all fine, failed round trips are counted in the errors field
+    \retval -1: invalid arguments
+    \retval -2: out of memory
+    \retval -3: applying the settings of a candidate failed
+    \retval -4: not available while the read-ahead or the reader thread is active
+    \retval -666: USB device unavailable
+*/
+int ftdi_profile_latency(struct ftdi_context *ftdi, enum ftdi_profile_method method,
+                         struct ftdi_latency_profile *profiles, int count, int rounds)
+{
+    unsigned int *samples;
+    unsigned char latency;
+    unsigned int chunksize;
+    const char *error_str;
+    int event_char_used = 0;
+    int ret = 0;
+    int i;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-666, "USB device unavailable");
+
+    if (profiles == NULL || count <= 0 || rounds <= 0 ||
+        (method != PROFILE_LOOPBACK && method != PROFILE_MPSSE))
+        ftdi_error_return(-1, "invalid profiling arguments");
+
+    // ftdi_transact() would fail every round trip
+    if (ftdi->readahead != NULL || ftdi->reader != NULL)
+        ftdi_error_return(-4, "not available while reading ahead");
+
+    if (ftdi_get_latency_timer(ftdi, &latency) < 0 ||
+        ftdi_read_data_get_chunksize(ftdi, &chunksize) < 0)
+        ftdi_error_return(-3, "reading the current settings failed");
+
+    samples = (unsigned int *) malloc(rounds * sizeof(*samples));
+    if (samples == NULL)
+        ftdi_error_return(-2, "out of memory for the round trip samples");
+
+    for (i = 0; i < count && ret == 0; i++)
+    {
+        event_char_used |= profiles[i].event_char_enable;
+        ret = ftdi_profile_run(ftdi, method, &profiles[i], rounds, samples);
+    }
+    free(samples);
+
+    // best effort, keep the error of the profiling
+    error_str = ftdi->error_str;
+    if (event_char_used)
+        ftdi_set_event_char(ftdi, 0, 0);
+    ftdi_read_data_set_chunksize(ftdi, chunksize);
+    ftdi_set_latency_timer(ftdi, latency);
+    if (ret < 0)
+        ftdi->error_str = error_str;
+
+    return ret;
+}
+
+/**
+    Pick the candidate with the lowest latency.
+
+    Candidates with failed round trips are skipped. The lowest 99th
+    percentile wins, the median decides between equal ones.
+
+    \param profiles Candidates measured by ftdi_profile_latency()
+    \param count Number of candidates
+
+    \retval >=0: index of the best candidate
+    \retval -1: no candidate without errors
+*/
+int ftdi_profile_best(const struct ftdi_latency_profile *profiles, int count)
+{
+    int best = -1;
+    int i;
+
+    if (profiles == NULL)
+        return -1;
+
+    for (i = 0; i < count; i++)
+    {
+        if (profiles[i].errors)
+            continue;
+        if (best < 0 || profiles[i].p99 < profiles[best].p99 ||
+            (profiles[i].p99 == profiles[best].p99 && profiles[i].p50 < profiles[best].p50))
+            best = i;
+    }
+    return best;
+}
@@ -0,0 +1,273 @@
+/***************************************************************************
+                          ftdi_readahead.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Read-ahead queue for ftdi_read_data()
+ *
+ * A fixed number of bulk IN transfers is kept submitted all the time, so the
+ * host keeps polling the chip even while the application is not inside
+ * ftdi_read_data(). The transfers complete in the order they were submitted.
+ * ftdi_read_data() waits for the oldest one, swaps its buffer with
+ * ftdi->readbuffer and submits it again at the end of the queue. This way
+ * the usual readbuffer bookkeeping applies and no data gets copied twice.
+ */
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <libusb.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+static void LIBUSB_CALL ftdi_readahead_cb(struct libusb_transfer *transfer)
+{
+    int *completed = (int *) transfer->user_data;
+
+    *completed = 1;
+}
+
+/**
+    Map the status of a failed transfer to a libusb error code
+    \internal
+*/
+static int ftdi_readahead_error(enum libusb_transfer_status status)
+{
+    switch (status)
+    {
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+/**
+    Allocate and submit the read-ahead transfers.
+    \internal
+
+    Each transfer gets its own buffer of readbuffer_chunksize bytes.
+
+    \param ftdi pointer to ftdi_context, the device must be open
+    \param depth Number of transfers to keep in flight
+
+    \retval  0: all fine
+    \retval <0: libusb error code, nothing is left allocated
+*/
+int ftdi_readahead_start(struct ftdi_context *ftdi, int depth)
+{
+    struct ftdi_readahead *ra;
+    int i, ret;
+
+    ra = (struct ftdi_readahead *) calloc(1, sizeof(*ra));
+    if (ra == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    ra->transfers = (struct libusb_transfer **) calloc(depth, sizeof(*ra->transfers));
+    ra->completed = (int *) calloc(depth, sizeof(*ra->completed));
+    if (ra->transfers == NULL || ra->completed == NULL)
+    {
+        free(ra->transfers);
+        free(ra->completed);
+        free(ra);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    ra->depth = depth;
+    ftdi->readahead = ra;
+
+    for (i = 0; i < depth; i++)
+    {
+        struct libusb_transfer *transfer;
+        unsigned char *buf;
+
+        ra->completed[i] = 1;
+
+        transfer = libusb_alloc_transfer(0);
+        if (transfer == NULL)
+        {
+            ftdi_readahead_stop(ftdi);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        ra->transfers[i] = transfer;
+
+        buf = (unsigned char *) malloc(ftdi->readbuffer_chunksize);
+        if (buf == NULL)
+        {
+            ftdi_readahead_stop(ftdi);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+
+        /* No timeout, a queued transfer may wait for a long time
+           until ftdi_read_data() gets called again */
+        libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->out_ep, buf,
+                                  ftdi_read_transfer_size(ftdi), ftdi_readahead_cb,
+                                  &ra->completed[i], 0);
+
+        ra->completed[i] = 0;
+        ret = ftdi->backend->submit_transfer(ftdi, transfer);
+        if (ret < 0)
+        {
+            ra->completed[i] = 1;
+            ftdi_readahead_stop(ftdi);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+    Cancel the read-ahead transfers and free them.
+    \internal
+
+    Data received by transfers that were not consumed yet is discarded.
+    The contents of ftdi->readbuffer are not touched.
+
+    \param ftdi pointer to ftdi_context
+*/
+void ftdi_readahead_stop(struct ftdi_context *ftdi)
+{
+    struct ftdi_readahead *ra = ftdi->readahead;
+    int i;
+
+    if (ra == NULL)
+        return;
+
+    for (i = 0; i < ra->depth; i++)
+        if (ra->transfers[i] != NULL && !ra->completed[i])
+            ftdi->backend->cancel_transfer(ftdi, ra->transfers[i]);
+
+    for (i = 0; i < ra->depth; i++)
+    {
+        if (ra->transfers[i] == NULL)
+            continue;
+
+        while (!ra->completed[i])
+        {
+            struct timeval tv = { 1, 0 };
+
+            if (ftdi->backend->handle_events(ftdi, &tv,
+                    &ra->completed[i]) < 0)
+                break;
+        }
+        /* Still in flight if event handling failed, better leak it */
+        if (ra->completed[i])
+        {
+            free(ra->transfers[i]->buffer);
+            libusb_free_transfer(ra->transfers[i]);
+        }
+    }
+
+    free(ra->transfers);
+    free(ra->completed);
+    free(ra);
+    ftdi->readahead = NULL;
+}
+
+/**
+    Discard everything received so far and submit fresh transfers.
+    \internal
+
+    \param ftdi pointer to ftdi_context
+
+    \retval  0: all fine
+    \retval <0: libusb error code, the read-ahead is disabled
+*/
+int ftdi_readahead_restart(struct ftdi_context *ftdi)
+{
+    int depth = ftdi->readahead->depth;
+
+    ftdi_readahead_stop(ftdi);
+    return ftdi_readahead_start(ftdi, depth);
+}
+
+/**
+    Take the oldest read-ahead transfer.
+    \internal
+
+    Waits up to usb_read_timeout for the oldest transfer to complete,
+    swaps its buffer with ftdi->readbuffer and submits it again.
+
+    \param ftdi pointer to ftdi_context
+    \param requested returns the length the transfer was submitted with
+
+    \retval >=0: number of raw bytes now in ftdi->readbuffer
+    \retval  <0: libusb error code
+*/
+int ftdi_readahead_next(struct ftdi_context *ftdi, int *requested)
+{
+    struct ftdi_readahead *ra = ftdi->readahead;
+    struct libusb_transfer *transfer = ra->transfers[ra->head];
+    int *completed = &ra->completed[ra->head];
+    struct timeval deadline, now, tv;
+    unsigned char *buf;
+    int actual_length, ret;
+
+    if (ra->error < 0)
+        return ra->error;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += ftdi->usb_read_timeout / 1000;
+    deadline.tv_usec += (ftdi->usb_read_timeout % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
+
+    while (!*completed)
+    {
+        gettimeofday(&now, NULL);
+        if (!timercmp(&now, &deadline, <))
+            return LIBUSB_ERROR_TIMEOUT;
+        timersub(&deadline, &now, &tv);
+
+        ret = ftdi->backend->handle_events(ftdi, &tv, completed);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            return ret;
+    }
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        ra->error = ftdi_readahead_error(transfer->status);
+        return ra->error;
+    }
+    actual_length = transfer->actual_length;
+    *requested = transfer->length;
+
+    buf = transfer->buffer;
+    transfer->buffer = ftdi->readbuffer;
+    ftdi->readbuffer = buf;
+
+    transfer->length = ftdi_read_transfer_size(ftdi);
+    *completed = 0;
+    ret = ftdi->backend->submit_transfer(ftdi, transfer);
+    if (ret < 0)
+    {
+        *completed = 1;
+        ra->error = ret;
+    }
+    ra->head = (ra->head + 1) % ra->depth;
+
+    return actual_length;
+}
@@ -0,0 +1,412 @@
+/***************************************************************************
+                          ftdi_reader.c  -  description
+                             -------------------
+    begin                : Thu Oct 15 2026
+    copyright            : (C) 2003-2017 by Intra2net AG and the libftdi developers
+    email                : opensource@intra2net.com
+    SPDX-License-Identifier: LGPL-2.1-only
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Background reader thread
+ *
+ * The thread calls ftdi_read_data() in a loop and stores the payload in a
+ * single producer/single consumer ring buffer. head and tail are free running
+ * byte counters: head is only written by the reader thread, tail only by the
+ * consumer. Both sides publish their counter with release semantics after
+ * touching the ring and read the other one with acquire semantics, so
+ * ftdi_reader_peek() and ftdi_reader_consume() need neither a lock nor a
+ * system call. Only ftdi_reader_wait() sleeps on a condition variable and
+ * the thread takes the mutex only if a consumer announced that it sleeps.
+ *
+ * When the ring is full, the thread keeps reading from the chip and counts
+ * the data it has to drop. Stalling the USB side would overflow the chip's
+ * FIFO instead, which is worse as the data would be lost silently.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <libusb.h>
+
+#include "ftdi_i.h"
+#include "ftdi.h"
+
+/** Largest ring buffer, head - tail must not overflow */
+#define FTDI_READER_MAX_RING (1u << 30)
+
+struct ftdi_reader
+{
+    /** Ring buffer of size bytes */
+    unsigned char *ring;
+    /** Size of the ring buffer, a power of two */
+    unsigned int size;
+    /** Number of bytes stored so far, written by the reader thread */
+    unsigned int head;
+    /** Number of bytes consumed so far, written by the consumer */
+    unsigned int tail;
+    /** Number of bytes dropped because the ring buffer was full */
+    unsigned long dropped;
+    /** Error returned by ftdi_read_data(), ends the thread */
+    int error;
+    /** Set to end the thread */
+    int stop;
+    /** Set while the consumer sleeps in ftdi_reader_wait() */
+    int waiting;
+    /** Destination for data that did not fit into the ring buffer */
+    unsigned char *scratch;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static void ftdi_reader_wakeup(struct ftdi_reader *reader)
+{
+    if (!__atomic_load_n(&reader->waiting, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_lock(&reader->lock);
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+static void *ftdi_reader_thread(void *arg)
+{
+    struct ftdi_context *ftdi = (struct ftdi_context *) arg;
+    struct ftdi_reader *reader = ftdi->reader;
+    unsigned int head = reader->head;
+    int ret;
+
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_RELAXED))
+    {
+        unsigned int tail = __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE);
+        unsigned int pos = head & (reader->size - 1);
+        unsigned int space = reader->size - (head - tail);
+
+        if (space > reader->size - pos)
+            space = reader->size - pos;
+
+        if (space == 0)
+        {
+            ret = ftdi_read_data(ftdi, reader->scratch, ftdi->readbuffer_chunksize);
+            if (ret > 0)
+                __atomic_add_fetch(&reader->dropped, ret, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            ret = ftdi_read_data(ftdi, reader->ring + pos, space);
+            if (ret > 0)
+            {
+                head += ret;
+                __atomic_store_n(&reader->head, head, __ATOMIC_SEQ_CST);
+                ftdi_reader_wakeup(reader);
+            }
+        }
+
+        if (ret < 0)
+        {
+            __atomic_store_n(&reader->error, ret, __ATOMIC_SEQ_CST);
+            ftdi_reader_wakeup(reader);
+            break;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+static void ftdi_reader_free(struct ftdi_reader *reader)
+{
+    free(reader->ring);
+    free(reader->scratch);
+    free(reader);
+}
+
+/**
+    Start a background thread reading from the chip.
+
+    The thread calls ftdi_read_data() in a loop and stores the data in a ring
+    buffer. Get at the data with ftdi_reader_peek() and ftdi_reader_consume(),
+    which don't need a lock or a system call, and sleep for more data with
+    ftdi_reader_wait(). Enable the read-ahead, see
+    ftdi_read_data_set_readahead(), to keep the chip polled while the thread
+    is busy storing data.
+
+    Don't call the read functions of this context while the thread runs.
+    If the ring buffer is full, incoming data is dropped and counted,
+    see ftdi_reader_get_dropped(). Not available while the context is
+    attached to a running event loop, see ftdi_event_loop_start().
+
+    Not available if libftdi was built without pthreads.
+
+    \param ftdi pointer to ftdi_context
+    \param ring_size Size of the ring buffer in bytes, rounded up to a power of two
+
+    \retval  0: all fine
+    \retval -1: invalid ring buffer size
+    \retval -2: USB device unavailable
+    \retval -3: reader thread already running
+    \retval -4: out of memory
+    \retval -5: can't create thread
+    \retval -6: flushing the write buffer failed
+    \retval -7: attached to a running event loop
+*/
+int ftdi_reader_start(struct ftdi_context *ftdi, unsigned int ring_size)
+{
+#ifdef HAVE_PTHREAD
+    struct ftdi_reader *reader;
+    unsigned int size = 1;
+
+    if (ring_size == 0 || ring_size > FTDI_READER_MAX_RING)
+        ftdi_error_return(-1, "invalid ring buffer size");
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL)
+        ftdi_error_return(-2, "USB device unavailable");
+
+    if (ftdi->reader != NULL)
+        ftdi_error_return(-3, "reader thread already running");
+
+    if (ftdi_event_loop_running(ftdi))
+        ftdi_error_return(-7, "attached to a running event loop");
+
+    /* The thread doesn't flush the write buffer, see ftdi_read_data_blocking() */
+    if (ftdi_write_data_flush(ftdi) < 0)
+        ftdi_error_return(-6, "flushing the write buffer failed");
+
+    while (size < ring_size)
+        size <<= 1;
+
+    reader = (struct ftdi_reader *) calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        ftdi_error_return(-4, "out of memory for reader");
+
+    reader->size = size;
+    reader->ring = (unsigned char *) malloc(size);
+    reader->scratch = (unsigned char *) malloc(ftdi->readbuffer_chunksize);
+    if (reader->ring == NULL || reader->scratch == NULL)
+    {
+        ftdi_reader_free(reader);
+        ftdi_error_return(-4, "out of memory for reader");
+    }
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+
+    ftdi->reader = reader;
+    if (pthread_create(&reader->thread, NULL, ftdi_reader_thread, ftdi) != 0)
+    {
+        ftdi->reader = NULL;
+        pthread_cond_destroy(&reader->cond);
+        pthread_mutex_destroy(&reader->lock);
+        ftdi_reader_free(reader);
+        ftdi_error_return(-5, "can't create reader thread");
+    }
+
+    return 0;
+#else
+    ftdi_error_return(-5, "libftdi was built without thread support");
+#endif
+}
+
+/**
+    Stop the background reader thread.
+
+    Waits until the thread's current ftdi_read_data() call returns.
+    Data still in the ring buffer is discarded, data in the readbuffer
+    is left for ftdi_read_data().
+
+    \param ftdi pointer to ftdi_context
+
+    \retval  0: all fine
+    \retval -1: ftdi context invalid
+*/
+int ftdi_reader_stop(struct ftdi_context *ftdi)
+{
+    struct ftdi_reader *reader;
+
+    if (ftdi == NULL)
+        ftdi_error_return(-1, "ftdi context invalid");
+
+    reader = ftdi->reader;
+    if (reader == NULL)
+        return 0;
+
+#ifdef HAVE_PTHREAD
+    __atomic_store_n(&reader->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->lock);
+#endif
+
+    ftdi->reader = NULL;
+    ftdi_reader_free(reader);
+    return 0;
+}
+
+/**
+    Get the oldest data received by the reader thread.
+
+    Does not block. The data stays in the ring buffer until it is released
+    with ftdi_reader_consume(). As the ring buffer wraps around, less than
+    the available data may be returned: call again after consuming.
+
+    \param ftdi pointer to ftdi_context
+    \param data Pointer to store the address of the data in
+
+    \retval >0: number of bytes available at *data
+    \retval  0: no data available
+    \retval -1: reader thread not running
+    \retval -2: reader thread stopped because of a read error,
+                see ftdi_get_error_string()
+*/
+int ftdi_reader_peek(struct ftdi_context *ftdi, unsigned char **data)
+{
+    struct ftdi_reader *reader;
+    unsigned int head, tail, pos, avail;
+
+    if (ftdi == NULL || ftdi->reader == NULL)
+        return -1;
+
+    reader = ftdi->reader;
+    head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+    tail = reader->tail;
+    avail = head - tail;
+    if (avail == 0)
+        return __atomic_load_n(&reader->error, __ATOMIC_ACQUIRE) ? -2 : 0;
+
+    pos = tail & (reader->size - 1);
+    if (avail > reader->size - pos)
+        avail = reader->size - pos;
+
+    *data = reader->ring + pos;
+    return avail;
+}
+
+/**
+    Release data returned by ftdi_reader_peek().
+
+    \param ftdi pointer to ftdi_context
+    \param size Number of bytes to release
+
+    \retval  0: all fine
+    \retval -1: reader thread not running
+    \retval -2: more data released than available
+*/
+int ftdi_reader_consume(struct ftdi_context *ftdi, int size)
+{
+    struct ftdi_reader *reader;
+    unsigned int head, tail;
+
+    if (ftdi == NULL || ftdi->reader == NULL)
+        return -1;
+
+    reader = ftdi->reader;
+    head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+    tail = reader->tail;
+    if (size < 0 || (unsigned int)size > head - tail)
+        return -2;
+
+    __atomic_store_n(&reader->tail, tail + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+    Wait for data from the reader thread.
+
+    \param ftdi pointer to ftdi_context
+    \param timeout Maximum time to wait in milliseconds, -1 waits forever
+
+    \retval >0: number of bytes available, get them with ftdi_reader_peek()
+    \retval  0: timeout
+    \retval -1: reader thread not running
+    \retval -2: reader thread stopped because of a read error,
+                see ftdi_get_error_string()
+*/
+int ftdi_reader_wait(struct ftdi_context *ftdi, int timeout)
+{
+    struct ftdi_reader *reader;
+    unsigned int avail;
+
+    if (ftdi == NULL || ftdi->reader == NULL)
+        return -1;
+
+    reader = ftdi->reader;
+    avail = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE) - reader->tail;
+
+#ifdef HAVE_PTHREAD
+    if (avail == 0 && timeout != 0)
+    {
+        struct timeval now;
+        struct timespec deadline;
+
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + timeout / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        __atomic_store_n(&reader->waiting, 1, __ATOMIC_SEQ_CST);
+        for (;;)
+        {
+            int ret;
+
+            avail = __atomic_load_n(&reader->head, __ATOMIC_SEQ_CST) - reader->tail;
+            if (avail != 0 || __atomic_load_n(&reader->error, __ATOMIC_SEQ_CST))
+                break;
+
+            if (timeout < 0)
+                ret = pthread_cond_wait(&reader->cond, &reader->lock);
+            else
+                ret = pthread_cond_timedwait(&reader->cond, &reader->lock, &deadline);
+            if (ret == ETIMEDOUT)
+                break;
+        }
+        __atomic_store_n(&reader->waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&reader->lock);
+    }
+#endif
+
+    if (avail == 0 && __atomic_load_n(&reader->error, __ATOMIC_ACQUIRE))
+        return -2;
+
+    return avail;
+}
+
+/**
+    Get the number of bytes the reader thread had to drop
+    because the ring buffer was full.
+
+    \param ftdi pointer to ftdi_context
+    \param dropped Pointer to store the number of bytes in
+
+    \retval  0: all fine
+    \retval -1: reader thread not running
+*/
+int ftdi_reader_get_dropped(struct ftdi_context *ftdi, unsigned long *dropped)
+{
+    if (ftdi == NULL || ftdi->reader == NULL)
+        return -1;
+
+    *dropped = __atomic_load_n(&ftdi->reader->dropped, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -42,11 +42,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #ifndef _WIN32
 #include <sys/time.h>
 #endif
 #include <libusb.h>
 
+#include "ftdi_i.h"
 #include "ftdi.h"
 
 typedef struct
@@ -57,13 +59,24 @@ typedef struct
     int activity;
     int result;
     FTDIProgressInfo progress;
+    struct ftdi_context *ftdi;
+    int in_flight;
+    FTDIStreamVecCallback *vcallback;
+    struct ftdi_iovec *iov;
+    int per_packet;
 } FTDIStreamState;
 
 /* Handle callbacks
  *
- * With Exit request, free memory and release the transfer
+ * Strip the status bytes of the transfer in place, pass the payload to
+ * the user callback and resubmit the transfer. A vectored callback gets
+ * the payload of the packets where it is instead. In per packet mode the
+ * callback is invoked for every packet, also without payload, like
+ * ftdi_readstream() always did. After an exit request or an
+ * error the transfer is not resubmitted any more, the transfers get freed
+ * by ftdi_readstream_run().
  *
- * state->result is only set when some error happens
+ * state->result is only set when some error happens or on exit requests
  */
 static void LIBUSB_CALL
 ftdi_readstream_cb(struct libusb_transfer *transfer)
@@ -72,43 +85,65 @@ ftdi_readstream_cb(struct libusb_transfer *transfer)
     int packet_size = state->packetsize;
 
     state->activity++;
+    state->in_flight--;
     if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
     {
-        int i;
-        uint8_t *ptr = transfer->buffer;
         int length = transfer->actual_length;
-        int numPackets = (length + packet_size - 1) / packet_size;
-        int res = 0;
+        int res;
 
-        for (i = 0; i < numPackets; i++)
+        if (state->result)
+            return;
+
+        ftdi_deframe_status(state->ftdi, transfer->buffer, length);
+        if (state->vcallback)
         {
-            int payloadLen;
-            int packetLen = length;
+            int iovcnt = ftdi_deframe_iov(state->iov, transfer->buffer, length, packet_size);
+            int i;
 
-            if (packetLen > packet_size)
-                packetLen = packet_size;
+            for (i = 0; i < iovcnt; i++)
+                state->progress.current.totalBytes += state->iov[i].iov_len;
 
-            payloadLen = packetLen - 2;
-            state->progress.current.totalBytes += payloadLen;
+            res = state->vcallback(state->iov, iovcnt, NULL, state->userdata);
+        }
+        else if (state->per_packet)
+        {
+            uint8_t *ptr = transfer->buffer;
+
+            res = 0;
+            while (length > 0 && !res)
+            {
+                int packetLen = length;
+                int payloadLen;
 
-            res = state->callback(ptr + 2, payloadLen,
-                                  NULL, state->userdata);
+                if (packetLen > packet_size)
+                    packetLen = packet_size;
+                payloadLen = (packetLen > 2) ? packetLen - 2 : 0;
+                state->progress.current.totalBytes += payloadLen;
 
-            ptr += packetLen;
-            length -= packetLen;
+                res = state->callback(ptr + 2, payloadLen, NULL, state->userdata);
+                ptr += packetLen;
+                length -= packetLen;
+            }
         }
-        if (res)
+        else
         {
-            free(transfer->buffer);
-            libusb_free_transfer(transfer);
+            length = ftdi_deframe(transfer->buffer, transfer->buffer, length, packet_size);
+            state->progress.current.totalBytes += length;
+
+            res = state->callback(transfer->buffer, length, NULL, state->userdata);
         }
+        if (res)
+            state->result = res;
         else
         {
-            transfer->status = -1;
-            state->result = libusb_submit_transfer(transfer);
+            res = state->ftdi->backend->submit_transfer(state->ftdi, transfer);
+            if (res)
+                state->result = res;
+            else
+                state->in_flight++;
         }
     }
-    else
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
     {
         fprintf(stderr, "unknown status %d\n",transfer->status);
         state->result = LIBUSB_ERROR_IO;
@@ -128,55 +163,90 @@ TimevalDiff(const struct timeval *a, const struct timeval *b)
 }
 
 /**
-    Streaming reading of data from the device
+   Update the progress info if enough time has elapsed
 
-    Use asynchronous transfers in libusb-1.0 for high-performance
-    streaming of data from a device interface back to the PC. This
-    function continuously transfers data until either an error occurs
-    or the callback returns a nonzero value. This function returns
-    a libusb error code or the callback's return value.
+   \param progress progress info of the stream
 
-    For every contiguous block of received data, the callback will
-    be invoked.
+   \retval 1: progress info updated, report it
+   \retval 0: too early
+*/
+static int
+ftdi_stream_progress(FTDIProgressInfo *progress)
+{
+    const double progressInterval = 1.0;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (TimevalDiff(&now, &progress->current.time) < progressInterval)
+        return 0;
+
+    progress->current.time = now;
+    progress->totalTime = TimevalDiff(&progress->current.time,
+                                      &progress->first.time);
+
+    if (progress->prev.totalBytes)
+    {
+        // We have enough information to calculate rates
+
+        double currentTime;
+
+        currentTime = TimevalDiff(&progress->current.time,
+                                  &progress->prev.time);
+
+        progress->totalRate =
+            progress->current.totalBytes /progress->totalTime;
+        progress->currentRate =
+            (progress->current.totalBytes -
+             progress->prev.totalBytes) / currentTime;
+    }
+
+    return 1;
+}
+
+/**
+    Run the streaming transfers until an error occurs or the callback
+    asks to stop. Common part of ftdi_readstream() and
+    ftdi_readstream_generic().
+    \internal
 
     \param  ftdi pointer to ftdi_context
     \param  callback to user supplied function for one block of data
     \param  userdata
     \param  packetsPerTransfer number of packets per transfer
     \param  numTransfers Number of transfers per callback
-
+    \param  syncff switch to synchronous FIFO mode once all transfers are submitted
+    \param  vcallback vectored callback, used instead of callback if not NULL
+    \param  per_packet invoke callback once per packet and ignore the return
+            value of the progress calls, as ftdi_readstream() does
 */
-
-int
-ftdi_readstream(struct ftdi_context *ftdi,
-                FTDIStreamCallback *callback, void *userdata,
-                int packetsPerTransfer, int numTransfers)
+static int
+ftdi_readstream_run(struct ftdi_context *ftdi,
+                    FTDIStreamCallback *callback, void *userdata,
+                    int packetsPerTransfer, int numTransfers, int syncff,
+                    FTDIStreamVecCallback *vcallback, int per_packet)
 {
-    struct libusb_transfer **transfers;
+    struct libusb_transfer **transfers = NULL;
     FTDIStreamState state = { callback, userdata, ftdi->max_packet_size, 1 };
     int bufferSize = packetsPerTransfer * ftdi->max_packet_size;
     int xferIndex;
     int err = 0;
 
-    /* Only FT2232H and FT232H know about the synchronous FIFO Mode*/
-    if ((ftdi->type != TYPE_2232H) && (ftdi->type != TYPE_232H))
-    {
-        fprintf(stderr,"Device doesn't support synchronous FIFO mode\n");
-        return 1;
-    }
+    state.ftdi = ftdi;
+    state.vcallback = vcallback;
+    state.per_packet = per_packet;
 
-    /* We don't know in what state we are, switch to reset*/
-    if (ftdi_set_bitmode(ftdi,  0xff, BITMODE_RESET) < 0)
-    {
-        fprintf(stderr,"Can't reset mode\n");
-        return 1;
-    }
+    err = ftdi_write_data_flush(ftdi);
+    if (err < 0)
+        return err;
 
-    /* Purge anything remaining in the buffers*/
-    if (ftdi_tcioflush(ftdi) < 0)
+    if (vcallback)
     {
-        fprintf(stderr,"Can't flush FIFOs & buffers\n");
-        return 1;
+        state.iov = calloc(packetsPerTransfer, sizeof *state.iov);
+        if (!state.iov)
+        {
+            err = LIBUSB_ERROR_NO_MEM;
+            goto cleanup;
+        }
     }
 
     /*
@@ -213,10 +283,10 @@ ftdi_readstream(struct ftdi_context *ftdi,
             goto cleanup;
         }
 
-        transfer->status = -1;
-        err = libusb_submit_transfer(transfer);
+        err = ftdi->backend->submit_transfer(ftdi, transfer);
         if (err)
             goto cleanup;
+        state.in_flight++;
     }
 
     /* Start the transfers only when everything has been set up.
@@ -224,10 +294,11 @@ ftdi_readstream(struct ftdi_context *ftdi,
      * fetching data for several to several ten milliseconds
      * and we skip blocks
      */
-    if (ftdi_set_bitmode(ftdi,  0xff, BITMODE_SYNCFF) < 0)
+    if (syncff && ftdi_set_bitmode(ftdi,  0xff, BITMODE_SYNCFF) < 0)
     {
         fprintf(stderr,"Can't set synchronous fifo mode: %s\n",
                 ftdi_get_error_string(ftdi));
+        err = 1;
         goto cleanup;
     }
 
@@ -240,14 +311,12 @@ ftdi_readstream(struct ftdi_context *ftdi,
     do
     {
         FTDIProgressInfo  *progress = &state.progress;
-        const double progressInterval = 1.0;
         struct timeval timeout = { 0, ftdi->usb_read_timeout * 1000};
-        struct timeval now;
 
-        int err = libusb_handle_events_timeout(ftdi->usb_ctx, &timeout);
+        int err = ftdi->backend->handle_events(ftdi, &timeout, NULL);
         if (err ==  LIBUSB_ERROR_INTERRUPTED)
             /* restart interrupted events */
-            err = libusb_handle_events_timeout(ftdi->usb_ctx, &timeout);
+            err = ftdi->backend->handle_events(ftdi, &timeout, NULL);
         if (!state.result)
         {
             state.result = err;
@@ -257,31 +326,16 @@ ftdi_readstream(struct ftdi_context *ftdi,
         else
             state.activity = 0;
 
-        // If enough time has elapsed, update the progress
-        gettimeofday(&now, NULL);
-        if (TimevalDiff(&now, &progress->current.time) >= progressInterval)
+        if (ftdi_stream_progress(progress))
         {
-            progress->current.time = now;
-            progress->totalTime = TimevalDiff(&progress->current.time,
-                                              &progress->first.time);
-
-            if (progress->prev.totalBytes)
-            {
-                // We have enough information to calculate rates
-
-                double currentTime;
-
-                currentTime = TimevalDiff(&progress->current.time,
-                                          &progress->prev.time);
-
-                progress->totalRate =
-                    progress->current.totalBytes /progress->totalTime;
-                progress->currentRate =
-                    (progress->current.totalBytes -
-                     progress->prev.totalBytes) / currentTime;
-            }
-
-            state.callback(NULL, 0, progress, state.userdata);
+            int stop;
+
+            if (state.vcallback)
+                stop = state.vcallback(NULL, 0, progress, state.userdata);
+            else
+                stop = state.callback(NULL, 0, progress, state.userdata);
+            if (stop && !state.result && !state.per_packet)
+                state.result = 1;
             progress->prev = progress->current;
 
         }
@@ -292,12 +346,393 @@ ftdi_readstream(struct ftdi_context *ftdi,
      */
 
 cleanup:
-    fprintf(stderr, "cleanup\n");
+    if (err && !state.result)
+        state.result = err;
     if (transfers)
-        free(transfers);
+    {
+        for (xferIndex = 0; xferIndex < numTransfers; xferIndex++)
+            if (transfers[xferIndex])
+                ftdi->backend->cancel_transfer(ftdi, transfers[xferIndex]);
+
+        while (state.in_flight > 0)
+        {
+            struct timeval timeout = { 1, 0 };
+
+            if (ftdi->backend->handle_events(ftdi, &timeout, NULL) < 0)
+                break;
+        }
+
+        /* Still in flight if event handling failed, better leak them */
+        if (state.in_flight == 0)
+        {
+            for (xferIndex = 0; xferIndex < numTransfers; xferIndex++)
+            {
+                if (!transfers[xferIndex])
+                    continue;
+                free(transfers[xferIndex]->buffer);
+                libusb_free_transfer(transfers[xferIndex]);
+            }
+            free(transfers);
+            free(state.iov);
+        }
+    }
+    else
+        free(state.iov);
     if (err)
         return err;
     else
         return state.result;
 }
 
+/**
+    Streaming reading of data from the device
+
+    Use asynchronous transfers in libusb-1.0 for high-performance
+    streaming of data from a device interface back to the PC. This
+    function continuously transfers data until either an error occurs
+    or the callback returns a nonzero value. This function returns
+    a libusb error code or the callback's return value.
+
+    The callback is invoked for every USB packet with the payload of
+    the packet, also with length 0 for packets carrying only the modem
+    status. Progress is reported once per second with buffer = NULL,
+    the return value of these calls is ignored.
+
+    Only for FT2232H and FT232H, the chip gets switched to the
+    synchronous FIFO mode. See ftdi_readstream_generic() for other
+    chips and modes.
+
+    \param  ftdi pointer to ftdi_context
+    \param  callback to user supplied function for one block of data
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers Number of transfers per callback
+
+*/
+
+int
+ftdi_readstream(struct ftdi_context *ftdi,
+                FTDIStreamCallback *callback, void *userdata,
+                int packetsPerTransfer, int numTransfers)
+{
+    /* Only FT2232H and FT232H know about the synchronous FIFO Mode*/
+    if ((ftdi->type != TYPE_2232H) && (ftdi->type != TYPE_232H))
+    {
+        fprintf(stderr,"Device doesn't support synchronous FIFO mode\n");
+        return 1;
+    }
+
+    /* We don't know in what state we are, switch to reset*/
+    if (ftdi_set_bitmode(ftdi,  0xff, BITMODE_RESET) < 0)
+    {
+        fprintf(stderr,"Can't reset mode\n");
+        return 1;
+    }
+
+    /* Purge anything remaining in the buffers*/
+    if (ftdi_tcioflush(ftdi) < 0)
+    {
+        fprintf(stderr,"Can't flush FIFOs & buffers\n");
+        return 1;
+    }
+
+    return ftdi_readstream_run(ftdi, callback, userdata,
+                               packetsPerTransfer, numTransfers, 1, NULL, 1);
+}
+
+/**
+    Streaming reading of data from the device in its current mode
+
+    Like ftdi_readstream(), but works with every chip and leaves the mode
+    to the caller: plain UART, asynchronous or synchronous bitbang, MPSSE
+    or FIFO modes. Neither the mode nor the buffers are touched, set up the
+    chip before calling this function.
+
+    Unlike ftdi_readstream(), the modem status bytes are stripped from each
+    transfer in place and the callback gets the payload of the whole
+    transfer as one block, which may be empty while the chip has no data. Return a nonzero value from the
+    callback, including the progress calls with a NULL buffer, to stop.
+    All transfers are cancelled and freed before this function returns.
+
+    \param  ftdi pointer to ftdi_context
+    \param  callback to user supplied function for one block of data
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers Number of transfers kept in flight
+
+    \retval -666: USB device unavailable
+    \retval <0: libusb error code
+    \retval >0: the callback's return value
+*/
+int
+ftdi_readstream_generic(struct ftdi_context *ftdi,
+                        FTDIStreamCallback *callback, void *userdata,
+                        int packetsPerTransfer, int numTransfers)
+{
+    if (ftdi == NULL || ftdi->usb_dev == NULL || ftdi->max_packet_size == 0)
+        return -666;
+
+    if (packetsPerTransfer <= 0 || numTransfers <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    return ftdi_readstream_run(ftdi, callback, userdata,
+                               packetsPerTransfer, numTransfers, 0, NULL, 0);
+}
+
+/**
+    Streaming reading of data from the device with a vectored callback
+
+    Like ftdi_readstream_generic(), but the callback is invoked once per
+    transfer with one ftdi_iovec per USB packet that carries data. The
+    payload is not moved, so the status bytes don't cost a copy. The
+    array and the data are only valid during the callback.
+
+    Progress is reported by calls with iov = NULL and the progress info.
+
+    \param  ftdi pointer to ftdi_context
+    \param  callback to user supplied function for the packets of one transfer
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers Number of transfers kept in flight
+
+    \retval -666: USB device unavailable
+    \retval <0: libusb error code
+    \retval >0: the callback's return value
+*/
+int
+ftdi_readstreamv(struct ftdi_context *ftdi,
+                 FTDIStreamVecCallback *callback, void *userdata,
+                 int packetsPerTransfer, int numTransfers)
+{
+    if (ftdi == NULL || ftdi->usb_dev == NULL || ftdi->max_packet_size == 0)
+        return -666;
+
+    if (packetsPerTransfer <= 0 || numTransfers <= 0 || callback == NULL)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    return ftdi_readstream_run(ftdi, NULL, userdata,
+                               packetsPerTransfer, numTransfers, 0, callback, 0);
+}
+
+typedef struct
+{
+    FTDIWriteStreamCallback *callback;
+    void *userdata;
+    int transferSize;
+    int result;
+    int eof;
+    int in_flight;
+    FTDIProgressInfo progress;
+    struct ftdi_context *ftdi;
+} FTDIWriteStreamState;
+
+/* Get the next block of data from the user callback and submit the
+ * transfer. At the end of the data or on errors the transfer stays idle.
+ */
+static void
+ftdi_writestream_fill(FTDIWriteStreamState *state,
+                      struct libusb_transfer *transfer)
+{
+    int length, res;
+
+    if (state->result || state->eof)
+        return;
+
+    length = state->callback(transfer->buffer, state->transferSize,
+                             NULL, state->userdata);
+    if (length < 0)
+    {
+        state->result = length;
+        return;
+    }
+    if (length == 0)
+    {
+        state->eof = 1;
+        return;
+    }
+    if (length > state->transferSize)
+        length = state->transferSize;
+
+    transfer->length = length;
+    res = state->ftdi->backend->submit_transfer(state->ftdi, transfer);
+    if (res)
+        state->result = res;
+    else
+        state->in_flight++;
+}
+
+/* Handle callbacks
+ *
+ * Account the written data and refill the transfer from the user callback.
+ */
+static void LIBUSB_CALL
+ftdi_writestream_cb(struct libusb_transfer *transfer)
+{
+    FTDIWriteStreamState *state = transfer->user_data;
+
+    state->in_flight--;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+        state->progress.current.totalBytes += transfer->actual_length;
+        if (transfer->actual_length != transfer->length)
+        {
+            if (!state->result)
+                state->result = LIBUSB_ERROR_IO;
+            return;
+        }
+        ftdi_writestream_fill(state, transfer);
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !state->result)
+    {
+        state->result = (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) ?
+                        LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+    }
+}
+
+/**
+    Streaming writing of data to the device
+
+    The write counterpart of ftdi_readstream_generic(): numTransfers
+    bulk OUT transfers are kept submitted, so the chip never runs out of
+    data while the next block gets prepared. Each time a transfer completes,
+    the callback fills its buffer again. The data arrives in the order the
+    callback returned it.
+
+    The callback returns the number of bytes it put into the buffer,
+    0 once all data was handed over or a negative value to abort. When
+    the end is reached, this function waits for the pending transfers to
+    complete. Progress is reported once per second with buffer = NULL,
+    return a negative value to abort there as well.
+
+    The chip's mode is not touched, set it up before, e.g. to the
+    synchronous FIFO mode. A transfer which can't be completed within
+    the write timeout, see ftdi_context.usb_write_timeout, ends the stream.
+
+    \param  ftdi pointer to ftdi_context
+    \param  callback to user supplied function providing the data
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers Number of transfers kept in flight
+
+    \retval -666: USB device unavailable
+    \retval  0: all data was written
+    \retval <0: libusb error code or the callback's return value
+*/
+int
+ftdi_writestream(struct ftdi_context *ftdi,
+                 FTDIWriteStreamCallback *callback, void *userdata,
+                 int packetsPerTransfer, int numTransfers)
+{
+    struct libusb_transfer **transfers;
+    FTDIWriteStreamState state;
+    int xferIndex;
+    int err;
+
+    if (ftdi == NULL || ftdi->usb_dev == NULL || ftdi->max_packet_size == 0)
+        return -666;
+
+    if (packetsPerTransfer <= 0 || numTransfers <= 0 || callback == NULL)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    // keep the order of the data
+    err = ftdi_write_data_flush(ftdi);
+    if (err < 0)
+        return err;
+
+    memset(&state, 0, sizeof(state));
+    state.callback = callback;
+    state.userdata = userdata;
+    state.transferSize = packetsPerTransfer * ftdi->max_packet_size;
+    state.ftdi = ftdi;
+
+    transfers = calloc(numTransfers, sizeof *transfers);
+    if (!transfers)
+        return LIBUSB_ERROR_NO_MEM;
+
+    /*
+     * Set up and fill all transfers
+     */
+
+    gettimeofday(&state.progress.first.time, NULL);
+
+    for (xferIndex = 0; xferIndex < numTransfers && !state.result; xferIndex++)
+    {
+        struct libusb_transfer *transfer;
+
+        transfer = libusb_alloc_transfer(0);
+        transfers[xferIndex] = transfer;
+        if (!transfer)
+        {
+            state.result = LIBUSB_ERROR_NO_MEM;
+            break;
+        }
+
+        libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->in_ep,
+                                  malloc(state.transferSize), state.transferSize,
+                                  ftdi_writestream_cb,
+                                  &state, ftdi->usb_write_timeout);
+
+        if (!transfer->buffer)
+        {
+            state.result = LIBUSB_ERROR_NO_MEM;
+            break;
+        }
+
+        ftdi_writestream_fill(&state, transfer);
+    }
+
+    /*
+     * Run the transfers until the data is written, and periodically
+     * assess progress.
+     */
+
+    while (!state.result && state.in_flight > 0)
+    {
+        FTDIProgressInfo *progress = &state.progress;
+        struct timeval timeout = { 1, 0 };
+
+        err = ftdi->backend->handle_events(ftdi, &timeout, NULL);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED && !state.result)
+            state.result = err;
+
+        if (ftdi_stream_progress(progress))
+        {
+            int stop = callback(NULL, 0, progress, userdata);
+
+            if (stop < 0 && !state.result)
+                state.result = stop;
+            progress->prev = progress->current;
+        }
+    }
+
+    /*
+     * Cancel any outstanding transfers, and free memory.
+     */
+
+    for (xferIndex = 0; xferIndex < numTransfers; xferIndex++)
+        if (transfers[xferIndex])
+            ftdi->backend->cancel_transfer(ftdi, transfers[xferIndex]);
+
+    while (state.in_flight > 0)
+    {
+        struct timeval timeout = { 1, 0 };
+
+        if (ftdi->backend->handle_events(ftdi, &timeout, NULL) < 0)
+            break;
+    }
+
+    /* Still in flight if event handling failed, better leak them */
+    if (state.in_flight == 0)
+    {
+        for (xferIndex = 0; xferIndex < numTransfers; xferIndex++)
+        {
+            if (!transfers[xferIndex])
+                continue;
+            free(transfers[xferIndex]->buffer);
+            libusb_free_transfer(transfers[xferIndex]);
+        }
+        free(transfers);
+    }
+
+    return state.result;
+}
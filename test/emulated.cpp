@@ -0,0 +1,1274 @@
+/**@file
+@brief Test the read and write paths against the emulated device
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <ftdi.h>
+#include <libusb.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+/// Emulated high speed chip in loopback mode for every test
+class EmulatedFixture
+{
+protected:
+    ftdi_context *ftdi;
+
+public:
+    EmulatedFixture()
+        : ftdi(NULL)
+    {
+        ftdi = ftdi_new();
+        BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_emulated(ftdi, TYPE_232H, 1));
+        BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 2));
+    }
+
+    virtual ~EmulatedFixture()
+    {
+        ftdi_free(ftdi);
+        ftdi = NULL;
+    }
+};
+
+static std::vector<unsigned char> pattern(int size)
+{
+    std::vector<unsigned char> data(size);
+
+    for (int i = 0; i < size; i++)
+        data[i] = (unsigned char)(i * 7 + i / 251);
+    return data;
+}
+
+static int elapsed_ms(const struct timeval &start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+}
+
+/// Write from another thread after a delay, like a device answering late
+struct DelayedWrite
+{
+    ftdi_context *ftdi;
+    const unsigned char *data;
+    int size;
+    int delay_ms;
+    pthread_t thread;
+};
+
+static void *delayed_write_thread(void *arg)
+{
+    DelayedWrite *w = static_cast<DelayedWrite *>(arg);
+
+    usleep(w->delay_ms * 1000);
+    ftdi_write_data(w->ftdi, w->data, w->size);
+    return NULL;
+}
+
+static void delayed_write(DelayedWrite &w, ftdi_context *ftdi, const unsigned char *data,
+                          int size, int delay_ms)
+{
+    w.ftdi = ftdi;
+    w.data = data;
+    w.size = size;
+    w.delay_ms = delay_ms;
+    BOOST_REQUIRE_EQUAL(0, pthread_create(&w.thread, NULL, delayed_write_thread, &w));
+}
+
+/// Read until size bytes arrived or a read returns nothing
+static int read_all(ftdi_context *ftdi, unsigned char *buf, int size)
+{
+    int offset = 0;
+
+    while (offset < size)
+    {
+        int ret = ftdi_read_data(ftdi, buf + offset, size - offset);
+        if (ret <= 0)
+            break;
+        offset += ret;
+    }
+    return offset;
+}
+
+BOOST_FIXTURE_TEST_SUITE(Emulated, EmulatedFixture)
+
+BOOST_AUTO_TEST_CASE(OpenClose)
+{
+    unsigned char latency = 0;
+
+    BOOST_CHECK_EQUAL(512, ftdi->max_packet_size);
+    BOOST_CHECK_EQUAL(-2, ftdi_usb_open_emulated(ftdi, TYPE_R, 1));
+
+    BOOST_CHECK_EQUAL(0, ftdi_get_latency_timer(ftdi, &latency));
+    BOOST_CHECK_EQUAL(2, latency);
+
+    BOOST_CHECK_EQUAL(0, ftdi_usb_close(ftdi));
+    BOOST_CHECK(ftdi->usb_dev == NULL);
+
+    BOOST_CHECK_EQUAL(0, ftdi_usb_open_emulated(ftdi, TYPE_R, 0));
+    BOOST_CHECK_EQUAL(64, ftdi->max_packet_size);
+    BOOST_CHECK_EQUAL(TYPE_R, ftdi->type);
+}
+
+BOOST_AUTO_TEST_CASE(EmptyRead)
+{
+    unsigned char buf[16];
+
+    // only the status bytes arrive
+    BOOST_CHECK_EQUAL(0, ftdi_read_data(ftdi, buf, sizeof(buf)));
+}
+
+BOOST_AUTO_TEST_CASE(Discard)
+{
+    std::vector<unsigned char> data = pattern(1000);
+    unsigned char buf[16];
+
+    ftdi_usb_close(ftdi);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_emulated(ftdi, TYPE_2232H, 0));
+
+    BOOST_CHECK_EQUAL(1000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(0, ftdi_read_data(ftdi, buf, sizeof(buf)));
+}
+
+BOOST_AUTO_TEST_CASE(LoopbackSmall)
+{
+    const unsigned char data[] = "hello";
+    unsigned char buf[16];
+
+    BOOST_CHECK_EQUAL(5, ftdi_write_data(ftdi, data, 5));
+    BOOST_CHECK_EQUAL(5, read_all(ftdi, buf, 5));
+    BOOST_CHECK(memcmp(buf, data, 5) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(LoopbackFullSpeed)
+{
+    std::vector<unsigned char> data = pattern(10000);
+    std::vector<unsigned char> buf(10000);
+
+    // 62 payload bytes per packet
+    ftdi_usb_close(ftdi);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_emulated(ftdi, TYPE_R, 1));
+    ftdi_set_latency_timer(ftdi, 2);
+
+    BOOST_CHECK_EQUAL(10000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(10000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+}
+
+BOOST_AUTO_TEST_CASE(LatencyTimer)
+{
+    std::vector<unsigned char> data = pattern(510 * 4);
+    std::vector<unsigned char> buf(510 * 4);
+    struct timeval start;
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 100));
+
+    // full packets go out right away, in a single transfer
+    ftdi_write_data(ftdi, &data[0], data.size());
+    ftdi->bulk_in_transfers = 0;
+    BOOST_CHECK_EQUAL(510 * 4, ftdi_read_data(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK_EQUAL(1U, ftdi->bulk_in_transfers);
+    BOOST_CHECK(buf == data);
+
+    // a short packet waits for the latency timer
+    ftdi_write_data(ftdi, &data[0], 10);
+    gettimeofday(&start, NULL);
+    BOOST_CHECK_EQUAL(10, ftdi_read_data(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(elapsed_ms(start) >= 50);
+}
+
+BOOST_AUTO_TEST_CASE(Throughput)
+{
+    const int size = 4 * 1024 * 1024;
+    std::vector<unsigned char> data = pattern(size);
+    std::vector<unsigned char> buf(size);
+    struct timeval start;
+    int ms;
+
+    gettimeofday(&start, NULL);
+    BOOST_CHECK_EQUAL(size, ftdi_write_data(ftdi, &data[0], size));
+    BOOST_CHECK_EQUAL(size, read_all(ftdi, &buf[0], size));
+    ms = elapsed_ms(start);
+    BOOST_CHECK(buf == data);
+
+    BOOST_TEST_MESSAGE("emulated loopback: " << size / 1024 << " KiB in " << ms << " ms");
+}
+
+BOOST_AUTO_TEST_CASE(Readahead)
+{
+    std::vector<unsigned char> data = pattern(100000);
+    std::vector<unsigned char> buf(100000);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_read_data_set_readahead(ftdi, 4));
+    BOOST_CHECK_EQUAL(100000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(100000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+}
+
+BOOST_AUTO_TEST_CASE(AsyncTransfers)
+{
+    std::vector<unsigned char> data = pattern(20000);
+    std::vector<unsigned char> buf(20000);
+    struct ftdi_transfer_control *wtc, *rtc;
+
+    wtc = ftdi_write_data_submit(ftdi, &data[0], data.size());
+    BOOST_REQUIRE(wtc != NULL);
+    rtc = ftdi_read_data_submit(ftdi, &buf[0], buf.size());
+    BOOST_REQUIRE(rtc != NULL);
+
+    BOOST_CHECK_EQUAL(20000, ftdi_transfer_data_done(wtc));
+    BOOST_CHECK_EQUAL(20000, ftdi_transfer_data_done(rtc));
+    BOOST_CHECK(buf == data);
+}
+
+BOOST_AUTO_TEST_CASE(CancelTransfer)
+{
+    const unsigned char data[] = "after";
+    unsigned char buf[16];
+    struct ftdi_transfer_control *tc;
+    struct timeval tv = { 0, 0 };
+    int pooled;
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 255));
+    tc = ftdi_read_data_submit(ftdi, buf, sizeof(buf));
+    BOOST_REQUIRE(tc != NULL);
+    pooled = ftdi->tc_pool_count;
+
+    // still waiting for the latency timer
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_TIMEOUT, ftdi_transfer_data_wait_any(&tc, 1, 0));
+    BOOST_CHECK_EQUAL(0, tc->completed);
+
+    ftdi_transfer_data_cancel(tc, &tv);
+    BOOST_CHECK_EQUAL(pooled + 1, ftdi->tc_pool_count);
+
+    // the device keeps working
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 2));
+    BOOST_CHECK_EQUAL(5, ftdi_write_data(ftdi, data, 5));
+    BOOST_CHECK_EQUAL(5, read_all(ftdi, buf, 5));
+    BOOST_CHECK(memcmp(buf, data, 5) == 0);
+}
+
+/// Completion callback counting the transfers and bytes
+static void count_completion(ftdi_transfer_control *tc, int result, void *userdata)
+{
+    int *results = static_cast<int *>(userdata);
+
+    BOOST_CHECK_EQUAL(tc->size, result);
+    results[0]++;
+    results[1] += result;
+}
+
+BOOST_AUTO_TEST_CASE(CompletionCallback)
+{
+    // a full packet doesn't wait for the latency timer
+    std::vector<unsigned char> data = pattern(510);
+    std::vector<unsigned char> buf(510);
+    unsigned char mark = '!';
+    int results[2] = { 0, 0 };
+    ftdi_transfer_control *tc;
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_transfer_pool(ftdi, 8));
+    BOOST_REQUIRE_EQUAL(8, ftdi->tc_pool_count);
+
+    // completed by the event handling for another transfer
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_submit_cb(ftdi, &data[0], data.size(), count_completion, results));
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_submit_cb(ftdi, &buf[0], buf.size(), count_completion, results));
+    tc = ftdi_write_data_submit(ftdi, &mark, 1);
+    BOOST_REQUIRE(tc != NULL);
+    BOOST_CHECK_EQUAL(5, ftdi->tc_pool_count);
+    BOOST_CHECK_EQUAL(1, ftdi_transfer_data_done(tc));
+    BOOST_CHECK_EQUAL(2, results[0]);
+    BOOST_CHECK_EQUAL(1020, results[1]);
+    BOOST_CHECK(buf == data);
+
+    // the controls went back to the pool
+    BOOST_CHECK_EQUAL(8, ftdi->tc_pool_count);
+
+    // served from the readbuffer, the callback runs right away
+    BOOST_CHECK_EQUAL(4, ftdi_write_data(ftdi, &data[0], 4));
+    BOOST_CHECK_EQUAL(2, ftdi_read_data_blocking(ftdi, &buf[0], 2, 2, 0));
+    BOOST_CHECK(buf[0] == mark && buf[1] == data[0]);
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_submit_cb(ftdi, &buf[0], 3, count_completion, results));
+    BOOST_CHECK_EQUAL(3, results[0]);
+    BOOST_CHECK_EQUAL(1023, results[1]);
+    BOOST_CHECK(memcmp(&buf[0], &data[1], 3) == 0);
+    BOOST_CHECK_EQUAL(8, ftdi->tc_pool_count);
+}
+
+/// Completions seen by the event thread, Boost.Test can't check there
+struct LoopCompletion
+{
+    pthread_t thread;
+    int bytes;
+    int count;
+};
+
+static void loop_completion(ftdi_transfer_control *tc, int result, void *userdata)
+{
+    LoopCompletion *done = static_cast<LoopCompletion *>(userdata);
+
+    (void) tc;
+    done->thread = pthread_self();
+    done->bytes += result;
+    __atomic_add_fetch(&done->count, 1, __ATOMIC_RELEASE);
+}
+
+static int wait_completions(LoopCompletion &done, int count)
+{
+    int seen = 0;
+
+    for (int i = 0; i < 1000 && seen < count; i++)
+    {
+        seen = __atomic_load_n(&done.count, __ATOMIC_ACQUIRE);
+        if (seen < count)
+            usleep(1000);
+    }
+    return seen;
+}
+
+BOOST_AUTO_TEST_CASE(EventLoopCallback)
+{
+    std::vector<unsigned char> data = pattern(510);
+    std::vector<unsigned char> buf(510);
+    struct ftdi_event_loop *loop = ftdi_event_loop_new();
+    ftdi_context *attached = ftdi_new();
+    LoopCompletion done = LoopCompletion();
+    const char *filename = "emulated_loop_capture.bin";
+
+    BOOST_REQUIRE(loop != NULL);
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_event_loop(attached, loop));
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_emulated(attached, TYPE_232H, 1));
+
+    // the read-ahead would complete without the state lock
+    BOOST_REQUIRE_EQUAL(0, ftdi_read_data_set_readahead(attached, 2));
+    BOOST_CHECK_EQUAL(-6, ftdi_event_loop_start(loop, -1, 0));
+    BOOST_REQUIRE_EQUAL(0, ftdi_read_data_set_readahead(attached, 0));
+    BOOST_REQUIRE_EQUAL(0, ftdi_event_loop_start(loop, -1, 0));
+    BOOST_CHECK_EQUAL(-4, ftdi_read_data_set_readahead(attached, 2));
+    BOOST_CHECK_EQUAL(-7, ftdi_reader_start(attached, 4096));
+
+    // nobody waits, the event thread completes the transfers
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_submit_cb(attached, &data[0], data.size(), loop_completion, &done));
+    BOOST_CHECK_EQUAL(1, wait_completions(done, 1));
+    BOOST_CHECK(!pthread_equal(done.thread, pthread_self()));
+
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_submit_cb(attached, &buf[0], buf.size(), loop_completion, &done));
+    BOOST_CHECK_EQUAL(2, wait_completions(done, 2));
+    BOOST_CHECK(!pthread_equal(done.thread, pthread_self()));
+    BOOST_CHECK_EQUAL(1020, done.bytes);
+    BOOST_CHECK(buf == data);
+
+    // still polled while captured
+    BOOST_REQUIRE_EQUAL(0, ftdi_capture_start(attached, filename));
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_submit_cb(attached, &data[0], data.size(), loop_completion, &done));
+    BOOST_CHECK_EQUAL(3, wait_completions(done, 3));
+    BOOST_CHECK(!pthread_equal(done.thread, pthread_self()));
+    BOOST_CHECK_EQUAL(0, ftdi_capture_stop(attached));
+
+    // a replay is limited to one thread
+    BOOST_CHECK_EQUAL(0, ftdi_usb_close(attached));
+    BOOST_CHECK_EQUAL(-6, ftdi_usb_open_replay(attached, filename, 0));
+    remove(filename);
+
+    BOOST_CHECK_EQUAL(0, ftdi_event_loop_stop(loop));
+    ftdi_free(attached);
+    BOOST_CHECK_EQUAL(0, ftdi_event_loop_free(loop));
+}
+
+BOOST_AUTO_TEST_CASE(WaitAnyAll)
+{
+    std::vector<unsigned char> data = pattern(3000);
+    std::vector<unsigned char> buf(3000);
+    unsigned char idle[16];
+    struct ftdi_transfer_control *tcs[3];
+
+    tcs[0] = ftdi_write_data_submit(ftdi, &data[0], 1000);
+    tcs[1] = ftdi_write_data_submit(ftdi, &data[1000], 2000);
+    BOOST_REQUIRE(tcs[0] != NULL && tcs[1] != NULL);
+    tcs[2] = NULL;
+
+    BOOST_CHECK_EQUAL(0, ftdi_transfer_data_wait_all(tcs, 3, 1000));
+    BOOST_CHECK_EQUAL(1000, ftdi_transfer_data_done(tcs[0]));
+    BOOST_CHECK_EQUAL(2000, ftdi_transfer_data_done(tcs[1]));
+    tcs[1] = NULL;
+
+    tcs[0] = ftdi_read_data_submit(ftdi, &buf[0], buf.size());
+    BOOST_REQUIRE(tcs[0] != NULL);
+    BOOST_CHECK_EQUAL(0, ftdi_transfer_data_wait_any(tcs, 1, 1000));
+    BOOST_CHECK_EQUAL(3000, ftdi_transfer_data_done(tcs[0]));
+    BOOST_CHECK(buf == data);
+
+    // nothing left to read, the read waits for data
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 255));
+    tcs[0] = ftdi_read_data_submit(ftdi, idle, sizeof(idle));
+    BOOST_REQUIRE(tcs[0] != NULL);
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_TIMEOUT, ftdi_transfer_data_wait_all(tcs, 1, 10));
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_INVALID_PARAM, ftdi_transfer_data_wait_any(&tcs[1], 2, 10));
+    ftdi_transfer_data_cancel(tcs[0], NULL);
+}
+
+BOOST_AUTO_TEST_CASE(TransferPool)
+{
+    std::vector<unsigned char> data = pattern(8);
+    unsigned char buf[4];
+    ftdi_transfer_control *tc, *again;
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_transfer_pool(ftdi, 2));
+    BOOST_CHECK_EQUAL(8, ftdi_write_data(ftdi, &data[0], data.size()));
+
+    tc = ftdi_read_data_submit(ftdi, buf, sizeof(buf));
+    BOOST_REQUIRE(tc != NULL);
+    BOOST_CHECK_EQUAL(1, ftdi->tc_pool_count);
+    BOOST_CHECK_EQUAL(4, ftdi_transfer_data_done(tc));
+    BOOST_CHECK_EQUAL(2, ftdi->tc_pool_count);
+    BOOST_CHECK(memcmp(buf, &data[0], 4) == 0);
+
+    // the control just returned gets reused
+    again = ftdi_read_data_submit(ftdi, buf, sizeof(buf));
+    BOOST_CHECK(again == tc);
+    BOOST_CHECK_EQUAL(4, ftdi_transfer_data_done(again));
+    BOOST_CHECK(memcmp(buf, &data[4], 4) == 0);
+    BOOST_CHECK_EQUAL(2, ftdi->tc_pool_count);
+}
+
+BOOST_AUTO_TEST_CASE(WaitForTransfer)
+{
+    std::vector<unsigned char> data = pattern(8);
+    unsigned char buf[4];
+    ftdi_transfer_control *tc;
+    struct timeval deadline = { 0, 0 };
+
+    BOOST_CHECK_EQUAL(8, ftdi_write_data(ftdi, &data[0], data.size()));
+    tc = ftdi_read_data_submit(ftdi, buf, sizeof(buf));
+    BOOST_REQUIRE(tc != NULL);
+    BOOST_CHECK_EQUAL(4, ftdi_transfer_data_wait(tc, 1000));
+
+    // served from the readbuffer, a deadline in the past doesn't keep
+    // the completed transfer from finishing
+    tc = ftdi_read_data_submit(ftdi, buf, sizeof(buf));
+    BOOST_REQUIRE(tc != NULL);
+    BOOST_CHECK(tc->completed);
+    BOOST_CHECK_EQUAL(4, ftdi_transfer_data_wait_until(tc, &deadline));
+    BOOST_CHECK(memcmp(buf, &data[4], 4) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(WaitAnyCompleted)
+{
+    std::vector<unsigned char> data = pattern(9);
+    unsigned char buf[4];
+    ftdi_transfer_control *tcs[3] = { NULL, NULL, NULL };
+
+    // leave eight bytes in the readbuffer, the reads complete right away
+    BOOST_CHECK_EQUAL(9, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(1, ftdi_read_data_blocking(ftdi, buf, 1, 1, 0));
+    tcs[1] = ftdi_read_data_submit(ftdi, buf, 2);
+    tcs[2] = ftdi_read_data_submit(ftdi, buf + 2, 2);
+    BOOST_REQUIRE(tcs[1] != NULL && tcs[2] != NULL);
+
+    BOOST_CHECK_EQUAL(1, ftdi_transfer_data_wait_any(tcs, 3, 0));
+    BOOST_CHECK_EQUAL(0, ftdi_transfer_data_wait_all(tcs, 3, 0));
+
+    BOOST_CHECK_EQUAL(2, ftdi_transfer_data_done(tcs[1]));
+    tcs[1] = NULL;
+    BOOST_CHECK_EQUAL(2, ftdi_transfer_data_wait_any(tcs, 3, -1));
+    BOOST_CHECK_EQUAL(2, ftdi_transfer_data_done(tcs[2]));
+    BOOST_CHECK(memcmp(buf, &data[1], 4) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(ReadUntil)
+{
+    const unsigned char delims[] = { 20, 10 };
+    const unsigned char far_delim = 150;
+    unsigned char data[186];
+    unsigned char buf[128];
+
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = i;
+
+    BOOST_CHECK_EQUAL(-1, ftdi_read_data_until(ftdi, buf, sizeof(buf), delims, 0, 0));
+
+    // one transfer brings everything, the rest stays in the readbuffer
+    BOOST_CHECK_EQUAL(186, ftdi_write_data(ftdi, data, sizeof(data)));
+    BOOST_CHECK_EQUAL(11, ftdi_read_data_until(ftdi, buf, sizeof(buf), delims, 2, 1000));
+    BOOST_CHECK(memcmp(buf, data, 11) == 0);
+    BOOST_CHECK_EQUAL(10, ftdi_read_data_until(ftdi, buf, sizeof(buf), delims, 2, 0));
+    BOOST_CHECK(memcmp(buf, data + 11, 10) == 0);
+
+    // buffer full before the delimiter
+    BOOST_CHECK_EQUAL(5, ftdi_read_data_until(ftdi, buf, 5, &far_delim, 1, 0));
+    BOOST_CHECK(memcmp(buf, data + 21, 5) == 0);
+    BOOST_CHECK_EQUAL(186U - 26, ftdi->readbuffer_remaining);
+
+    // the delimiter is found in what is left
+    BOOST_CHECK_EQUAL(125, ftdi_read_data_until(ftdi, buf, sizeof(buf), &far_delim, 1, 0));
+    BOOST_CHECK_EQUAL(far_delim, buf[124]);
+}
+
+BOOST_AUTO_TEST_CASE(WriteBuffer)
+{
+    std::vector<unsigned char> data = pattern(1000);
+    std::vector<unsigned char> buf(1000);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_buffer(ftdi, 4096, -1));
+    ftdi->bulk_out_transfers = 0;
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK_EQUAL(10, ftdi_write_data(ftdi, &data[i * 10], 10));
+    BOOST_CHECK_EQUAL(0U, ftdi->bulk_out_transfers);
+
+    // reading sends the buffered data first, in one transfer
+    BOOST_CHECK_EQUAL(1000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK_EQUAL(1U, ftdi->bulk_out_transfers);
+    BOOST_CHECK(buf == data);
+
+    // a write not fitting anymore pushes the buffer out
+    std::vector<unsigned char> big = pattern(5000);
+    BOOST_CHECK_EQUAL(10, ftdi_write_data(ftdi, &data[0], 10));
+    BOOST_CHECK_EQUAL(5000, ftdi_write_data(ftdi, &big[0], big.size()));
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_flush(ftdi));
+    buf.resize(5010);
+    BOOST_CHECK_EQUAL(5010, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(memcmp(&buf[0], &data[0], 10) == 0);
+    BOOST_CHECK(memcmp(&buf[10], &big[0], big.size()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(PipelinedWrite)
+{
+    std::vector<unsigned char> data = pattern(10000);
+    std::vector<unsigned char> buf(10000);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_chunksize(ftdi, 256));
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_queue_depth(ftdi, 4));
+    ftdi->bulk_out_transfers = 0;
+    BOOST_CHECK_EQUAL(10000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(40U, ftdi->bulk_out_transfers);
+    BOOST_CHECK_EQUAL(10000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+}
+
+/// Record kinds of a capture file
+enum { CAPTURE_CONTROL = 1, CAPTURE_BULK = 2, CAPTURE_ASYNC = 3 };
+
+/// Append an OUT record to a capture file made up by hand
+static void capture_write(FILE *file, int kind, int status, int length, int actual)
+{
+    unsigned char record[32];
+    std::vector<unsigned char> data = pattern(actual);
+
+    memset(record, 0, sizeof(record));
+    record[0] = kind;
+    record[1] = 0x02;
+    record[3] = status;
+    record[12] = length & 0xff;
+    record[13] = length >> 8;
+    record[16] = actual & 0xff;
+    record[17] = actual >> 8;
+    fwrite(record, sizeof(record), 1, file);
+    if (actual > 0)
+        fwrite(&data[0], actual, 1, file);
+}
+
+/// Start a capture file made up by hand
+static FILE *capture_create(const char *filename)
+{
+    const unsigned char header[16] = { 'F', 'T', 'D', 'I', 'C', 'A', 'P', 1,
+                                       TYPE_232H, 0, 0, 2 };
+    FILE *file = fopen(filename, "wb");
+
+    BOOST_REQUIRE(file != NULL);
+    fwrite(header, sizeof(header), 1, file);
+    return file;
+}
+
+/// A capture of a pipelined write whose second chunk came back short
+static void capture_short_write(const char *filename, int third_actual)
+{
+    FILE *file = capture_create(filename);
+
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 64);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 30);
+    capture_write(file, CAPTURE_ASYNC,
+                  third_actual ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_CANCELLED,
+                  64, third_actual);
+    // submitted again from where the short one stopped
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 64);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 34, 34);
+    fclose(file);
+}
+
+/// A capture of a pipelined write whose last chunk came back short
+static void capture_short_last(const char *filename)
+{
+    FILE *file = capture_create(filename);
+
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 64);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 64);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 30);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 34, 34);
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(PipelinedShortWrite)
+{
+    ftdi_iovec iov[2];
+    std::vector<unsigned char> data = pattern(192);
+    const char *filename = "emulated_short_write.bin";
+
+    ftdi_usb_close(ftdi);
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_chunksize(ftdi, 64));
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_queue_depth(ftdi, 3));
+
+    // the chunk queued behind the short one is sent again
+    capture_short_write(filename, 0);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK_EQUAL(192, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(5U, ftdi->bulk_out_transfers);
+    ftdi_usb_close(ftdi);
+
+    // unless it already went out, that would leave a hole
+    capture_short_write(filename, 64);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK_EQUAL(-1, ftdi_write_data(ftdi, &data[0], data.size()));
+    ftdi_usb_close(ftdi);
+
+    // the rest of a short last chunk is sent with nothing else in flight
+    capture_short_last(filename);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK_EQUAL(192, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(4U, ftdi->bulk_out_transfers);
+    ftdi_usb_close(ftdi);
+
+    // the same vectored
+    iov[0].iov_base = &data[0];
+    iov[0].iov_len = 60;
+    iov[1].iov_base = &data[60];
+    iov[1].iov_len = 132;
+    capture_short_last(filename);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK_EQUAL(192, ftdi_write_datav(ftdi, iov, 2));
+    BOOST_CHECK_EQUAL(4U, ftdi->bulk_out_transfers);
+
+    remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(WriteVectored)
+{
+    std::vector<unsigned char> data = pattern(10000);
+    std::vector<unsigned char> buf(10000);
+    ftdi_iovec iov[4] =
+    {
+        { &data[0], 3 },
+        { &data[3], 5000 },
+        { &data[5003], 0 },
+        { &data[5003], 4997 },
+    };
+
+    ftdi_iovec bad = { &data[0], -1 };
+
+    BOOST_CHECK_EQUAL(-2, ftdi_write_datav(ftdi, &bad, 1));
+    BOOST_CHECK_EQUAL(10000, ftdi_write_datav(ftdi, iov, 4));
+    BOOST_CHECK_EQUAL(10000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+
+    // with several chunks in flight
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_chunksize(ftdi, 256));
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_queue_depth(ftdi, 4));
+    ftdi->bulk_out_transfers = 0;
+    std::fill(buf.begin(), buf.end(), 0);
+    BOOST_CHECK_EQUAL(10000, ftdi_write_datav(ftdi, iov, 4));
+    BOOST_CHECK_EQUAL(40U, ftdi->bulk_out_transfers);
+    BOOST_CHECK_EQUAL(10000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+
+    // queued segment by segment into the write buffer
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_buffer(ftdi, 4096, -1));
+    std::fill(buf.begin(), buf.end(), 0);
+    BOOST_CHECK_EQUAL(10000, ftdi_write_datav(ftdi, iov, 4));
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_flush(ftdi));
+    BOOST_CHECK_EQUAL(10000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+}
+
+BOOST_AUTO_TEST_CASE(WriteVectoredShort)
+{
+    std::vector<unsigned char> data = pattern(100);
+    ftdi_iovec iov[2] = { { &data[0], 40 }, { &data[40], 60 } };
+    const char *filename = "emulated_short_writev.bin";
+    ftdi_transfer_control *tc;
+    FILE *file;
+
+    ftdi_usb_close(ftdi);
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_chunksize(ftdi, 64));
+
+    // the first chunk is sent in two goes, then the rest
+    file = capture_create(filename);
+    capture_write(file, CAPTURE_BULK, 0, 64, 30);
+    capture_write(file, CAPTURE_BULK, 0, 34, 34);
+    capture_write(file, CAPTURE_BULK, 0, 36, 36);
+    fclose(file);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK_EQUAL(100, ftdi_write_datav(ftdi, iov, 2));
+    BOOST_CHECK_EQUAL(3U, ftdi->bulk_out_transfers);
+    ftdi_usb_close(ftdi);
+
+    // the same async
+    file = capture_create(filename);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 64, 30);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 34, 34);
+    capture_write(file, CAPTURE_ASYNC, LIBUSB_TRANSFER_COMPLETED, 36, 36);
+    fclose(file);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    tc = ftdi_write_datav_submit(ftdi, iov, 2);
+    BOOST_REQUIRE(tc != NULL);
+    BOOST_CHECK_EQUAL(100, ftdi_transfer_data_done(tc));
+    BOOST_CHECK_EQUAL(3U, ftdi->bulk_out_transfers);
+
+    remove(filename);
+}
+
+/// Kinds and requests of the records in a capture file
+static std::vector<std::pair<int, int> > capture_records(const char *filename)
+{
+    std::vector<std::pair<int, int> > records;
+    unsigned char record[32];
+    FILE *file = fopen(filename, "rb");
+
+    BOOST_REQUIRE(file != NULL);
+    fseek(file, 16, SEEK_SET);
+    while (fread(record, sizeof(record), 1, file) == 1)
+    {
+        long actual = record[16] | (record[17] << 8) | (record[18] << 16);
+
+        records.push_back(std::make_pair((int)record[0], (int)record[2]));
+        fseek(file, actual, SEEK_CUR);
+    }
+    fclose(file);
+    return records;
+}
+
+BOOST_AUTO_TEST_CASE(WriteBufferOrdering)
+{
+    const unsigned char cmd[3] = { 0x80, 0x08, 0x0b };
+    const char *filename = "emulated_write_buffer.bin";
+    const int requests[] =
+    {
+        SIO_SET_BAUDRATE_REQUEST, SIO_SET_DATA_REQUEST,
+        SIO_SET_FLOW_CTRL_REQUEST, SIO_SET_FLOW_CTRL_REQUEST,
+        SIO_SET_MODEM_CTRL_REQUEST, SIO_SET_MODEM_CTRL_REQUEST, SIO_SET_MODEM_CTRL_REQUEST,
+        SIO_SET_LATENCY_TIMER_REQUEST, SIO_SET_EVENT_CHAR_REQUEST, SIO_SET_ERROR_CHAR_REQUEST,
+        SIO_SET_BITMODE_REQUEST,
+    };
+    const int count = sizeof(requests) / sizeof(requests[0]);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_buffer(ftdi, 64, -1));
+    BOOST_REQUIRE_EQUAL(0, ftdi_capture_start(ftdi, filename));
+
+    // the data buffered before a line setting changes goes out first
+    for (int i = 0; i < count; i++)
+    {
+        BOOST_CHECK_EQUAL(3, ftdi_write_data(ftdi, cmd, sizeof(cmd)));
+        BOOST_CHECK_EQUAL(3U, ftdi->write_buffer_used);
+        switch (i)
+        {
+            case 0: BOOST_CHECK_EQUAL(0, ftdi_set_baudrate(ftdi, 115200)); break;
+            case 1: BOOST_CHECK_EQUAL(0, ftdi_set_line_property2(ftdi, BITS_8, STOP_BIT_1, NONE, BREAK_OFF)); break;
+            case 2: BOOST_CHECK_EQUAL(0, ftdi_setflowctrl(ftdi, SIO_RTS_CTS_HS)); break;
+            case 3: BOOST_CHECK_EQUAL(0, ftdi_setflowctrl_xonxoff(ftdi, 0x11, 0x13)); break;
+            case 4: BOOST_CHECK_EQUAL(0, ftdi_setdtr(ftdi, 1)); break;
+            case 5: BOOST_CHECK_EQUAL(0, ftdi_setrts(ftdi, 1)); break;
+            case 6: BOOST_CHECK_EQUAL(0, ftdi_setdtr_rts(ftdi, 0, 0)); break;
+            case 7: BOOST_CHECK_EQUAL(0, ftdi_set_latency_timer(ftdi, 16)); break;
+            case 8: BOOST_CHECK_EQUAL(0, ftdi_set_event_char(ftdi, '\n', 1)); break;
+            case 9: BOOST_CHECK_EQUAL(0, ftdi_set_error_char(ftdi, 0, 0)); break;
+            case 10: BOOST_CHECK_EQUAL(0, ftdi_set_bitmode(ftdi, 0, BITMODE_RESET)); break;
+        }
+        BOOST_CHECK_EQUAL(0U, ftdi->write_buffer_used);
+    }
+    BOOST_CHECK_EQUAL(0, ftdi_capture_stop(ftdi));
+
+    std::vector<std::pair<int, int> > records = capture_records(filename);
+    BOOST_REQUIRE_EQUAL((size_t)count * 2, records.size());
+    for (int i = 0; i < count; i++)
+    {
+        BOOST_CHECK_EQUAL(CAPTURE_BULK, records[i * 2].first);
+        BOOST_CHECK_EQUAL(CAPTURE_CONTROL, records[i * 2 + 1].first);
+        BOOST_CHECK_EQUAL(requests[i], records[i * 2 + 1].second);
+    }
+
+    remove(filename);
+}
+
+/// Hands out a pattern in blocks of odd sizes
+struct WriteSource
+{
+    std::vector<unsigned char> data;
+    size_t offset;
+    int progress_calls;
+};
+
+static int produce(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
+{
+    WriteSource *source = static_cast<WriteSource *>(userdata);
+    int n = 777;
+
+    if (buffer == NULL)
+    {
+        (void) progress;
+        source->progress_calls++;
+        return 0;
+    }
+    if (n > length)
+        n = length;
+    if ((size_t)n > source->data.size() - source->offset)
+        n = source->data.size() - source->offset;
+    memcpy(buffer, &source->data[source->offset], n);
+    source->offset += n;
+    return n;
+}
+
+BOOST_AUTO_TEST_CASE(WriteStream)
+{
+    WriteSource source;
+    std::vector<unsigned char> buf(100000);
+
+    source.data = pattern(100000);
+    source.offset = 0;
+    source.progress_calls = 0;
+
+    BOOST_CHECK_EQUAL(0, ftdi_writestream(ftdi, produce, &source, 4, 4));
+    BOOST_CHECK_EQUAL(100000U, source.offset);
+    BOOST_CHECK_EQUAL(100000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == source.data);
+
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_INVALID_PARAM, ftdi_writestream(ftdi, produce, &source, 0, 4));
+}
+
+BOOST_AUTO_TEST_CASE(BlockingNoWait)
+{
+    const unsigned char data[] = "abc";
+    unsigned char buf[16];
+
+    // vmin = 0, vtime = 0 is ftdi_read_data()
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 0, 0));
+    BOOST_CHECK_EQUAL(3, ftdi_write_data(ftdi, data, 3));
+    BOOST_CHECK_EQUAL(3, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 0, 0));
+    BOOST_CHECK(memcmp(buf, data, 3) == 0);
+
+    // and ftdi_read_data() goes the same way
+    BOOST_CHECK_EQUAL(0, ftdi_read_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK_EQUAL(3, ftdi_write_data(ftdi, data, 3));
+    BOOST_CHECK_EQUAL(3, ftdi_read_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK(memcmp(buf, data, 3) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(BlockingMinimum)
+{
+    std::vector<unsigned char> data = pattern(10);
+    unsigned char buf[16];
+    DelayedWrite w;
+
+    // vmin > 0, vtime = 0 waits for vmin bytes, however long it takes
+    BOOST_CHECK_EQUAL(5, ftdi_write_data(ftdi, &data[0], 5));
+    delayed_write(w, ftdi, &data[5], 5, 50);
+    BOOST_CHECK_EQUAL(10, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 10, 0));
+    pthread_join(w.thread, NULL);
+    BOOST_CHECK(memcmp(buf, &data[0], 10) == 0);
+
+    // vmin is limited to the buffer size
+    BOOST_CHECK_EQUAL(5, ftdi_write_data(ftdi, &data[0], 5));
+    BOOST_CHECK_EQUAL(4, ftdi_read_data_blocking(ftdi, buf, 4, 10, 0));
+    BOOST_CHECK_EQUAL(1, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 1, 0));
+}
+
+BOOST_AUTO_TEST_CASE(BlockingTimeout)
+{
+    const unsigned char data[] = "late";
+    unsigned char buf[16];
+    struct timeval start;
+    DelayedWrite w;
+
+    // vmin = 0, vtime > 0 gives up after vtime without data
+    gettimeofday(&start, NULL);
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 0, 30));
+    BOOST_CHECK(elapsed_ms(start) >= 30);
+
+    // and returns whatever arrives before
+    delayed_write(w, ftdi, data, 4, 20);
+    BOOST_CHECK_EQUAL(4, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 0, 5000));
+    pthread_join(w.thread, NULL);
+    BOOST_CHECK(memcmp(buf, data, 4) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(BlockingInterByte)
+{
+    std::vector<unsigned char> data = pattern(6);
+    unsigned char buf[16];
+    struct timeval start;
+    DelayedWrite w;
+
+    // vmin > 0, vtime > 0 waits for the first byte however long it takes
+    delayed_write(w, ftdi, &data[0], 3, 50);
+    gettimeofday(&start, NULL);
+    BOOST_CHECK_EQUAL(3, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 6, 20));
+    BOOST_CHECK(elapsed_ms(start) >= 50);
+    pthread_join(w.thread, NULL);
+    BOOST_CHECK(memcmp(buf, &data[0], 3) == 0);
+
+    // vmin bytes end it at once
+    BOOST_CHECK_EQUAL(6, ftdi_write_data(ftdi, &data[0], 6));
+    BOOST_CHECK_EQUAL(6, ftdi_read_data_blocking(ftdi, buf, sizeof(buf), 6, 5000));
+}
+
+BOOST_AUTO_TEST_CASE(ReaderThread)
+{
+    std::vector<unsigned char> data = pattern(20000);
+    std::vector<unsigned char> received;
+    unsigned long dropped = 1;
+
+    // the data wraps around the small ring many times
+    BOOST_REQUIRE_EQUAL(0, ftdi_reader_start(ftdi, 1000));
+    BOOST_CHECK_EQUAL(-3, ftdi_reader_start(ftdi, 1000));
+    for (size_t offset = 0; offset < data.size(); offset += 500)
+    {
+        BOOST_REQUIRE_EQUAL(500, ftdi_write_data(ftdi, &data[offset], 500));
+        while (received.size() < offset + 500)
+        {
+            unsigned char *p;
+            int n;
+
+            BOOST_REQUIRE(ftdi_reader_wait(ftdi, 1000) > 0);
+            n = ftdi_reader_peek(ftdi, &p);
+            BOOST_REQUIRE(n > 0);
+            received.insert(received.end(), p, p + n);
+            BOOST_REQUIRE_EQUAL(0, ftdi_reader_consume(ftdi, n));
+        }
+    }
+    BOOST_CHECK(received == data);
+    BOOST_CHECK_EQUAL(0, ftdi_reader_get_dropped(ftdi, &dropped));
+    BOOST_CHECK_EQUAL(0UL, dropped);
+    BOOST_CHECK_EQUAL(0, ftdi_reader_wait(ftdi, 10));
+
+    // the thread sits in a read waiting for the latency timer
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 200));
+    BOOST_CHECK_EQUAL(0, ftdi_reader_stop(ftdi));
+    BOOST_CHECK(ftdi->reader == NULL);
+    BOOST_CHECK_EQUAL(-1, ftdi_reader_wait(ftdi, 0));
+}
+
+BOOST_AUTO_TEST_CASE(StatusOnlyPackets)
+{
+    struct ftdi_status_event events[FTDI_STATUS_EVENTS];
+    unsigned short status = 0;
+    unsigned char buf[16];
+    struct ftdi_transfer_control *tc;
+
+    // the loopback plug turns RTS into CTS, seen by an idle read
+    BOOST_REQUIRE_EQUAL(0, ftdi_setrts(ftdi, 1));
+    BOOST_CHECK_EQUAL(0, ftdi_read_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK_EQUAL(0, ftdi_get_modem_status(ftdi, &status));
+    BOOST_CHECK_EQUAL(0x6011, status);
+    BOOST_REQUIRE_EQUAL(1, ftdi_read_status_events(ftdi, events, FTDI_STATUS_EVENTS));
+    BOOST_CHECK_EQUAL(0U, events[0].offset);
+    BOOST_CHECK_EQUAL(0x6011, events[0].status);
+
+    // and DTR into DSR, seen by a pending async read
+    BOOST_REQUIRE_EQUAL(0, ftdi_setdtr(ftdi, 1));
+    tc = ftdi_read_data_submit(ftdi, buf, 1);
+    BOOST_REQUIRE(tc != NULL);
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_TIMEOUT, ftdi_transfer_data_wait_any(&tc, 1, 20));
+    BOOST_REQUIRE_EQUAL(1, ftdi_read_status_events(ftdi, events, FTDI_STATUS_EVENTS));
+    BOOST_CHECK_EQUAL(0x6031, events[0].status);
+    ftdi_transfer_data_cancel(tc, NULL);
+}
+
+BOOST_AUTO_TEST_CASE(Transact)
+{
+    unsigned char response[8];
+
+    BOOST_CHECK_EQUAL(-1, ftdi_transact(ftdi, (const unsigned char *)"abc", 0, response, 3));
+    BOOST_CHECK_EQUAL(-1, ftdi_transact(ftdi, (const unsigned char *)"abc", 3, response, -1));
+
+    BOOST_CHECK_EQUAL(3, ftdi_transact(ftdi, (const unsigned char *)"abc", 3, response, 3));
+    BOOST_CHECK(memcmp(response, "abc", 3) == 0);
+
+    // what is left in the readbuffer comes first
+    BOOST_CHECK_EQUAL(3, ftdi_write_data(ftdi, (const unsigned char *)"xyz", 3));
+    BOOST_CHECK_EQUAL(1, ftdi_read_data_blocking(ftdi, response, 1, 1, 0));
+    BOOST_CHECK_EQUAL(4, ftdi_transact(ftdi, (const unsigned char *)"ab", 2, response, 4));
+    BOOST_CHECK(memcmp(response, "yzab", 4) == 0);
+
+    // the response never completes
+    ftdi->usb_read_timeout = 100;
+    BOOST_CHECK_EQUAL(-5, ftdi_transact(ftdi, (const unsigned char *)"abc", 3, response, 5));
+    BOOST_REQUIRE_EQUAL(0, ftdi_tciflush(ftdi));
+    BOOST_CHECK_EQUAL(2, ftdi_transact(ftdi, (const unsigned char *)"ok", 2, response, 2));
+    BOOST_CHECK(memcmp(response, "ok", 2) == 0);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_read_data_set_readahead(ftdi, 4));
+    BOOST_CHECK_EQUAL(-2, ftdi_transact(ftdi, (const unsigned char *)"abc", 3, response, 3));
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_set_readahead(ftdi, 0));
+}
+
+BOOST_AUTO_TEST_CASE(ProfileLatency)
+{
+    struct ftdi_latency_profile profiles[3];
+    unsigned char latency = 0;
+
+    memset(profiles, 0, sizeof(profiles));
+    profiles[0].latency = 40;
+    profiles[1].latency = 10;
+    // the event character doesn't wait for the latency timer
+    profiles[2].latency = 40;
+    profiles[2].event_char = '\n';
+    profiles[2].event_char_enable = 1;
+
+    BOOST_CHECK_EQUAL(-1, ftdi_profile_latency(ftdi, PROFILE_LOOPBACK, profiles, 0, 5));
+    BOOST_REQUIRE_EQUAL(0, ftdi_profile_latency(ftdi, PROFILE_LOOPBACK, profiles, 3, 5));
+
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_CHECK_EQUAL(0, profiles[i].errors);
+        BOOST_CHECK(profiles[i].min <= profiles[i].p50);
+        BOOST_CHECK(profiles[i].p50 <= profiles[i].p99);
+        BOOST_CHECK(profiles[i].p99 <= profiles[i].max);
+    }
+    BOOST_CHECK(profiles[0].p50 >= 30000);
+    BOOST_CHECK(profiles[1].p50 < profiles[0].p50);
+    BOOST_CHECK(profiles[2].p50 < 10000);
+    BOOST_CHECK_EQUAL(2, ftdi_profile_best(profiles, 3));
+
+    // the settings are back
+    BOOST_CHECK_EQUAL(0, ftdi_get_latency_timer(ftdi, &latency));
+    BOOST_CHECK_EQUAL(2, latency);
+
+    profiles[2].errors = 1;
+    BOOST_CHECK_EQUAL(1, ftdi_profile_best(profiles, 3));
+    BOOST_CHECK_EQUAL(-1, ftdi_profile_best(profiles, 0));
+
+    // stale bytes don't pass for instant responses
+    profiles[1].latency = 40;
+    BOOST_CHECK_EQUAL(2, ftdi_write_data(ftdi, (const unsigned char *)"xy", 2));
+    BOOST_REQUIRE_EQUAL(0, ftdi_profile_latency(ftdi, PROFILE_LOOPBACK, profiles, 2, 3));
+    BOOST_CHECK_EQUAL(0, profiles[1].errors);
+    BOOST_CHECK(profiles[1].min >= 30000);
+
+    // round trips don't work while reading ahead
+    BOOST_REQUIRE_EQUAL(0, ftdi_read_data_set_readahead(ftdi, 4));
+    BOOST_CHECK_EQUAL(-4, ftdi_profile_latency(ftdi, PROFILE_LOOPBACK, profiles, 1, 1));
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_set_readahead(ftdi, 0));
+}
+
+static int collect(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
+{
+    std::vector<unsigned char> *received = static_cast<std::vector<unsigned char> *>(userdata);
+
+    (void) progress;
+    if (length > 0)
+        received->insert(received->end(), buffer, buffer + length);
+    return received->size() >= 50000;
+}
+
+BOOST_AUTO_TEST_CASE(ReadStream)
+{
+    std::vector<unsigned char> data = pattern(50000);
+    std::vector<unsigned char> received;
+
+    BOOST_CHECK_EQUAL(50000, ftdi_write_data(ftdi, &data[0], data.size()));
+    // ftdi_readstream() would purge the loopback data first
+    BOOST_CHECK_EQUAL(1, ftdi_readstream_generic(ftdi, collect, &received, 8, 4));
+    BOOST_CHECK(received == data);
+}
+
+struct PacketStream
+{
+    ftdi_context *ftdi;
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> received;
+    int empty;
+    int largest;
+};
+
+static int collect_packets(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
+{
+    PacketStream *stream = static_cast<PacketStream *>(userdata);
+
+    if (progress)
+        return 1;
+    if (length == 0 && stream->empty++ == 0)
+        ftdi_write_data(stream->ftdi, &stream->data[0], stream->data.size());
+    stream->largest = std::max(stream->largest, length);
+    stream->received.insert(stream->received.end(), buffer, buffer + length);
+    return stream->received.size() >= stream->data.size();
+}
+
+BOOST_AUTO_TEST_CASE(ReadStreamPerPacket)
+{
+    PacketStream stream = { ftdi, pattern(2000) };
+
+    // status only packets get a call of their own, data one per packet
+    BOOST_CHECK_EQUAL(1, ftdi_readstream(ftdi, collect_packets, &stream, 8, 2));
+    BOOST_CHECK(stream.empty > 0);
+    BOOST_CHECK_EQUAL(510, stream.largest);
+    BOOST_CHECK(stream.received == stream.data);
+}
+
+BOOST_AUTO_TEST_CASE(CaptureReplay)
+{
+    std::vector<unsigned char> data = pattern(10000);
+    std::vector<unsigned char> buf(10000);
+    const char *filename = "emulated_capture.bin";
+    unsigned char latency = 0;
+
+    BOOST_CHECK_EQUAL(-1, ftdi_capture_start(ftdi, NULL));
+    BOOST_REQUIRE_EQUAL(0, ftdi_capture_start(ftdi, filename));
+    BOOST_CHECK_EQUAL(-2, ftdi_capture_start(ftdi, filename));
+
+    BOOST_CHECK_EQUAL(10000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(10000, read_all(ftdi, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+    BOOST_CHECK_EQUAL(0, ftdi_get_latency_timer(ftdi, &latency));
+    BOOST_CHECK_EQUAL(0, ftdi_capture_stop(ftdi));
+    BOOST_CHECK_EQUAL(-1, ftdi_capture_stop(ftdi));
+
+    ftdi_context *replay = ftdi_new();
+    BOOST_CHECK_EQUAL(-4, ftdi_usb_open_replay(replay, "no_such_capture.bin", 0));
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(replay, filename, 0));
+    BOOST_CHECK_EQUAL(TYPE_232H, replay->type);
+    BOOST_CHECK_EQUAL(512, replay->max_packet_size);
+
+    std::fill(buf.begin(), buf.end(), 0);
+    latency = 0;
+    BOOST_CHECK_EQUAL(10000, ftdi_write_data(replay, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(10000, read_all(replay, &buf[0], buf.size()));
+    BOOST_CHECK(buf == data);
+    BOOST_CHECK_EQUAL(0, ftdi_get_latency_timer(replay, &latency));
+    BOOST_CHECK_EQUAL(2, latency);
+
+    // the recording ran out
+    BOOST_CHECK(ftdi_read_data(replay, &buf[0], buf.size()) < 0);
+    ftdi_free(replay);
+
+    // not a capture file
+    FILE *file = fopen(filename, "wb");
+    fputs("garbage, not a capture", file);
+    fclose(file);
+    replay = ftdi_new();
+    BOOST_CHECK_EQUAL(-5, ftdi_usb_open_replay(replay, filename, 0));
+    ftdi_free(replay);
+
+    remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(CaptureReplayStream)
+{
+    std::vector<unsigned char> data = pattern(50000);
+    std::vector<unsigned char> received;
+    const char *filename = "emulated_capture_stream.bin";
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_capture_start(ftdi, filename));
+    BOOST_CHECK_EQUAL(50000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(1, ftdi_readstream_generic(ftdi, collect, &received, 8, 4));
+    BOOST_CHECK(received == data);
+    // closing ends the capture too
+    BOOST_CHECK_EQUAL(0, ftdi_usb_close(ftdi));
+    BOOST_CHECK(ftdi->capture == NULL);
+
+    received.clear();
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK_EQUAL(50000, ftdi_write_data(ftdi, &data[0], data.size()));
+    BOOST_CHECK_EQUAL(1, ftdi_readstream_generic(ftdi, collect, &received, 8, 4));
+    BOOST_CHECK(received == data);
+
+    remove(filename);
+}
+
+/// Overwrite size bytes at offset of a file
+static void patch_file(const char *filename, long offset, const unsigned char *bytes, size_t size)
+{
+    FILE *file = fopen(filename, "r+b");
+
+    BOOST_REQUIRE(file != NULL);
+    fseek(file, offset, SEEK_SET);
+    fwrite(bytes, size, 1, file);
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(ReplayMalformed)
+{
+    const unsigned char data[] = "hello";
+    const char *filename = "emulated_capture_malformed.bin";
+    const unsigned char no_packet_size[] = { 0, 0 };
+    const unsigned char odd_packet_size[] = { 100, 0 };
+    const unsigned char packet_size[] = { 0, 2 };
+    const unsigned char huge_actual[] = { 0xf0, 0xff, 0xff, 0xff };
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_capture_start(ftdi, filename));
+    BOOST_CHECK_EQUAL(5, ftdi_write_data(ftdi, data, 5));
+    BOOST_CHECK_EQUAL(0, ftdi_capture_stop(ftdi));
+    ftdi_usb_close(ftdi);
+
+    // the packet size in the header
+    patch_file(filename, 10, no_packet_size, 2);
+    BOOST_CHECK_EQUAL(-5, ftdi_usb_open_replay(ftdi, filename, 0));
+    patch_file(filename, 10, odd_packet_size, 2);
+    BOOST_CHECK_EQUAL(-5, ftdi_usb_open_replay(ftdi, filename, 0));
+    patch_file(filename, 10, packet_size, 2);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    ftdi_usb_close(ftdi);
+
+    // a record claiming more data than the file holds ends the recording
+    patch_file(filename, 16 + 16, huge_actual, 4);
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 0));
+    BOOST_CHECK(ftdi_write_data(ftdi, data, 5) < 0);
+
+    remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(ReplayTiming)
+{
+    const unsigned char data[] = "hello";
+    unsigned char buf[16];
+    const char *filename = "emulated_capture_timing.bin";
+    struct timeval start;
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_latency_timer(ftdi, 60));
+    BOOST_REQUIRE_EQUAL(0, ftdi_capture_start(ftdi, filename));
+    BOOST_CHECK_EQUAL(5, ftdi_write_data(ftdi, data, 5));
+    // a short packet waits for the latency timer
+    BOOST_CHECK_EQUAL(5, ftdi_read_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK_EQUAL(0, ftdi_capture_stop(ftdi));
+    ftdi_usb_close(ftdi);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 1));
+    ftdi_write_data(ftdi, data, 5);
+    gettimeofday(&start, NULL);
+    BOOST_CHECK_EQUAL(5, ftdi_read_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK(elapsed_ms(start) >= 40);
+    ftdi_usb_close(ftdi);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_usb_open_replay(ftdi, filename, 10));
+    ftdi_write_data(ftdi, data, 5);
+    gettimeofday(&start, NULL);
+    BOOST_CHECK_EQUAL(5, ftdi_read_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK(memcmp(buf, data, 5) == 0);
+
+    remove(filename);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
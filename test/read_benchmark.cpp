@@ -0,0 +1,400 @@
+/**@file
+@brief Benchmark the read path of ftdi_read_data()
+
+Compares the previous strip-in-place-then-copy implementation with the
+current single pass de-framing on synthetic bulk transfers, the
+de-framing kernels on their own, and the whole read path of
+ftdi_read_data() and ftdi_read_data_submit() against the emulated device.
+Run with "make benchmark".
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <ftdi.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#ifdef __GLIBC__
+/* Count the allocations of libftdi, the executable's malloc() wins
+   over the one of the C library */
+extern "C"
+{
+    extern void *__libc_malloc(size_t size);
+    extern void *__libc_calloc(size_t nmemb, size_t size);
+    extern void *__libc_realloc(void *ptr, size_t size);
+}
+
+static unsigned long allocations;
+
+void *malloc(size_t size) __THROW
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) __THROW
+{
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) __THROW
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOCATION_COUNT 1
+#else
+static unsigned long allocations;
+#endif
+
+extern "C" int read_data_deframe_UT_export(struct ftdi_context *ftdi, int actual_length,
+                                           unsigned char *buf, int size);
+extern "C" int deframe_UT_export(int kernel, unsigned char *dst, const unsigned char *src,
+                                 int length, int packet_size);
+
+/// Copy of the memmove based status byte stripping libftdi used before
+static int legacy_deframe(ftdi_context *ftdi, int actual_length, unsigned char *buf, int size)
+{
+    int packet_size = ftdi->max_packet_size;
+    int num_of_chunks, chunk_remains, i;
+
+    ftdi->readbuffer_offset = 0;
+    ftdi->readbuffer_remaining = 0;
+
+    num_of_chunks = actual_length / packet_size;
+    chunk_remains = actual_length % packet_size;
+
+    ftdi->readbuffer_offset += 2;
+    actual_length -= 2;
+
+    if (actual_length > packet_size - 2)
+    {
+        for (i = 1; i < num_of_chunks; i++)
+            memmove (ftdi->readbuffer+ftdi->readbuffer_offset+(packet_size - 2)*i,
+                     ftdi->readbuffer+ftdi->readbuffer_offset+packet_size*i,
+                     packet_size - 2);
+        if (chunk_remains > 2)
+        {
+            memmove (ftdi->readbuffer+ftdi->readbuffer_offset+(packet_size - 2)*i,
+                     ftdi->readbuffer+ftdi->readbuffer_offset+packet_size*i,
+                     chunk_remains-2);
+            actual_length -= 2*num_of_chunks;
+        }
+        else
+            actual_length -= 2*(num_of_chunks-1)+chunk_remains;
+    }
+
+    if (actual_length <= size)
+    {
+        memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, actual_length);
+        ftdi->readbuffer_offset = 0;
+        return actual_length;
+    }
+
+    memcpy (buf, ftdi->readbuffer+ftdi->readbuffer_offset, size);
+    ftdi->readbuffer_offset += size;
+    ftdi->readbuffer_remaining = actual_length - size;
+    return size;
+}
+
+typedef int (*deframe_func)(ftdi_context *, int, unsigned char *, int);
+
+static int current_deframe(ftdi_context *ftdi, int actual_length, unsigned char *buf, int size)
+{
+    return read_data_deframe_UT_export(ftdi, actual_length, buf, size);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static unsigned long long cycles()
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct result
+{
+    double seconds;
+    unsigned long long cycles;
+};
+
+/// Run func over the synthetic transfer. The time needed to refill
+/// the readbuffer (the part libusb does) is measured separately and subtracted.
+static result run(ftdi_context *ftdi, deframe_func func, const std::vector<unsigned char> &transfer,
+                  unsigned char *buf, int size, int iterations)
+{
+    result res, refill;
+    double start;
+    unsigned long long start_cycles;
+    int i;
+
+    start = now();
+    start_cycles = cycles();
+    for (i = 0; i < iterations; i++)
+        memcpy(ftdi->readbuffer, &transfer[0], transfer.size());
+    refill.seconds = now() - start;
+    refill.cycles = cycles() - start_cycles;
+
+    start = now();
+    start_cycles = cycles();
+    for (i = 0; i < iterations; i++)
+    {
+        memcpy(ftdi->readbuffer, &transfer[0], transfer.size());
+        func(ftdi, transfer.size(), buf, size);
+    }
+    res.seconds = now() - start - refill.seconds;
+    res.cycles = cycles() - start_cycles - refill.cycles;
+
+    return res;
+}
+
+/// Compare the de-framing kernels on their own, copying and in place
+static void run_kernels()
+{
+    static const char *kernel_names[] = { "portable", "sse2", "avx2" };
+    static const int packet_sizes[] = { 64, 512 };
+    const int length = 16384;
+    const int iterations = (256 << 20) / length;
+    std::vector<unsigned char> src(length), work(length), dst(length);
+    int p, k, i, in_place;
+
+    printf("\n%8s %6s %8s | %12s %12s\n", "kernel", "packet", "mode", "MB/s", "B/cycle");
+
+    for (p = 0; p < 2; p++)
+        for (k = 0; k < 3; k++)
+            for (in_place = 0; in_place < 2; in_place++)
+            {
+                int payload = length / packet_sizes[p] * (packet_sizes[p] - 2);
+                unsigned char *out = in_place ? &work[0] : &dst[0];
+                unsigned long long start_cycles, refill_cycles;
+                double start, refill;
+
+                if (deframe_UT_export(k, &dst[0], &src[0], length, packet_sizes[p]) < 0)
+                    continue;
+
+                start = now();
+                start_cycles = cycles();
+                for (i = 0; i < iterations; i++)
+                    memcpy(&work[0], &src[0], length);
+                refill = now() - start;
+                refill_cycles = cycles() - start_cycles;
+
+                start = now();
+                start_cycles = cycles();
+                for (i = 0; i < iterations; i++)
+                {
+                    memcpy(&work[0], &src[0], length);
+                    deframe_UT_export(k, out, &work[0], length, packet_sizes[p]);
+                }
+                start = now() - start - refill;
+                start_cycles = cycles() - start_cycles - refill_cycles;
+
+                printf("%8s %6d %8s | %12.1f %12.3f\n", kernel_names[k], packet_sizes[p],
+                       in_place ? "in place" : "copy",
+                       payload * (double)iterations / start / 1e6,
+                       start_cycles ? payload * (double)iterations / start_cycles : 0.0);
+            }
+}
+
+/// Read one round of loopback data, either with ftdi_read_data() or
+/// with ftdi_read_data_submit() and ftdi_transfer_data_done()
+static int read_round(ftdi_context *ftdi, int async, unsigned char *dst, int length,
+                      int size, int *calls)
+{
+    int offset = 0;
+
+    while (offset < length)
+    {
+        int want = (length - offset < size) ? length - offset : size;
+        int ret;
+
+        if (async)
+        {
+            struct ftdi_transfer_control *tc = ftdi_read_data_submit(ftdi, dst + offset, want);
+            ret = tc ? ftdi_transfer_data_done(tc) : -1;
+        }
+        else
+            ret = ftdi_read_data(ftdi, dst + offset, want);
+        if (ret <= 0)
+            return -1;
+        offset += ret;
+        (*calls)++;
+    }
+    return 0;
+}
+
+/// The whole read path against the emulated device: transfer size,
+/// de-framing and the readbuffer bookkeeping between the calls.
+/// Writing the loopback data isn't measured.
+static int run_read_path()
+{
+    static const enum ftdi_chip_type types[] = { TYPE_R, TYPE_232H };
+    static const int chunk_sizes[] = { 4096, 16384 };
+    static const int caller_sizes[] = { 256, 4096, 65536 };
+    const int rounds = 16;
+    int t, c, s, async, r;
+
+    printf("\n%6s %6s %6s %8s | %12s %12s %12s\n", "mode", "packet", "chunk", "bufsize",
+           "ns/byte", "MB/s", "allocs/call");
+
+    for (async = 0; async < 2; async++)
+        for (t = 0; t < 2; t++)
+            for (c = 0; c < 2; c++)
+                for (s = 0; s < 3; s++)
+                {
+                    ftdi_context *ftdi = ftdi_new();
+                    unsigned long allocs = 0;
+                    double seconds = 0;
+                    int calls = 0;
+                    int payload, length;
+
+                    if (ftdi == NULL || ftdi_usb_open_emulated(ftdi, types[t], 1) < 0)
+                    {
+                        fprintf(stderr, "Can't open the emulated device\n");
+                        ftdi_free(ftdi);
+                        return -1;
+                    }
+                    ftdi_set_latency_timer(ftdi, 1);
+                    ftdi_read_data_set_chunksize(ftdi, chunk_sizes[c]);
+
+                    // full packets only, a short one would wait for the latency timer
+                    payload = ftdi->max_packet_size - 2;
+                    length = (1 << 20) / payload * payload;
+
+                    std::vector<unsigned char> src(length), dst(length);
+                    for (r = 0; r < length; r++)
+                        src[r] = r * 7 + r / 251;
+
+                    for (r = 0; r < rounds; r++)
+                    {
+                        unsigned long start_allocs;
+                        double start;
+
+                        ftdi_write_data(ftdi, &src[0], length);
+                        memset(&dst[0], 0, length);
+
+                        start_allocs = allocations;
+                        start = now();
+                        if (read_round(ftdi, async, &dst[0], length, caller_sizes[s], &calls) < 0 ||
+                            memcmp(&src[0], &dst[0], length) != 0)
+                        {
+                            fprintf(stderr, "Read path broken for packet size %d, chunk size %d, "
+                                    "buffer size %d\n", ftdi->max_packet_size, chunk_sizes[c],
+                                    caller_sizes[s]);
+                            ftdi_free(ftdi);
+                            return -1;
+                        }
+                        seconds += now() - start;
+                        allocs += allocations - start_allocs;
+                    }
+
+                    printf("%6s %6d %6d %8d | %12.3f %12.1f ", async ? "async" : "sync",
+                           ftdi->max_packet_size, chunk_sizes[c], caller_sizes[s],
+                           seconds * 1e9 / ((double)length * rounds),
+                           (double)length * rounds / seconds / 1e6);
+#ifdef HAVE_ALLOCATION_COUNT
+                    printf("%12.3f\n", (double)allocs / calls);
+#else
+                    printf("%12s\n", "n/a");
+#endif
+                    ftdi_free(ftdi);
+                }
+
+    return 0;
+}
+
+int main()
+{
+    static const int packet_sizes[] = { 64, 512 };
+    static const int chunk_sizes[] = { 4096, 16384 };
+    static const int caller_sizes[] = { 256, 1 << 20 };
+    const long long bytes_per_run = 256LL << 20;
+    ftdi_context *ftdi = ftdi_new();
+    std::vector<unsigned char> buf_legacy(1 << 20), buf_current(1 << 20);
+    int p, c, s, i;
+
+    if (ftdi == NULL)
+    {
+        fprintf(stderr, "ftdi_new failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%6s %6s %8s | %12s %12s | %12s %12s\n", "packet", "chunk", "bufsize",
+           "old MB/s", "old B/cycle", "new MB/s", "new B/cycle");
+
+    for (p = 0; p < 2; p++)
+        for (c = 0; c < 2; c++)
+            for (s = 0; s < 2; s++)
+            {
+                int packet_size = packet_sizes[p];
+                int chunk_size = chunk_sizes[c];
+                int size = caller_sizes[s];
+                int payload = chunk_size / packet_size * (packet_size - 2);
+                int iterations = bytes_per_run / chunk_size;
+                std::vector<unsigned char> transfer(chunk_size);
+                result old_res, new_res;
+                int old_len, new_len;
+
+                ftdi->max_packet_size = packet_size;
+                ftdi_read_data_set_chunksize(ftdi, chunk_size);
+
+                for (i = 0; i < chunk_size; i++)
+                    transfer[i] = (i % packet_size < 2) ? 0x60 + (i % packet_size) : i * 7;
+
+                // Both implementations have to agree before measuring anything
+                memcpy(ftdi->readbuffer, &transfer[0], chunk_size);
+                old_len = legacy_deframe(ftdi, chunk_size, &buf_legacy[0], size);
+                memcpy(ftdi->readbuffer, &transfer[0], chunk_size);
+                new_len = current_deframe(ftdi, chunk_size, &buf_current[0], size);
+                if (old_len != new_len || memcmp(&buf_legacy[0], &buf_current[0], new_len) != 0)
+                {
+                    fprintf(stderr, "Mismatch for packet size %d, chunk size %d, buffer size %d\n",
+                            packet_size, chunk_size, size);
+                    ftdi_free(ftdi);
+                    return EXIT_FAILURE;
+                }
+
+                old_res = run(ftdi, legacy_deframe, transfer, &buf_legacy[0], size, iterations);
+                new_res = run(ftdi, current_deframe, transfer, &buf_current[0], size, iterations);
+
+                printf("%6d %6d %8d | %12.1f %12.3f | %12.1f %12.3f\n",
+                       packet_size, chunk_size, size,
+                       payload * (double)iterations / old_res.seconds / 1e6,
+                       old_res.cycles ? payload * (double)iterations / old_res.cycles : 0.0,
+                       payload * (double)iterations / new_res.seconds / 1e6,
+                       new_res.cycles ? payload * (double)iterations / new_res.cycles : 0.0);
+            }
+
+    run_kernels();
+
+    ftdi_free(ftdi);
+
+    if (run_read_path() < 0)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+/**@file
+@brief Test the read path of ftdi_read_data()
+
+Feeds synthetic bulk transfers through the modem status byte stripping.
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <ftdi.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+extern "C" int read_data_deframe_UT_export(struct ftdi_context *ftdi, int actual_length,
+                                           unsigned char *buf, int size);
+extern "C" void read_data_adapt_UT_export(struct ftdi_context *ftdi, int requested, int actual_length);
+extern "C" int deframe_iov_UT_export(struct ftdi_iovec *iov, unsigned char *src,
+                                     int length, int packet_size);
+extern "C" int deframe_UT_export(int kernel, unsigned char *dst, const unsigned char *src,
+                                 int length, int packet_size);
+
+/// Basic initialization of libftdi for every test
+class ReadDataFixture
+{
+protected:
+    ftdi_context *ftdi;
+
+public:
+    ReadDataFixture()
+        : ftdi(NULL)
+    {
+        ftdi = ftdi_new();
+        ftdi->max_packet_size = 64;
+    }
+
+    virtual ~ReadDataFixture()
+    {
+        ftdi_free(ftdi);
+        ftdi = NULL;
+    }
+
+    /// Put a transfer of 'length' bytes into the readbuffer.
+    /// Status bytes are 0x11 0x60 (CTS active), payload byte n has the value n & 0xff.
+    void fill_transfer(int length)
+    {
+        int payload = 0;
+        for (int i = 0; i < length; i++)
+        {
+            if (i % ftdi->max_packet_size == 0)
+                ftdi->readbuffer[i] = 0x11;
+            else if (i % ftdi->max_packet_size == 1)
+                ftdi->readbuffer[i] = 0x60;
+            else
+                ftdi->readbuffer[i] = payload++ & 0xff;
+        }
+    }
+};
+
+static void check_payload(const unsigned char *buf, int offset, int length)
+{
+    for (int i = 0; i < length; i++)
+        BOOST_REQUIRE_EQUAL(buf[i], (offset + i) & 0xff);
+}
+
+BOOST_FIXTURE_TEST_SUITE(ReadData, ReadDataFixture)
+
+BOOST_AUTO_TEST_CASE(DeframeFullTransfer)
+{
+    vector<unsigned char> buf(4096);
+
+    // three full packets and a short one
+    fill_transfer(3 * 64 + 10);
+    int res = read_data_deframe_UT_export(ftdi, 3 * 64 + 10, &buf[0], buf.size());
+
+    BOOST_CHECK_EQUAL(3 * 62 + 8, res);
+    check_payload(&buf[0], 0, res);
+    BOOST_CHECK_EQUAL(0U, ftdi->readbuffer_remaining);
+}
+
+BOOST_AUTO_TEST_CASE(DeframeKeepsTail)
+{
+    vector<unsigned char> buf(100);
+
+    fill_transfer(4 * 64);
+    int res = read_data_deframe_UT_export(ftdi, 4 * 64, &buf[0], buf.size());
+
+    BOOST_CHECK_EQUAL(100, res);
+    check_payload(&buf[0], 0, res);
+
+    // the unconsumed payload must be left contiguous in the readbuffer
+    BOOST_REQUIRE_EQUAL(4U * 62 - 100, ftdi->readbuffer_remaining);
+    check_payload(ftdi->readbuffer + ftdi->readbuffer_offset, 100, ftdi->readbuffer_remaining);
+}
+
+BOOST_AUTO_TEST_CASE(DeframeStatusOnly)
+{
+    vector<unsigned char> buf(16);
+
+    fill_transfer(2);
+    BOOST_CHECK_EQUAL(0, read_data_deframe_UT_export(ftdi, 2, &buf[0], buf.size()));
+    BOOST_CHECK_EQUAL(0U, ftdi->readbuffer_remaining);
+}
+
+BOOST_AUTO_TEST_CASE(StatusEvents)
+{
+    vector<unsigned char> buf(4096);
+    ftdi_status_event events[FTDI_STATUS_EVENTS];
+    unsigned short status;
+
+    // overrun error in the third packet, CTS drops in the fourth
+    fill_transfer(4 * 64);
+    ftdi->readbuffer[2 * 64 + 1] |= 0x02;
+    ftdi->readbuffer[3 * 64] = 0x01;
+    read_data_deframe_UT_export(ftdi, 4 * 64, &buf[0], buf.size());
+
+    BOOST_CHECK_EQUAL(0, ftdi_get_modem_status(ftdi, &status));
+    BOOST_CHECK_EQUAL(0x6001, status);
+
+    BOOST_REQUIRE_EQUAL(3, ftdi_read_status_events(ftdi, events, FTDI_STATUS_EVENTS));
+    BOOST_CHECK_EQUAL(0U, events[0].offset);
+    BOOST_CHECK_EQUAL(0x6011, events[0].status);
+    BOOST_CHECK_EQUAL(2U * 62, events[1].offset);
+    BOOST_CHECK_EQUAL(0x6211, events[1].status);
+    BOOST_CHECK_EQUAL(3U * 62, events[2].offset);
+    BOOST_CHECK_EQUAL(0x6001, events[2].status);
+
+    // events are removed once fetched
+    BOOST_CHECK_EQUAL(0, ftdi_read_status_events(ftdi, events, FTDI_STATUS_EVENTS));
+}
+
+BOOST_AUTO_TEST_CASE(ReadAheadNeedsDevice)
+{
+    int depth = -1;
+
+    BOOST_CHECK_EQUAL(-1, ftdi_read_data_set_readahead(ftdi, -1));
+    BOOST_CHECK_EQUAL(-2, ftdi_read_data_set_readahead(ftdi, 4));
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_get_readahead(ftdi, &depth));
+    BOOST_CHECK_EQUAL(0, depth);
+}
+
+BOOST_AUTO_TEST_CASE(ReaderNeedsDevice)
+{
+    unsigned char *data;
+
+    BOOST_CHECK_EQUAL(-1, ftdi_reader_start(ftdi, 0));
+    BOOST_CHECK_EQUAL(-2, ftdi_reader_start(ftdi, 65536));
+    BOOST_CHECK_EQUAL(-1, ftdi_reader_peek(ftdi, &data));
+    BOOST_CHECK_EQUAL(-1, ftdi_reader_consume(ftdi, 0));
+    BOOST_CHECK_EQUAL(-1, ftdi_reader_wait(ftdi, 0));
+    BOOST_CHECK_EQUAL(0, ftdi_reader_stop(ftdi));
+}
+
+BOOST_AUTO_TEST_CASE(ReadUntilNeedsDevice)
+{
+    const unsigned char delim = '\n';
+    unsigned char buf[64];
+
+    BOOST_CHECK_EQUAL(-666, ftdi_read_data_until(ftdi, buf, sizeof(buf), &delim, 1, 0));
+}
+
+BOOST_AUTO_TEST_CASE(AdaptiveTransferSize)
+{
+    unsigned int size;
+
+    ftdi_read_data_set_chunksize(ftdi, 4096);
+    BOOST_CHECK_EQUAL(0, ftdi_read_data_get_transfer_size(ftdi, &size));
+    BOOST_CHECK_EQUAL(4096U, size);
+
+    BOOST_REQUIRE_EQUAL(0, ftdi_read_data_set_adaptive(ftdi, 1));
+
+    // sparse traffic shrinks the transfers down to a single packet
+    for (int i = 0; i < 200; i++)
+    {
+        ftdi_read_data_get_transfer_size(ftdi, &size);
+        read_data_adapt_UT_export(ftdi, size, 2);
+    }
+    ftdi_read_data_get_transfer_size(ftdi, &size);
+    BOOST_CHECK_EQUAL(64U, size);
+
+    // full transfers double the size up to the chunk size
+    read_data_adapt_UT_export(ftdi, 64, 64);
+    ftdi_read_data_get_transfer_size(ftdi, &size);
+    BOOST_CHECK_EQUAL(128U, size);
+
+    // transfers queued before the change don't double it again
+    read_data_adapt_UT_export(ftdi, 64, 64);
+    ftdi_read_data_get_transfer_size(ftdi, &size);
+    BOOST_CHECK_EQUAL(128U, size);
+    for (int i = 0; i < 10; i++)
+    {
+        ftdi_read_data_get_transfer_size(ftdi, &size);
+        read_data_adapt_UT_export(ftdi, size, size);
+    }
+    ftdi_read_data_get_transfer_size(ftdi, &size);
+    BOOST_CHECK_EQUAL(4096U, size);
+
+    // a smaller chunk size limits the transfers right away
+    ftdi_read_data_set_chunksize(ftdi, 1000);
+    ftdi_read_data_get_transfer_size(ftdi, &size);
+    BOOST_CHECK_EQUAL(960U, size);
+}
+
+BOOST_AUTO_TEST_CASE(DeframeVectored)
+{
+    ftdi_iovec iov[8];
+
+    // status bytes only
+    fill_transfer(2);
+    BOOST_CHECK_EQUAL(0, deframe_iov_UT_export(iov, ftdi->readbuffer, 2, 64));
+
+    // three full packets and a short one, pointing into the readbuffer
+    fill_transfer(3 * 64 + 10);
+    int iovcnt = deframe_iov_UT_export(iov, ftdi->readbuffer, 3 * 64 + 10, 64);
+    BOOST_REQUIRE_EQUAL(4, iovcnt);
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_CHECK(iov[i].iov_base == ftdi->readbuffer + i * 64 + 2);
+        BOOST_CHECK_EQUAL(62, iov[i].iov_len);
+        check_payload(iov[i].iov_base, i * 62, 62);
+    }
+    BOOST_CHECK_EQUAL(8, iov[3].iov_len);
+    check_payload(iov[3].iov_base, 3 * 62, 8);
+}
+
+BOOST_AUTO_TEST_CASE(DeframeKernels)
+{
+    static const int packet_sizes[] = { 64, 512 };
+
+    for (int p = 0; p < 2; p++)
+    {
+        ftdi->max_packet_size = packet_sizes[p];
+        ftdi_read_data_set_chunksize(ftdi, 16384);
+
+        // all lengths up to three packets, including a short last packet
+        for (int length = 0; length <= 3 * packet_sizes[p] + 17; length++)
+        {
+            int packets = (length + packet_sizes[p] - 1) / packet_sizes[p];
+            int expected = length - 2 * packets;
+            if (length % packet_sizes[p] == 1)
+                expected += 1;
+
+            for (int kernel = 0; kernel < 3; kernel++)
+            {
+                vector<unsigned char> dst(length + 1);
+
+                fill_transfer(length);
+                int res = deframe_UT_export(kernel, &dst[0], ftdi->readbuffer, length, packet_sizes[p]);
+                if (res < 0)
+                    continue;   // kernel not supported by this CPU
+                BOOST_REQUIRE_EQUAL(expected, res);
+                check_payload(&dst[0], 0, res);
+
+                // in place compaction
+                fill_transfer(length);
+                res = deframe_UT_export(kernel, ftdi->readbuffer, ftdi->readbuffer, length, packet_sizes[p]);
+                BOOST_REQUIRE_EQUAL(expected, res);
+                check_payload(ftdi->readbuffer, 0, res);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
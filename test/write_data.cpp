@@ -0,0 +1,202 @@
+/**@file
+@brief Test the write path configuration of ftdi_write_data()
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <ftdi.h>
+#include <libusb.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+extern "C" int write_datav_gather_UT_export(const struct ftdi_iovec *iov, int iovcnt, int chunksize,
+        unsigned char *out, int *lengths, int *copied, int max_chunks);
+
+/// Basic initialization of libftdi for every test
+class WriteDataFixture
+{
+protected:
+    ftdi_context *ftdi;
+
+public:
+    WriteDataFixture()
+        : ftdi(NULL)
+    {
+        ftdi = ftdi_new();
+    }
+
+    virtual ~WriteDataFixture()
+    {
+        ftdi_free(ftdi);
+        ftdi = NULL;
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(WriteData, WriteDataFixture)
+
+BOOST_AUTO_TEST_CASE(QueueDepth)
+{
+    int depth = 0;
+
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_get_queue_depth(ftdi, &depth));
+    BOOST_CHECK_EQUAL(1, depth);
+
+    BOOST_CHECK_EQUAL(-2, ftdi_write_data_set_queue_depth(ftdi, 0));
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_set_queue_depth(ftdi, 8));
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_get_queue_depth(ftdi, &depth));
+    BOOST_CHECK_EQUAL(8, depth);
+
+    BOOST_CHECK_EQUAL(-1, ftdi_write_data_set_queue_depth(NULL, 8));
+}
+
+BOOST_AUTO_TEST_CASE(WriteNeedsDevice)
+{
+    unsigned char buf[16] = { 0 };
+
+    BOOST_CHECK_EQUAL(-666, ftdi_write_data(ftdi, buf, sizeof(buf)));
+    BOOST_CHECK_EQUAL(-666, ftdi_write_data_flush(ftdi));
+}
+
+static int write_stream_cb(uint8_t *, int, FTDIProgressInfo *, void *)
+{
+    return 0;
+}
+
+BOOST_AUTO_TEST_CASE(WriteStreamNeedsDevice)
+{
+    BOOST_CHECK_EQUAL(-666, ftdi_writestream(ftdi, write_stream_cb, NULL, 8, 16));
+    BOOST_CHECK_EQUAL(-666, ftdi_writestream(NULL, write_stream_cb, NULL, 8, 16));
+}
+
+BOOST_AUTO_TEST_CASE(WriteBufferSetup)
+{
+    BOOST_CHECK_EQUAL(-1, ftdi_write_data_set_buffer(NULL, 64, -1));
+    BOOST_REQUIRE_EQUAL(0, ftdi_write_data_set_buffer(ftdi, 64, -1));
+    BOOST_CHECK(ftdi->write_buffer != NULL);
+    BOOST_CHECK_EQUAL(0U, ftdi->write_buffer_used);
+
+    BOOST_CHECK_EQUAL(0, ftdi_write_data_set_buffer(ftdi, 0, -1));
+    BOOST_CHECK(ftdi->write_buffer == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(GatherChunks)
+{
+    std::vector<unsigned char> frame(4 + 10000 + 2);
+    std::vector<unsigned char> out(frame.size());
+    int lengths[8], copied[8];
+
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = i * 7;
+
+    // header, empty segment, payload, checksum
+    struct ftdi_iovec iov[4] =
+    {
+        { &frame[0], 4 },
+        { NULL, 0 },
+        { &frame[4], 10000 },
+        { &frame[10004], 2 },
+    };
+
+    BOOST_REQUIRE_EQUAL(3, write_datav_gather_UT_export(iov, 4, 4096, &out[0], lengths, copied, 8));
+    BOOST_CHECK(out == frame);
+
+    // the header gets packed with the start of the payload, the middle of
+    // the payload goes out as it is and the rest with the checksum
+    BOOST_CHECK_EQUAL(4096, lengths[0]);
+    BOOST_CHECK_EQUAL(1, copied[0]);
+    BOOST_CHECK_EQUAL(4096, lengths[1]);
+    BOOST_CHECK_EQUAL(0, copied[1]);
+    BOOST_CHECK_EQUAL(1814, lengths[2]);
+    BOOST_CHECK_EQUAL(1, copied[2]);
+
+    BOOST_CHECK_EQUAL(0, write_datav_gather_UT_export(iov, 0, 4096, &out[0], lengths, copied, 8));
+}
+
+BOOST_AUTO_TEST_CASE(WriteDatavNeedsDevice)
+{
+    unsigned char header[2] = { 0x80, 0x08 };
+    unsigned char payload[5] = { 1, 2, 3, 4, 5 };
+    struct ftdi_iovec iov[2] = { { header, 2 }, { payload, 5 } };
+
+    BOOST_CHECK_EQUAL(-666, ftdi_write_datav(ftdi, iov, 2));
+    BOOST_CHECK(ftdi_write_datav_submit(ftdi, iov, 2) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(TransactNeedsDevice)
+{
+    unsigned char cmd[3] = { 0x81, 0x83, 0x87 };
+    unsigned char response[2];
+
+    BOOST_CHECK_EQUAL(-666, ftdi_transact(ftdi, cmd, sizeof(cmd), response, sizeof(response)));
+}
+
+BOOST_AUTO_TEST_CASE(TransferPool)
+{
+    BOOST_CHECK_EQUAL(-1, ftdi_set_transfer_pool(NULL, 2));
+    BOOST_CHECK_EQUAL(-2, ftdi_set_transfer_pool(ftdi, -1));
+    BOOST_REQUIRE_EQUAL(0, ftdi_set_transfer_pool(ftdi, 2));
+    BOOST_CHECK_EQUAL(2, ftdi->tc_pool_count);
+
+    BOOST_CHECK_EQUAL(0, ftdi_set_transfer_pool(ftdi, 0));
+    BOOST_CHECK(ftdi->tc_pool == NULL);
+}
+
+static void count_completion(struct ftdi_transfer_control *tc, int result, void *userdata)
+{
+    int *results = static_cast<int *>(userdata);
+
+    results[0]++;
+    results[1] += result;
+}
+
+BOOST_AUTO_TEST_CASE(CompletionCallback)
+{
+    unsigned char buf[4];
+    int results[2] = { 0, 0 };
+
+    BOOST_CHECK_EQUAL(-1, ftdi_read_data_submit_cb(ftdi, buf, sizeof(buf), count_completion, results));
+    BOOST_CHECK_EQUAL(-1, ftdi_write_data_submit_cb(ftdi, buf, sizeof(buf), count_completion, results));
+    BOOST_CHECK_EQUAL(0, results[0]);
+}
+
+BOOST_AUTO_TEST_CASE(WaitForManyTransfers)
+{
+    struct ftdi_transfer_control *tcs[3] = { NULL, NULL, NULL };
+
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_INVALID_PARAM, ftdi_transfer_data_wait_any(tcs, 3, 0));
+    BOOST_CHECK_EQUAL(LIBUSB_ERROR_INVALID_PARAM, ftdi_transfer_data_wait_all(tcs, 0, 0));
+}
+
+BOOST_AUTO_TEST_CASE(SharedEventLoop)
+{
+    struct ftdi_event_loop *loop = ftdi_event_loop_new();
+    struct ftdi_context *other = ftdi_new();
+
+    BOOST_REQUIRE(loop != NULL && other != NULL);
+
+    BOOST_CHECK_EQUAL(0, ftdi_set_event_loop(ftdi, loop));
+    BOOST_CHECK_EQUAL(0, ftdi_set_event_loop(other, loop));
+    BOOST_CHECK(ftdi->usb_ctx == other->usb_ctx);
+    BOOST_CHECK_EQUAL(-2, ftdi_event_loop_free(loop));
+
+    BOOST_CHECK_EQUAL(0, ftdi_event_loop_start(loop, -1, 0));
+    BOOST_CHECK_EQUAL(-2, ftdi_event_loop_start(loop, -1, 0));
+    BOOST_CHECK_EQUAL(0, ftdi_event_loop_stop(loop));
+
+    // deinit leaves the shared libusb context alone
+    ftdi_free(other);
+    BOOST_CHECK_EQUAL(0, ftdi_set_event_loop(ftdi, NULL));
+    BOOST_CHECK(ftdi->usb_ctx != NULL);
+    BOOST_CHECK_EQUAL(0, ftdi_event_loop_free(loop));
+}
+
+BOOST_AUTO_TEST_SUITE_END()